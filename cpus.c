@@ -356,6 +356,24 @@ void cpu_disable_ticks(void)
                          &timers_state.vm_clock_lock);
 }
 
+/* advance QEMU_CLOCK_VIRTUAL by @delta nanoseconds without waiting, e.g. to
+ * skip over periods in which all CPUs are idle. Only valid without icount,
+ * which has its own warping mechanism.
+ * Caller must hold BQL which serves as mutex for vm_clock_seqlock.
+ */
+void cpu_clock_warp(int64_t delta)
+{
+    assert(!use_icount);
+
+    seqlock_write_lock(&timers_state.vm_clock_seqlock,
+                       &timers_state.vm_clock_lock);
+    timers_state.cpu_clock_offset += delta;
+    seqlock_write_unlock(&timers_state.vm_clock_seqlock,
+                         &timers_state.vm_clock_lock);
+
+    qemu_clock_notify(QEMU_CLOCK_VIRTUAL);
+}
+
 /* Correlation between real and virtual time is always going to be
    fairly approximate, so ignore small variation.
    When the guest is idle real and virtual time will be aligned in
@@ -1437,13 +1455,25 @@ static void deal_with_unplugged_cpus(void)
  * elsewhere.
  */
 
+static bool tcg_vcpu_threads_forked;
+
+static void qemu_tcg_register_vcpu_thread(CPUState *cpu)
+{
+    if (tcg_vcpu_threads_forked) {
+        /* see qemu_tcg_fork_child_vcpus() */
+        tcg_reattach_thread(qemu_tcg_mttcg_enabled() ? cpu->cpu_index : 0);
+    } else {
+        tcg_register_thread();
+    }
+}
+
 static void *qemu_tcg_rr_cpu_thread_fn(void *arg)
 {
     CPUState *cpu = arg;
 
     assert(tcg_enabled());
     rcu_register_thread();
-    tcg_register_thread();
+    qemu_tcg_register_vcpu_thread(cpu);
 
     qemu_mutex_lock_iothread();
     qemu_thread_get_self(cpu->thread);
@@ -1691,7 +1721,7 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     g_assert(!use_icount);
 
     rcu_register_thread();
-    tcg_register_thread();
+    qemu_tcg_register_vcpu_thread(cpu);
 
     qemu_mutex_lock_iothread();
     qemu_thread_get_self(cpu->thread);
@@ -1922,11 +1952,12 @@ void cpu_remove_sync(CPUState *cpu)
 /* For temporary buffers for forming a name */
 #define VCPU_THREAD_NAME_SIZE 16
 
+static QemuCond *single_tcg_halt_cond;
+static QemuThread *single_tcg_cpu_thread;
+
 static void qemu_tcg_init_vcpu(CPUState *cpu)
 {
     char thread_name[VCPU_THREAD_NAME_SIZE];
-    static QemuCond *single_tcg_halt_cond;
-    static QemuThread *single_tcg_cpu_thread;
     static int tcg_region_inited;
 
     assert(tcg_enabled());
@@ -1978,6 +2009,34 @@ static void qemu_tcg_init_vcpu(CPUState *cpu)
     }
 }
 
+/*
+ * Re-create the vCPU threads in a child process after fork(). The child only
+ * inherits the calling thread, the vCPU threads of the parent are gone. The
+ * new threads take over the TCG contexts (and thus the translated code) of
+ * the old ones. Only supported for TCG and while all vCPUs are stopped.
+ * Caller must hold BQL.
+ */
+void qemu_tcg_fork_child_vcpus(void)
+{
+    CPUState *cpu;
+
+    assert(tcg_enabled() && !runstate_is_running());
+
+    tcg_vcpu_threads_forked = true;
+    single_tcg_halt_cond = NULL;
+    single_tcg_cpu_thread = NULL;
+
+    CPU_FOREACH(cpu) {
+        cpu->created = false;
+        cpu->thread_kicked = false;
+        qemu_tcg_init_vcpu(cpu);
+
+        while (!cpu->created) {
+            qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        }
+    }
+}
+
 static void qemu_hax_start_vcpu(CPUState *cpu)
 {
     char thread_name[VCPU_THREAD_NAME_SIZE];
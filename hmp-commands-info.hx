@@ -850,6 +850,20 @@ SRST
     Show Virtual Machine Generation ID
 ERST
 
+    {
+        .name       = "at91-mci",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show AT91 MCI I/O statistics",
+        .cmd        = hmp_info_at91_mci,
+    },
+
+SRST
+  ``info at91-mci``
+    Show I/O statistics of the AT91 MCI (SD card interface of the isis-obc
+    machine): commands, latency histograms and bytes transferred per card.
+ERST
+
     {
         .name       = "memory_size_summary",
         .args_type  = "",
@@ -12,6 +12,7 @@
 #include "at91-aic.h"
 #include "qemu/error-report.h"
 #include "hw/irq.h"
+#include "migration/vmstate.h"
 
 #define AIC_SMR0            0x000
 #define AIC_SMR31           0x07C
@@ -447,12 +448,45 @@ static void aic_device_reset(DeviceState *dev)
     s->line_state = 0;
 }
 
+static const VMStateDescription vmstate_at91_aic_irq_stack_elem = {
+    .name = "at91-aic-irq-stack-elem",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT8(pri, AicIrqStackElem),
+        VMSTATE_UINT8(irq, AicIrqStackElem),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
+static const VMStateDescription vmstate_at91_aic = {
+    .name = "at91-aic",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(reg_smr, AicState, 32),
+        VMSTATE_UINT32_ARRAY(reg_svr, AicState, 32),
+        VMSTATE_UINT32(reg_ipr, AicState),
+        VMSTATE_UINT32(reg_imr, AicState),
+        VMSTATE_UINT32(reg_cisr, AicState),
+        VMSTATE_UINT32(reg_spu, AicState),
+        VMSTATE_UINT32(reg_dcr, AicState),
+        VMSTATE_UINT32(reg_ffsr, AicState),
+        VMSTATE_STRUCT_ARRAY(irq_stack, AicState, 9, 1,
+                             vmstate_at91_aic_irq_stack_elem, AicIrqStackElem),
+        VMSTATE_INT32(irq_stack_pos, AicState),
+        VMSTATE_UINT32(line_state, AicState),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 static void aic_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
 
     dc->realize = aic_device_realize;
     dc->reset = aic_device_reset;
+    dc->vmsd = &vmstate_at91_aic;
 }
 
 static const TypeInfo aic_device_info = {
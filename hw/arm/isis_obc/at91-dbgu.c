@@ -25,6 +25,7 @@
 #include "qemu/log.h"
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
+#include "migration/vmstate.h"
 
 
 #define DEFAULT_CIDR    0x00000000      // TODO(at91.dbgu.chip_id): get actual chip id
@@ -318,6 +319,26 @@ static void dbgu_device_reset(DeviceState *dev)
     dbgu_reset_registers(AT91_DBGU(dev));
 }
 
+static const VMStateDescription vmstate_at91_dbgu = {
+    .name = "at91-dbgu",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(rx_enabled, DbguState),
+        VMSTATE_BOOL(tx_enabled, DbguState),
+        VMSTATE_UINT32(reg_mr, DbguState),
+        VMSTATE_UINT32(reg_imr, DbguState),
+        VMSTATE_UINT32(reg_sr, DbguState),
+        VMSTATE_UINT32(reg_rhr, DbguState),
+        VMSTATE_UINT32(reg_thr, DbguState),
+        VMSTATE_UINT32(reg_brgr, DbguState),
+        VMSTATE_UINT32(reg_cidr, DbguState),
+        VMSTATE_UINT32(reg_exid, DbguState),
+        VMSTATE_UINT32(reg_fnr, DbguState),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 static void dbgu_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -325,6 +346,7 @@ static void dbgu_class_init(ObjectClass *klass, void *data)
     dc->realize = dbgu_device_realize;
     dc->reset = dbgu_device_reset;
     device_class_set_props(dc, dbgu_device_properties);
+    dc->vmsd = &vmstate_at91_dbgu;
 }
 
 static const TypeInfo dbgu_device_info = {
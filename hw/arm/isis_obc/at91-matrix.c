@@ -15,6 +15,7 @@
 
 #include "at91-matrix.h"
 #include "qemu/error-report.h"
+#include "migration/vmstate.h"
 
 #define MATRIX_MCFG0        0x000
 #define MATRIX_MCFG4        0x010
@@ -210,12 +211,28 @@ static void matrix_device_reset(DeviceState *dev)
     matrix_bootmem_update(s);
 }
 
+static const VMStateDescription vmstate_at91_matrix = {
+    .name = "at91-matrix",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(reg_mcfg, MatrixState, 6),
+        VMSTATE_UINT32_ARRAY(reg_scfg, MatrixState, 5),
+        VMSTATE_UINT32_ARRAY(reg_pras, MatrixState, 5),
+        VMSTATE_UINT32(reg_mrcr, MatrixState),
+        VMSTATE_UINT32(reg_ebi_csa, MatrixState),
+        VMSTATE_BOOL(bms, MatrixState),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 static void matrix_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
 
     dc->realize = matrix_device_realize;
     dc->reset = matrix_device_reset;
+    dc->vmsd = &vmstate_at91_matrix;
 }
 
 static const TypeInfo matrix_device_info = {
@@ -30,12 +30,21 @@
 //   of detail
 
 #include "at91-mci.h"
+#include "iobc-idle_warp.h"
+#include "ioxfer-replay.h"
 #include "exec/address-spaces.h"
 #include "qapi/error.h"
+#include "qapi/qapi-commands-misc.h"
 #include "qemu/error-report.h"
+#include "qemu/host-utils.h"
+#include "qemu/timer.h"
+#include "sysemu/block-backend.h"
 #include "sysemu/blockdev.h"
+#include "sysemu/cpus.h"
+#include "sysemu/replay.h"
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
+#include "migration/vmstate.h"
 
 #define MCI_CR          0x00
 #define MCI_MR          0x04
@@ -145,13 +154,44 @@ enum cmdr_iospcmd {
 #define SR_OVRE         BIT(30)
 #define SR_UNRE         BIT(31)
 
-#define BLKLEN_MULTIBLOCK_UNLIMITED   ((size_t)-1)
+#define BLKLEN_MULTIBLOCK_UNLIMITED   UINT64_MAX
 
 
 static void mci_reset_registers(MciState *s);
 
+static void mci_stats_command_done(MciState *s)
+{
+    MciCardStats *st = &s->stats.card[s->stats.pending_card];
+    int64_t us = (qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) - s->stats.pending_start) / SCALE_US;
+    unsigned bucket = us > 0 ? 64 - clz64(us) : 0;
+
+    if (bucket >= AT91_MCI_LATENCY_BUCKETS)
+        bucket = AT91_MCI_LATENCY_BUCKETS - 1;
+
+    st->cmd_latency[s->stats.pending_cmd][bucket] += 1;
+    s->stats.pending = false;
+}
+
+static void mci_stats_command_start(MciState *s, uint8_t cmd)
+{
+    // a command not done yet ends with the next one (e.g. open-ended reads)
+    if (s->stats.pending)
+        mci_stats_command_done(s);
+
+    s->stats.card[s->selected_card].cmd_count[cmd] += 1;
+
+    s->stats.pending = true;
+    s->stats.pending_cmd = cmd;
+    s->stats.pending_card = s->selected_card;
+    s->stats.pending_start = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+}
+
 static void mci_irq_update(MciState *s)
 {
+    // every change of the status register goes through here
+    if (s->stats.pending && (s->reg_sr & (SR_NOTBUSY | SR_DTIP)) == SR_NOTBUSY)
+        mci_stats_command_done(s);
+
     qemu_set_irq(s->irq, !!(s->reg_sr & s->reg_imr));
 }
 
@@ -166,140 +206,355 @@ void at91_mci_set_master_clock(MciState *s, unsigned mclk)
     mci_update_mcck(s);
 }
 
+static inline SDBus *mci_get_sdcard(MciState *s, uint8_t card)
+{
+    return card == 0 ? &s->sdbus0 : &s->sdbus1;
+}
+
 static inline SDBus *mci_get_selected_sdcard(MciState *s)
 {
-    return s->selected_card == 0 ? &s->sdbus0 : &s->sdbus1;
+    return mci_get_sdcard(s, s->selected_card);
 }
 
 
-static void mci_pdc_do_read_rcr(MciState *s)
+static void mci_sd_transfer(SDBus *sd, uint8_t *buf, size_t len, bool read)
 {
-    SDBus *sd = mci_get_selected_sdcard(s);
+    if (read) {
+        for (size_t i = 0; i < len; i++)
+            buf[i] = sdbus_read_data(sd);
+    } else {
+        for (size_t i = 0; i < len; i++)
+            sdbus_write_data(sd, buf[i]);
+    }
+}
 
-    size_t len = s->pdc.reg_rcr;
-    if (!(s->reg_mr & MR_PDCFBYTE))
-        len *= 4;
+static void mci_pdc_transfer(SDBus *sd, hwaddr addr, size_t len, bool read)
+{
+    // transfer directly between SD card and guest memory
+    while (len) {
+        hwaddr maplen = len;
+        uint8_t *buf;
+
+        buf = address_space_map(&address_space_memory, addr, &maplen, read,
+                                MEMTXATTRS_UNSPECIFIED);
+
+        if (!buf) {
+            // not mappable right now (e.g. bounce buffer in use), go via a
+            // temporary buffer
+            maplen = len;
+            buf = g_malloc(maplen);
+
+            if (!read && address_space_rw(&address_space_memory, addr,
+                                          MEMTXATTRS_UNSPECIFIED, buf, maplen, false)) {
+                error_report("at91.mci: failed to read memory");
+                abort();
+            }
 
-    if (len > s->rd_bytes_left)
-        len = s->rd_bytes_left;
+            mci_sd_transfer(sd, buf, maplen, read);
 
-    uint8_t *data = g_new0(uint8_t, len);
+            if (read && address_space_rw(&address_space_memory, addr,
+                                         MEMTXATTRS_UNSPECIFIED, buf, maplen, true)) {
+                error_report("at91.mci: failed to write memory");
+                abort();
+            }
 
-    // read from SD card to buffer
-    if (!sdbus_data_ready(sd)) {
-        error_report("at91.mci: sd card has no data available for read");
-        abort();
+            g_free(buf);
+        } else {
+            mci_sd_transfer(sd, buf, maplen, read);
+            address_space_unmap(&address_space_memory, buf, maplen, read, maplen);
+        }
+
+        addr += maplen;
+        len -= maplen;
     }
+}
+
+static void mci_pdc_resume(MciState *s);
+static void mci_pdc_buffer_done(MciState *s);
+static bool mci_io_run(MciState *s);
 
-    for (size_t i = 0; i < len; i++) {
-        data[i] = sdbus_read_data(sd);
+static void mci_io_complete(void *opaque, int ret)
+{
+    MciState *s = opaque;
+
+    s->io.aiocb = NULL;
+    s->io.busy = false;
+    qemu_sglist_destroy(&s->io.sg);
+    iobc_idle_warp_release();
+
+    // as on the byte-wise path: report, the data is undefined
+    if (ret < 0) {
+        error_report("at91.mci: %s error on host side: %s",
+                     s->io.read ? "read" : "write", strerror(-ret));
     }
 
-    // copy buffer to DMA memory
-    MemTxResult result = address_space_rw(&address_space_memory, s->pdc.reg_rpr,
-                                          MEMTXATTRS_UNSPECIFIED, data, len, true);
-    if (result) {
-        error_report("at91.mci: failed to write memory: %d", result);
-        abort();
+    s->io.addr += s->io.count;
+    s->io.len -= s->io.count;
+
+    if (!mci_io_run(s))
+        return;
+
+    mci_pdc_buffer_done(s);
+    mci_pdc_resume(s);
+}
+
+static void mci_io_submit(MciState *s)
+{
+    // the guest typically idles until completion, don't warp past it
+    iobc_idle_warp_hold();
+
+    qemu_sglist_init(&s->io.sg, DEVICE(s), 1, &address_space_memory);
+    qemu_sglist_add(&s->io.sg, s->io.addr, s->io.count);
+
+    if (s->io.read) {
+        s->io.aiocb = dma_blk_read(s->io.blk, &s->io.sg, s->io.offset, 1,
+                                   mci_io_complete, s);
+    } else {
+        s->io.aiocb = dma_blk_write(s->io.blk, &s->io.sg, s->io.offset, 1,
+                                    mci_io_complete, s);
+    }
+}
+
+// Transfer a partial block (or data of a transfer the card does not do
+// block-wise) byte by byte, using a single mapping of guest memory, until the
+// card reaches the next block boundary. Returns the number of bytes
+// transferred. Blocks claimed at that boundary are returned via n, blk and
+// offset, zero if there are none.
+static size_t mci_io_partial(MciState *s, SDBus *sd, size_t *n, BlockBackend **blk,
+                             uint64_t *offset)
+{
+    hwaddr maplen = s->io.len;
+    uint8_t *buf;
+    size_t i;
+
+    *n = 0;
+
+    buf = address_space_map(&address_space_memory, s->io.addr, &maplen, s->io.read,
+                            MEMTXATTRS_UNSPECIFIED);
+
+    if (!buf) {
+        // not mappable right now (e.g. bounce buffer in use)
+        mci_pdc_transfer(sd, s->io.addr, 1, s->io.read);
+        return 1;
     }
 
-    g_free(data);
+    for (i = 0; i < maplen; i++) {
+        if (i && (*n = sdbus_claim_blocks(sd, !s->io.read, s->io.len - i, blk, offset)))
+            break;
 
-    s->pdc.reg_rpr += len;
-    s->pdc.reg_rcr -= (s->reg_mr & MR_PDCFBYTE) ? len : len / 4;
+        if (s->io.read)
+            buf[i] = sdbus_read_data(sd);
+        else
+            sdbus_write_data(sd, buf[i]);
+    }
 
-    if (s->rd_bytes_left != BLKLEN_MULTIBLOCK_UNLIMITED)
-        s->rd_bytes_left -= len;
+    address_space_unmap(&address_space_memory, buf, maplen, s->io.read, i);
+    return i;
 }
 
-static void mci_pdc_do_read(MciState *s)
+// Completion of asynchronous requests depends on the host, which breaks
+// deterministic execution with icount, record/replay and IOX trace replay.
+static bool mci_io_sync(void)
 {
-    if (s->pdc.reg_rcr)
-        mci_pdc_do_read_rcr(s);
+    return use_icount || replay_mode != REPLAY_MODE_NONE || iox_replay_path();
+}
 
-    if (s->pdc.reg_rcr == 0)
-        s->reg_sr |= SR_ENDRX;
+// Transfer the claimed blocks synchronously, see mci_io_sync().
+static void mci_io_run_sync(MciState *s)
+{
+    uint8_t *buf = g_malloc(s->io.count);
+    int ret;
 
-    if (s->pdc.reg_rcr == 0 && s->pdc.reg_rncr != 0) {
-        s->pdc.reg_rcr = s->pdc.reg_rncr;
-        s->pdc.reg_rncr = 0;
+    if (s->io.read) {
+        ret = blk_pread(s->io.blk, s->io.offset, buf, s->io.count);
+        address_space_write(&address_space_memory, s->io.addr, MEMTXATTRS_UNSPECIFIED,
+                            buf, s->io.count);
+    } else {
+        address_space_read(&address_space_memory, s->io.addr, MEMTXATTRS_UNSPECIFIED,
+                           buf, s->io.count);
+        ret = blk_pwrite(s->io.blk, s->io.offset, buf, s->io.count, 0);
+    }
 
-        s->pdc.reg_rpr = s->pdc.reg_rnpr;
-        s->pdc.reg_rnpr = 0;
+    if (ret < 0) {
+        error_report("at91.mci: %s error on host side: %s",
+                     s->io.read ? "read" : "write", strerror(-ret));
+    }
 
-        if (s->rd_bytes_left)
-            mci_pdc_do_read_rcr(s);
+    g_free(buf);
+
+    s->io.addr += s->io.count;
+    s->io.len -= s->io.count;
+}
+
+// Continue the transfer of the current PDC buffer. Returns true if the
+// buffer is complete, false if a request is in flight, in which case the
+// transfer continues from its completion. The transfer stays on the card it
+// has been started on, even if another card is selected in the meantime.
+static bool mci_io_run(MciState *s)
+{
+    SDBus *sd = mci_get_sdcard(s, s->io.card);
+
+    if (!s->block_io) {
+        mci_pdc_transfer(sd, s->io.addr, s->io.len, s->io.read);
+        s->io.addr += s->io.len;
+        s->io.len = 0;
+        return true;
     }
 
-    if (s->rd_bytes_left == 0) {
-        s->reg_sr &= ~(SR_DTIP | SR_RXRDY);
+    while (s->io.len) {
+        BlockBackend *blk;
+        uint64_t offset;
+        size_t n;
+
+        n = sdbus_claim_blocks(sd, !s->io.read, s->io.len, &blk, &offset);
+        if (!n) {
+            size_t done = mci_io_partial(s, sd, &n, &blk, &offset);
+
+            s->io.addr += done;
+            s->io.len -= done;
+
+            if (!n)
+                continue;
+        }
+
+        s->stats.card[s->io.card].blk_requests += 1;
+        s->io.blk = blk;
+        s->io.offset = offset;
+        s->io.count = n;
+
+        if (mci_io_sync()) {
+            mci_io_run_sync(s);
+            continue;
+        }
+
+        s->io.busy = true;
+        mci_io_submit(s);
+        return false;
     }
 
-    if (s->pdc.reg_rcr == 0 && s->pdc.reg_rncr == 0) {
-        s->reg_sr |= SR_RXBUFF;
-        s->rx_dma_enabled = false;
+    return true;
+}
 
-        if (s->rd_bytes_left)
-            s->reg_sr |= SR_RXRDY;
+static void mci_io_drain(MciState *s)
+{
+    // completion may start the next request of the transfer
+    while (s->io.aiocb)
+        blk_drain(s->io.blk);
+}
+
+static void mci_io_vm_state_change(void *opaque, int running, RunState state)
+{
+    MciState *s = opaque;
+
+    // a request in flight during migration is issued again on the destination
+    if (running && s->io.busy && !s->io.aiocb) {
+        s->io.blk = s->io.card == 0 ? s->blk0 : s->blk1;
+        mci_io_submit(s);
     }
 }
 
-static void mci_pdc_do_write_tcr(MciState *s)
+
+static bool mci_pdc_buffer_start(MciState *s, bool read, bool second)
 {
     SDBus *sd = mci_get_selected_sdcard(s);
+    uint64_t left = read ? s->rd_bytes_left : s->wr_bytes_left;
+    size_t len = read ? s->pdc.reg_rcr : s->pdc.reg_tcr;
 
-    size_t len = s->pdc.reg_tcr;
     if (!(s->reg_mr & MR_PDCFBYTE))
         len *= 4;
 
-    if (len > s->wr_bytes_left)
-        len = s->wr_bytes_left;
-
-    uint8_t *data = g_new0(uint8_t, len);
+    if (len > left)
+        len = left;
 
-    // read DMA memory into buffer
-    MemTxResult result = address_space_rw(&address_space_memory, s->pdc.reg_tpr,
-                                          MEMTXATTRS_UNSPECIFIED, data, len, false);
-    if (result) {
-        error_report("at91.mci: failed to read memory: %d", result);
+    if (read && !sdbus_data_ready(sd)) {
+        error_report("at91.mci: sd card has no data available for read");
         abort();
     }
 
-    // write buffer to SD card
-    for (size_t i = 0; i < len; i++) {
-        sdbus_write_data(sd, data[i]);
-    }
+    s->io.read = read;
+    s->io.second = second;
+    s->io.card = s->selected_card;
+    s->io.addr = read ? s->pdc.reg_rpr : s->pdc.reg_tpr;
+    s->io.len = len;
+    s->io.total = len;
+    s->io.units = (s->reg_mr & MR_PDCFBYTE) ? len : len / 4;
+
+    if (!mci_io_run(s))
+        return false;
+
+    mci_pdc_buffer_done(s);
+    return true;
+}
+
+static void mci_pdc_buffer_done(MciState *s)
+{
+    MciCardStats *st = &s->stats.card[s->io.card];
+
+    if (s->io.read) {
+        st->pdc_read_bytes += s->io.total;
 
-    g_free(data);
+        s->pdc.reg_rpr += s->io.total;
+        s->pdc.reg_rcr -= s->io.units;
+
+        if (s->rd_bytes_left != BLKLEN_MULTIBLOCK_UNLIMITED)
+            s->rd_bytes_left -= s->io.total;
+    } else {
+        st->pdc_write_bytes += s->io.total;
 
-    s->pdc.reg_tpr += len;
-    s->pdc.reg_tcr -= (s->reg_mr & MR_PDCFBYTE) ? len : len / 4;
+        s->pdc.reg_tpr += s->io.total;
+        s->pdc.reg_tcr -= s->io.units;
 
-    if (s->wr_bytes_left != BLKLEN_MULTIBLOCK_UNLIMITED)
-        s->wr_bytes_left -= len;
+        if (s->wr_bytes_left != BLKLEN_MULTIBLOCK_UNLIMITED)
+            s->wr_bytes_left -= s->io.total;
 
-    s->wr_bytes_blk = (s->wr_bytes_blk + len) % BLKR_BLKLEN(s);
+        s->wr_bytes_blk = (s->wr_bytes_blk + s->io.total) % BLKR_BLKLEN(s);
+    }
 }
 
-static void mci_pdc_do_write(MciState *s)
+static void mci_pdc_read_finish(MciState *s)
 {
-    if (s->pdc.reg_tcr)
-        mci_pdc_do_write_tcr(s);
+    if (s->rd_bytes_left == 0) {
+        s->reg_sr &= ~(SR_DTIP | SR_RXRDY);
+    }
 
-    if (s->pdc.reg_tcr == 0)
-        s->reg_sr |= SR_ENDTX;
+    if (s->pdc.reg_rcr == 0 && s->pdc.reg_rncr == 0) {
+        s->reg_sr |= SR_RXBUFF;
+        s->rx_dma_enabled = false;
 
-    if (s->pdc.reg_tcr == 0 && s->pdc.reg_tncr != 0) {
-        s->pdc.reg_tcr = s->pdc.reg_tncr;
-        s->pdc.reg_tncr = 0;
+        if (s->rd_bytes_left)
+            s->reg_sr |= SR_RXRDY;
+    }
+}
 
-        s->pdc.reg_tpr = s->pdc.reg_tnpr;
-        s->pdc.reg_tnpr = 0;
+static void mci_pdc_read_next(MciState *s)
+{
+    if (s->pdc.reg_rcr == 0)
+        s->reg_sr |= SR_ENDRX;
 
-        if (s->wr_bytes_left)
-            mci_pdc_do_write_tcr(s);
+    if (s->pdc.reg_rcr == 0 && s->pdc.reg_rncr != 0) {
+        s->pdc.reg_rcr = s->pdc.reg_rncr;
+        s->pdc.reg_rncr = 0;
+
+        s->pdc.reg_rpr = s->pdc.reg_rnpr;
+        s->pdc.reg_rnpr = 0;
+
+        if (s->rd_bytes_left && !mci_pdc_buffer_start(s, true, true))
+            return;
     }
 
+    mci_pdc_read_finish(s);
+}
+
+static void mci_pdc_do_read(MciState *s)
+{
+    if (s->pdc.reg_rcr && !mci_pdc_buffer_start(s, true, false))
+        return;
+
+    mci_pdc_read_next(s);
+}
+
+static void mci_pdc_write_finish(MciState *s)
+{
     if (s->wr_bytes_left == 0) {
         // Note: In PDC mode, BLKE is set for the last block transferred.
         s->reg_sr |= SR_NOTBUSY | SR_BLKE;
@@ -319,8 +574,50 @@ static void mci_pdc_do_write(MciState *s)
     }
 }
 
+static void mci_pdc_write_next(MciState *s)
+{
+    if (s->pdc.reg_tcr == 0)
+        s->reg_sr |= SR_ENDTX;
+
+    if (s->pdc.reg_tcr == 0 && s->pdc.reg_tncr != 0) {
+        s->pdc.reg_tcr = s->pdc.reg_tncr;
+        s->pdc.reg_tncr = 0;
+
+        s->pdc.reg_tpr = s->pdc.reg_tnpr;
+        s->pdc.reg_tnpr = 0;
+
+        if (s->wr_bytes_left && !mci_pdc_buffer_start(s, false, true))
+            return;
+    }
+
+    mci_pdc_write_finish(s);
+}
+
+static void mci_pdc_do_write(MciState *s)
+{
+    if (s->pdc.reg_tcr && !mci_pdc_buffer_start(s, false, false))
+        return;
+
+    mci_pdc_write_next(s);
+}
+
+static void mci_pdc_resume(MciState *s)
+{
+    // a buffer has been completed asynchronously, continue where its
+    // transfer has been started
+    if (s->io.read && !s->io.second)
+        mci_pdc_read_next(s);
+    else if (s->io.read)
+        mci_pdc_read_finish(s);
+    else if (!s->io.second)
+        mci_pdc_write_next(s);
+    else
+        mci_pdc_write_finish(s);
+
+    mci_irq_update(s);
+}
 
-static size_t mci_tr_length(MciState *s, uint32_t cmdr)
+static uint64_t mci_tr_length(MciState *s, uint32_t cmdr)
 {
     switch (CMDR_TRTYP(cmdr)) {
     case CMDR_TRTYP_MMCSD_SINGLE_BLOCK:
@@ -330,13 +627,13 @@ static size_t mci_tr_length(MciState *s, uint32_t cmdr)
         if (BLKR_BCNT(s) == 0)          // infinite block transfer
             return BLKLEN_MULTIBLOCK_UNLIMITED;
         else                            // finite block transfer
-            return ((size_t)BLKR_BLKLEN(s)) * ((size_t)BLKR_BCNT(s));
+            return ((uint64_t)BLKR_BLKLEN(s)) * ((uint64_t)BLKR_BCNT(s));
 
     case CMDR_TRTYP_SDIO_BYTE:
         return BLKR_BCNT(s);
 
     case CMDR_TRTYP_SDIO_BLOCK:
-        return ((size_t)BLKR_BLKLEN(s)) * ((size_t)BLKR_BCNT(s));
+        return ((uint64_t)BLKR_BLKLEN(s)) * ((uint64_t)BLKR_BCNT(s));
 
     case CMDR_TRTYP_MMC_STREAM:
         error_report("at91.mci: MMC stream data transfer not supported");
@@ -405,6 +702,8 @@ static void mci_do_command(MciState *s, uint32_t cmdr)
     // clear flag for documentation, even though commands are instant in emulation
     s->reg_sr &= ~SR_CMDRDY;
 
+    mci_stats_command_start(s, CMDR_CMDNB(cmdr));
+
     if (CMDR_RSPTYP(cmdr) == CMDR_RSPTYP_NORSP) {
         rlen_expected = 0;
     } else if (CMDR_RSPTYP(cmdr) == CMDR_RSPTYP_48bit) {
@@ -532,6 +831,7 @@ static uint32_t mci_rdr(MciState *s)
         ((uint8_t *)&buf)[i] = sdbus_read_data(sd);
     }
     s->rd_bytes_left -= len;
+    s->stats.card[s->selected_card].reg_read_bytes += len;
 
     if (s->rd_bytes_left == 0) {
         s->reg_sr &= ~SR_DTIP;
@@ -578,6 +878,7 @@ static void mci_tdr(MciState *s, uint32_t data)
         sdbus_write_data(sd, ((uint8_t *)&data)[i]);
     }
     s->wr_bytes_left -= len;
+    s->stats.card[s->selected_card].reg_write_bytes += len;
     s->wr_bytes_blk += len;
 
     // On writes, check for full block transfers and set BLKE accordingly.
@@ -694,11 +995,13 @@ static uint64_t mci_mmio_read(void *opaque, hwaddr offset, unsigned size)
         }
 
     case MCI_RDR:
+        mci_io_drain(s);
         return mci_rdr(s);
 
     case MCI_SR:
         {
             uint32_t sr = s->reg_sr;
+            s->stats.sr_reads += 1;
             s->reg_sr &= ~(SR_BLKE | SR_DCRCE | SR_DTOE | SR_SDIOIRQA | SR_SDIOIRQB);
             mci_irq_update(s);
             return sr;
@@ -720,6 +1023,21 @@ static void mci_mmio_write(void *opaque, hwaddr offset, uint64_t value, unsigned
 {
     MciState *s = opaque;
 
+    // the next buffer may be set up while the current one is in flight
+    switch (offset) {
+    case MCI_IER:
+    case MCI_IDR:
+    case PDC_RNPR:
+    case PDC_RNCR:
+    case PDC_TNPR:
+    case PDC_TNCR:
+        break;
+
+    default:
+        mci_io_drain(s);
+        break;
+    }
+
     switch (offset)  {
     case MCI_CR:
         if ((value & CR_MCIEN) && !(value & CR_MCIDIS)) {
@@ -923,6 +1241,10 @@ static void mci_device_realize(DeviceState *dev, Error **errp)
     qdev_prop_set_drive(sd1, "drive", blk1, &error_abort);
     qdev_init_nofail(sd1);
 
+    s->blk0 = blk0;
+    s->blk1 = blk1;
+    s->vmstate = qemu_add_vm_change_state_handler(mci_io_vm_state_change, s);
+
     mci_reset_registers(s);
     s->selected_card = 0;
     s->rx_dma_enabled = false;
@@ -932,15 +1254,136 @@ static void mci_device_realize(DeviceState *dev, Error **errp)
 static void mci_device_reset(DeviceState *dev)
 {
     MciState *s = AT91_MCI(dev);
+
+    mci_io_drain(s);
+    memset(&s->io, 0, sizeof(s->io));
+
     mci_reset_registers(s);
 }
 
+static const VMStateDescription vmstate_at91_mci = {
+    .name = "at91-mci",
+    .version_id = 2,
+    .minimum_version_id = 2,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(mclk, MciState),
+        VMSTATE_UINT32(mcck, MciState),
+        VMSTATE_UINT32(reg_mr, MciState),
+        VMSTATE_UINT32(reg_dtor, MciState),
+        VMSTATE_UINT32(reg_sdcr, MciState),
+        VMSTATE_UINT32(reg_argr, MciState),
+        VMSTATE_UINT32(reg_blkr, MciState),
+        VMSTATE_UINT32(reg_sr, MciState),
+        VMSTATE_UINT32(reg_imr, MciState),
+        VMSTATE_UINT32_ARRAY(reg_rspr, MciState, 4),
+        VMSTATE_UINT8(reg_rspr_index, MciState),
+        VMSTATE_UINT8(reg_rspr_len, MciState),
+        VMSTATE_BOOL(mcien, MciState),
+        VMSTATE_BOOL(pwsen, MciState),
+        VMSTATE_UINT8(selected_card, MciState),
+        VMSTATE_UINT64(rd_bytes_left, MciState),
+        VMSTATE_UINT64(wr_bytes_left, MciState),
+        VMSTATE_UINT64(wr_bytes_blk, MciState),
+        VMSTATE_AT91_PDC(pdc, MciState),
+        VMSTATE_BOOL(rx_dma_enabled, MciState),
+        VMSTATE_BOOL(tx_dma_enabled, MciState),
+        VMSTATE_BOOL(io.read, MciState),
+        VMSTATE_BOOL(io.second, MciState),
+        VMSTATE_UINT32(io.addr, MciState),
+        VMSTATE_UINT32(io.len, MciState),
+        VMSTATE_UINT32(io.total, MciState),
+        VMSTATE_UINT32(io.units, MciState),
+        VMSTATE_BOOL(io.busy, MciState),
+        VMSTATE_UINT8(io.card, MciState),
+        VMSTATE_UINT64(io.offset, MciState),
+        VMSTATE_UINT32(io.count, MciState),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
+
+static At91MciCardStats *mci_query_card(MciState *s, uint8_t slot)
+{
+    MciCardStats *st = &s->stats.card[slot];
+    At91MciCardStats *info = g_new0(At91MciCardStats, 1);
+    At91MciCommandStatsList **cmd_tail = &info->commands;
+
+    info->slot = slot;
+    info->pdc_read_bytes = st->pdc_read_bytes;
+    info->pdc_write_bytes = st->pdc_write_bytes;
+    info->reg_read_bytes = st->reg_read_bytes;
+    info->reg_write_bytes = st->reg_write_bytes;
+    info->block_requests = st->blk_requests;
+
+    for (unsigned cmd = 0; cmd < AT91_MCI_NUM_CMDS; cmd++) {
+        At91MciCommandStatsList *entry;
+        uint64List **lat_tail;
+
+        if (!st->cmd_count[cmd])
+            continue;
+
+        entry = g_new0(At91MciCommandStatsList, 1);
+        entry->value = g_new0(At91MciCommandStats, 1);
+        entry->value->index = cmd;
+        entry->value->count = st->cmd_count[cmd];
+
+        lat_tail = &entry->value->latency;
+        for (unsigned i = 0; i < AT91_MCI_LATENCY_BUCKETS; i++) {
+            *lat_tail = g_new0(uint64List, 1);
+            (*lat_tail)->value = st->cmd_latency[cmd][i];
+            lat_tail = &(*lat_tail)->next;
+        }
+
+        *cmd_tail = entry;
+        cmd_tail = &entry->next;
+    }
+
+    return info;
+}
+
+At91MciStats *qmp_query_at91_mci(Error **errp)
+{
+    Object *obj = object_resolve_path_type("", TYPE_AT91_MCI, NULL);
+    At91MciCardStatsList *cards = NULL;
+    At91MciStats *info;
+    MciState *s;
+
+    if (!obj) {
+        error_setg(errp, "no %s device found", TYPE_AT91_MCI);
+        return NULL;
+    }
+
+    s = AT91_MCI(obj);
+
+    for (int slot = 1; slot >= 0; slot--) {
+        At91MciCardStatsList *entry = g_new0(At91MciCardStatsList, 1);
+
+        entry->value = mci_query_card(s, slot);
+        entry->next = cards;
+        cards = entry;
+    }
+
+    info = g_new0(At91MciStats, 1);
+    info->sr_reads = s->stats.sr_reads;
+    info->cards = cards;
+
+    return info;
+}
+
+
+static Property mci_device_properties[] = {
+    DEFINE_PROP_BOOL("block-io", MciState, block_io, true),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void mci_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
 
     dc->realize = mci_device_realize;
     dc->reset = mci_device_reset;
+    device_class_set_props(dc, mci_device_properties);
+    dc->vmsd = &vmstate_at91_mci;
 }
 
 static const TypeInfo mci_device_info = {
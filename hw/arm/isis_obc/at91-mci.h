@@ -7,6 +7,29 @@
  * "select" GPIO pin. Only slot A is used, thus slot B is not implemented.
  * Furthermore, only SD-cards are supported.
  *
+ * PDC transfers move whole blocks directly between the block backend of the
+ * card and guest memory, only partial blocks and register-mode transfers
+ * (RDR/TDR) go through the byte-wise SD card interface. The "block-io"
+ * property (default on) can be used to force the byte-wise path for PDC
+ * transfers as well, e.g. for comparison.
+ *
+ * Block I/O of PDC transfers is asynchronous: the blocks are claimed from the
+ * card, the request is issued on the block backend, and the vCPU continues.
+ * While a request is in flight, DTIP stays set and NOTBUSY cleared; ENDRX,
+ * ENDTX, RXBUFF, TXBUFE and BLKE are raised once it has completed. Guest
+ * accesses that would observe or change the transfer (commands, PDC pointer
+ * and control registers, RDR/TDR, reset) wait for the request to complete.
+ * Idle-warp (see iobc-idle_warp.h) is held off while a request is in flight.
+ * With icount, record/replay or IOX trace replay, the blocks are transferred
+ * synchronously instead, keeping execution deterministic.
+ *
+ * For diagnosing the I/O pattern of the guest, the MCI keeps statistics per
+ * card slot: commands per index, bytes moved via PDC and RDR/TDR, block
+ * requests issued, and histograms of the virtual time from issuing a command
+ * until it is done (NOTBUSY set and DTIP cleared, or the next command
+ * issued). They can be queried via QMP (query-at91-mci) and HMP
+ * (info at91-mci), and are not reset with the device.
+ *
  * See at91-mci.c for implementation status.
  *
  * Copyright (c) 2019-2020 KSat e.V. Stuttgart
@@ -21,12 +44,29 @@
 #include "qemu/osdep.h"
 #include "hw/sysbus.h"
 #include "hw/sd/sd.h"
+#include "sysemu/dma.h"
+#include "sysemu/runstate.h"
 #include "at91-pdc.h"
 
 
 #define TYPE_AT91_MCI "at91-mci"
 #define AT91_MCI(obj) OBJECT_CHECK(MciState, (obj), TYPE_AT91_MCI)
 
+#define AT91_MCI_NUM_CMDS           64
+#define AT91_MCI_LATENCY_BUCKETS    20      // <1us, <2us, ..., >=2^18us
+
+
+typedef struct {
+    uint64_t cmd_count[AT91_MCI_NUM_CMDS];
+    uint64_t cmd_latency[AT91_MCI_NUM_CMDS][AT91_MCI_LATENCY_BUCKETS];
+
+    uint64_t pdc_read_bytes;
+    uint64_t pdc_write_bytes;
+    uint64_t reg_read_bytes;
+    uint64_t reg_write_bytes;
+    uint64_t blk_requests;
+} MciCardStats;
+
 
 typedef struct {
     SysBusDevice parent_obj;
@@ -36,6 +76,10 @@ typedef struct {
 
     SDBus sdbus0;
     SDBus sdbus1;
+    BlockBackend *blk0;
+    BlockBackend *blk1;
+
+    bool block_io;
 
     unsigned mclk;
     unsigned mcck;
@@ -56,13 +100,45 @@ typedef struct {
 
     uint8_t selected_card;
 
-    size_t rd_bytes_left;
-    size_t wr_bytes_left;
-    size_t wr_bytes_blk;
+    uint64_t rd_bytes_left;
+    uint64_t wr_bytes_left;
+    uint64_t wr_bytes_blk;
 
     At91Pdc pdc;
     bool rx_dma_enabled;
     bool tx_dma_enabled;
+
+    // PDC buffer transfer, possibly waiting for a block request
+    struct {
+        bool read;
+        bool second;            // transfer of next buffer (RNPR/TNPR)
+        uint32_t addr;
+        uint32_t len;
+        uint32_t total;
+        uint32_t units;
+        uint8_t card;           // card the buffer is transferred from/to
+
+        bool busy;              // request issued, but not completed
+        uint64_t offset;
+        uint32_t count;
+
+        BlockBackend *blk;
+        BlockAIOCB *aiocb;
+        QEMUSGList sg;
+    } io;
+
+    VMChangeStateEntry *vmstate;
+
+    // diagnostics, neither reset nor migrated
+    struct {
+        MciCardStats card[2];
+        uint64_t sr_reads;
+
+        bool pending;           // command issued, but not done yet
+        uint8_t pending_cmd;
+        uint8_t pending_card;
+        int64_t pending_start;
+    } stats;
 } MciState;
 
 
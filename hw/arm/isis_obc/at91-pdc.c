@@ -0,0 +1,31 @@
+/*
+ * Generic support functionality for AT91 PDC implementations.
+ *
+ * See at91-pdc.h for details.
+ *
+ * Copyright (c) 2019-2020 KSat e.V. Stuttgart
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or, at your
+ * option, any later version. See the COPYING file in the top-level directory.
+ */
+
+#include "at91-pdc.h"
+
+
+const VMStateDescription vmstate_at91_pdc = {
+    .name = "at91-pdc",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(reg_ptsr, At91Pdc),
+        VMSTATE_UINT32(reg_rpr, At91Pdc),
+        VMSTATE_UINT32(reg_rnpr, At91Pdc),
+        VMSTATE_UINT32(reg_tpr, At91Pdc),
+        VMSTATE_UINT32(reg_tnpr, At91Pdc),
+        VMSTATE_UINT16(reg_rcr, At91Pdc),
+        VMSTATE_UINT16(reg_rncr, At91Pdc),
+        VMSTATE_UINT16(reg_tcr, At91Pdc),
+        VMSTATE_UINT16(reg_tncr, At91Pdc),
+        VMSTATE_END_OF_LIST()
+    },
+};
@@ -17,6 +17,7 @@
 #include "qemu/osdep.h"
 #include "qemu/error-report.h"
 #include "hw/sysbus.h"
+#include "migration/vmstate.h"
 
 
 #define PDC_START       0x100
@@ -72,6 +73,12 @@ typedef struct {
     uint32_t *reg_sr;
 } At91PdcOps;
 
+extern const VMStateDescription vmstate_at91_pdc;
+
+#define VMSTATE_AT91_PDC(_field, _state) \
+    VMSTATE_STRUCT(_field, _state, 1, vmstate_at91_pdc, At91Pdc)
+
+
 enum at91_pdc_action {
     AT91_PDC_ACTION_NONE = 0,
     AT91_PDC_ACTION_STATE,
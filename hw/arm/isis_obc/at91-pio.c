@@ -17,9 +17,11 @@
 
 #include "at91-pio.h"
 #include "qapi/error.h"
+#include "qemu/bswap.h"
 #include "qemu/error-report.h"
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
+#include "migration/vmstate.h"
 
 #define IOX_CAT_PINSTATE            0x01
 #define IOX_CID_PINSTATE_ENABLE     0x01
@@ -67,7 +69,8 @@ static void iox_pinstate_set(PioState *s, struct iox_data_frame *frame)
         return;
     }
 
-    uint32_t state = *((uint32_t *)&frame->payload[0]);
+    // payload points into the receive buffer and may not be aligned
+    uint32_t state = ldl_he_p(frame->payload);
     bool level = frame->id == IOX_CID_PINSTATE_ENABLE;
 
     for (uint32_t i = 0; i < 32; i++)
@@ -432,6 +435,7 @@ static void pio_device_realize(DeviceState *dev, Error **errp)
         }
 
         iox_server_set_handler(srv, iox_receive, s);
+        iox_server_set_iothread(srv, s->iothread);
 
         if (iox_server_open(srv, &addr, errp))
             return;
@@ -459,9 +463,33 @@ static void pio_device_reset(DeviceState *dev)
 
 static Property pio_device_properties[] = {
     DEFINE_PROP_STRING("socket", PioState, socket),
+    DEFINE_PROP_LINK("iothread", PioState, iothread, TYPE_IOTHREAD, IOThread *),
     DEFINE_PROP_END_OF_LIST(),
 };
 
+static const VMStateDescription vmstate_at91_pio = {
+    .name = "at91-pio",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(reg_psr, PioState),
+        VMSTATE_UINT32(reg_osr, PioState),
+        VMSTATE_UINT32(reg_ifsr, PioState),
+        VMSTATE_UINT32(reg_odsr, PioState),
+        VMSTATE_UINT32(reg_pdsr, PioState),
+        VMSTATE_UINT32(reg_imr, PioState),
+        VMSTATE_UINT32(reg_isr, PioState),
+        VMSTATE_UINT32(reg_mdsr, PioState),
+        VMSTATE_UINT32(reg_pusr, PioState),
+        VMSTATE_UINT32(reg_absr, PioState),
+        VMSTATE_UINT32(reg_owsr, PioState),
+        VMSTATE_UINT32(pin_state_in, PioState),
+        VMSTATE_UINT32(pin_state_periph_a, PioState),
+        VMSTATE_UINT32(pin_state_periph_b, PioState),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 static void pio_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -470,6 +498,7 @@ static void pio_class_init(ObjectClass *klass, void *data)
     dc->unrealize = pio_device_unrealize;
     dc->reset = pio_device_reset;
     device_class_set_props(dc, pio_device_properties);
+    dc->vmsd = &vmstate_at91_pio;
 }
 
 static const TypeInfo pio_device_info = {
@@ -50,6 +50,7 @@ typedef struct {
     qemu_irq pin_out[AT91_PIO_NUM_PINS];
 
     char* socket;
+    IOThread *iothread;
     IoXferServer *server;
 
     // registers
@@ -12,6 +12,7 @@
 #include "at91-pit.h"
 #include "qemu/error-report.h"
 #include "hw/irq.h"
+#include "migration/vmstate.h"
 
 
 #define PIT_MR      0x00
@@ -178,12 +179,27 @@ static void pit_device_reset(DeviceState *dev)
     qemu_set_irq(s->irq, 0);
 }
 
+static const VMStateDescription vmstate_at91_pit = {
+    .name = "at91-pit",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_PTIMER(timer, PitState),
+        VMSTATE_UINT32(mclk, PitState),
+        VMSTATE_UINT32(reg_mr, PitState),
+        VMSTATE_UINT32(reg_sr, PitState),
+        VMSTATE_UINT32(picnt, PitState),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 static void pit_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
 
     dc->realize = pit_device_realize;
     dc->reset = pit_device_reset;
+    dc->vmsd = &vmstate_at91_pit;
 }
 
 static const TypeInfo pit_device_info = {
@@ -17,6 +17,8 @@
 #include "at91-pmc.h"
 #include "qemu/error-report.h"
 #include "hw/irq.h"
+#include "cpu.h"
+#include "migration/vmstate.h"
 
 
 #define SR_MOSCS    0x00000001
@@ -24,6 +26,8 @@
 #define SR_LOCKB    0x00000004
 #define SR_MCKRDY   0x00000008
 
+#define SCSR_PCK    0x00000001
+
 #define PMC_SCER        0x00
 #define PMC_SCDR        0x04
 #define PMC_SCSR        0x08
@@ -180,7 +184,14 @@ static void pmc_mmio_write(void *opaque, hwaddr offset, uint64_t value, unsigned
         break;
 
     case PMC_SCDR:
-        s->reg_pmc_scsr &= ~value;
+        // SPEC: The processor clock is automatically re-enabled by any
+        // enabled fast or normal interrupt, or by the reset of the product.
+        // Thus emulate disabling of PCK as wait-for-interrupt (idle mode) and
+        // keep it enabled in SCSR, as seen by the CPU once it is woken up.
+        if ((value & SCSR_PCK) && current_cpu) {
+            cpu_interrupt(current_cpu, CPU_INTERRUPT_HALT);
+        }
+        s->reg_pmc_scsr &= ~(value & ~SCSR_PCK);
         break;
 
     case PMC_PCER:
@@ -314,12 +325,37 @@ static void pmc_device_reset(DeviceState *dev)
     pmc_update_mckr(s);
 }
 
+static const VMStateDescription vmstate_at91_pmc = {
+    .name = "at91-pmc",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(reg_pmc_scsr, PmcState),
+        VMSTATE_UINT32(reg_pmc_pcsr, PmcState),
+        VMSTATE_UINT32(reg_ckgr_mor, PmcState),
+        VMSTATE_UINT32(reg_ckgr_mcfr, PmcState),
+        VMSTATE_UINT32(reg_ckgr_plla, PmcState),
+        VMSTATE_UINT32(reg_ckgr_pllb, PmcState),
+        VMSTATE_UINT32(reg_pmc_mckr, PmcState),
+        VMSTATE_UINT32(reg_pmc_pck0, PmcState),
+        VMSTATE_UINT32(reg_pmc_pck1, PmcState),
+        VMSTATE_UINT32(reg_pmc_sr, PmcState),
+        VMSTATE_UINT32(reg_pmc_imr, PmcState),
+        VMSTATE_UINT32(reg_pmc_pllicpr, PmcState),
+        // note: peripherals keep track of (and save) their master clock
+        // themselves, so no need to notify them after load
+        VMSTATE_UINT32(master_clock_freq, PmcState),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 static void pmc_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
 
     dc->realize = pmc_device_realize;
     dc->reset = pmc_device_reset;
+    dc->vmsd = &vmstate_at91_pmc;
 }
 
 static void pmc_instance_init(Object *obj)
@@ -7,6 +7,10 @@
  * notified when sytem clock changes. Only one callback allowed at a time.
  * This should be done by the board implementation.
  *
+ * Disabling the processor clock via PMC_SCDR halts the CPU until the next
+ * interrupt (nIRQ or nFIQ) is asserted by the AIC, same as the ARM926
+ * wait-for-interrupt instruction.
+ *
  * See at91-pmc.c for implementation status.
  *
  * Copyright (c) 2019-2020 KSat e.V. Stuttgart
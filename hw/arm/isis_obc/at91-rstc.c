@@ -17,6 +17,7 @@
 #include "at91-rstc.h"
 #include "qemu/error-report.h"
 #include "hw/irq.h"
+#include "migration/vmstate.h"
 
 #define RSTC_KEY_PASSWORD   0xa5
 
@@ -129,11 +130,23 @@ static void rstc_device_realize(DeviceState *dev, Error **errp)
     s->reg_mr = 0;
 }
 
+static const VMStateDescription vmstate_at91_rstc = {
+    .name = "at91-rstc",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(reg_sr, RstcState),
+        VMSTATE_UINT32(reg_mr, RstcState),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 static void rstc_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
 
     dc->realize = rstc_device_realize;
+    dc->vmsd = &vmstate_at91_rstc;
 }
 
 static const TypeInfo rstc_device_info = {
@@ -10,6 +10,7 @@
 #include "at91-rtt.h"
 #include "qemu/error-report.h"
 #include "hw/irq.h"
+#include "migration/vmstate.h"
 
 
 #define AT91_SCLK       0x8000
@@ -168,12 +169,27 @@ static void rtt_device_reset(DeviceState *dev)
     qemu_set_irq(s->irq, 0);
 }
 
+static const VMStateDescription vmstate_at91_rtt = {
+    .name = "at91-rtt",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_PTIMER(timer, RttState),
+        VMSTATE_UINT32(reg_mr, RttState),
+        VMSTATE_UINT32(reg_ar, RttState),
+        VMSTATE_UINT32(reg_vr, RttState),
+        VMSTATE_UINT32(reg_sr, RttState),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 static void rtt_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
 
     dc->realize = rtt_device_realize;
     dc->reset = rtt_device_reset;
+    dc->vmsd = &vmstate_at91_rtt;
 }
 
 static const TypeInfo rtt_device_info = {
@@ -14,6 +14,7 @@
 #include "qemu/error-report.h"
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
+#include "migration/vmstate.h"
 
 
 #define IOX_CAT_FAULT       0x02
@@ -186,6 +187,7 @@ static void sdramc_device_realize(DeviceState *dev, Error **errp)
         }
 
         iox_server_set_handler(srv, iox_receive, s);
+        iox_server_set_iothread(srv, s->iothread);
 
         if (iox_server_open(srv, &addr, errp))
             return;
@@ -213,9 +215,26 @@ static void sdramc_device_reset(DeviceState *dev)
 
 static Property sdramc_device_properties[] = {
     DEFINE_PROP_STRING("socket", SdramcState, socket),
+    DEFINE_PROP_LINK("iothread", SdramcState, iothread, TYPE_IOTHREAD, IOThread *),
     DEFINE_PROP_END_OF_LIST(),
 };
 
+static const VMStateDescription vmstate_at91_sdramc = {
+    .name = "at91-sdramc",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(reg_mr, SdramcState),
+        VMSTATE_UINT32(reg_tr, SdramcState),
+        VMSTATE_UINT32(reg_cr, SdramcState),
+        VMSTATE_UINT32(reg_lpr, SdramcState),
+        VMSTATE_UINT32(reg_imr, SdramcState),
+        VMSTATE_UINT32(reg_isr, SdramcState),
+        VMSTATE_UINT32(reg_mdr, SdramcState),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 static void sdramc_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -224,6 +243,7 @@ static void sdramc_class_init(ObjectClass *klass, void *data)
     dc->unrealize = sdramc_device_unrealize;
     dc->reset = sdramc_device_reset;
     device_class_set_props(dc, sdramc_device_properties);
+    dc->vmsd = &vmstate_at91_sdramc;
 }
 
 static const TypeInfo sdramc_device_info = {
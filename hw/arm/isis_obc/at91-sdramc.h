@@ -32,6 +32,7 @@ typedef struct {
     qemu_irq irq;
 
     char* socket;
+    IOThread *iothread;
     IoXferServer *server;
 
     uint32_t reg_mr;
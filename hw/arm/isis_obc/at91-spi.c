@@ -11,20 +11,22 @@
 
 // Overview of TODOs:
 // - Slave mode (only master mode is implemented).
-// - Transmission delays (transmissions are currently sent instantaneous, size
-//   does not have an impact on the time it takes to send them).
+// - DLYBCS (delay between chip selects) is not included in transfer times.
 // - Chip-selects are implemented on a per-transfer basis, NPCS lines are not
-//   directly simulated. This includes LASTXFER having no effect.
+//   directly simulated. LASTXFER and CSAAT only have an effect for in-process
+//   devices and in packed mode.
 
 #include "at91-spi.h"
 #include "exec/address-spaces.h"
-#include "sysemu/cpus.h"
 #include "qapi/error.h"
 #include "qemu/bswap.h"
 #include "qemu/error-report.h"
+#include "qemu/host-utils.h"
 #include "qemu/log.h"
 #include "hw/irq.h"
+#include "hw/ssi/ssi.h"
 #include "hw/qdev-properties.h"
+#include "migration/vmstate.h"
 
 
 #define IOX_CAT_DATA            0x01
@@ -32,10 +34,18 @@
 
 #define IOX_CID_DATA_IN         0x01
 #define IOX_CID_DATA_OUT        0x02
+#define IOX_CID_DATA_PACKED_IN  0x03
+#define IOX_CID_DATA_PACKED_OUT 0x04
 
 #define IOX_CID_FAULT_MODF      0x01
 #define IOX_CID_FAULT_OVRES     0x02
 
+#define SPI_PACKED_HDR_LEN      4
+#define SPI_PACKED_FLAG_END     BIT(0)
+
+// chip select deasserted after this unit, internal, not sent in unit format
+#define XFER_UNIT_LASTXFER      BIT(31)
+
 
 #define SPI_CR          0x00
 #define SPI_MR          0x04
@@ -63,6 +73,11 @@
 #define MR_PCS(s)       (((s)->reg_mr >> 16) & 0x0F)
 #define MR_DLYBCS(s)    (((s)->reg_mr >> 24) & 0xFF)
 
+#define CSR_CSAAT       BIT(3)
+#define CSR_SCBR(v)     (((v) >> 8) & 0xFF)
+#define CSR_DLYBS(v)    (((v) >> 16) & 0xFF)
+#define CSR_DLYBCT(v)   (((v) >> 24) & 0xFF)
+
 #define SR_RDRF         BIT(0)
 #define SR_TDRE         BIT(1)
 #define SR_MODF         BIT(2)
@@ -77,6 +92,8 @@
 
 #define SR_IRQ_MASK     0x3FF
 
+#define TDR_LASTXFER    BIT(24)
+
 
 // SPEC:
 // The end of transfer is indicated by the TXEMPTY flag in the SPI_SR. If a
@@ -136,12 +153,12 @@ inline static uint8_t pcs_to_nr(SpiState *s, uint8_t pcs)
     return pcs_to_nr_nopcsdec(pcs);
 }
 
-inline static uint8_t pcnr_to_cs(SpiState *s, uint8_t pcnr)
+inline static uint8_t pcnr_to_cs(uint32_t mr, uint8_t pcnr)
 {
-    if (!(s->reg_mr & MR_MSTR))
+    if (!(mr & MR_MSTR))
         return 0x00;
 
-    if (s->reg_mr & MR_PCSDEC)
+    if (mr & MR_PCSDEC)
         return pcnr;
 
     return ~(pcnr + 1);
@@ -165,53 +182,393 @@ inline static uint32_t to_xfer_unit(uint8_t pcnr, uint8_t bits, uint16_t data)
 }
 
 
-inline static void xfer_master_wait_receive_finish(SpiState *s);
+// SPEC: The delay between the assertion of a chip select and the first valid
+// SPCK transition is DLYBS/MCK, the SPCK period is SCBR/MCK, and the delay
+// between two consecutive transfers is 32 * DLYBCT/MCK.
 
-inline static void xfer_master_wait_receive_start_dma(SpiState *s, uint32_t n)
+inline static uint64_t xfer_unit_cycles(SpiState *s, uint8_t pcnr, uint8_t bits)
 {
-    s->wait_rcv.n = n;
-    s->wait_rcv.ty = AT91_SPI_WAIT_RCV_DMA;
+    uint32_t csr = s->reg_csr[pcnr/4];
+    uint32_t scbr = CSR_SCBR(csr);
 
-    // pause execution until data has been recieved to avoid timeouts       // TODO: remove?
-    pause_all_vcpus();
-
-    // if no server set up or it doesn't have a client, we already prepared rcvbuf
-    if (!s->server || !s->server->client)
-        xfer_master_wait_receive_finish(s);
+    // SCBR of zero leads to unpredictable results, assume one instead
+    return (uint64_t)bits * (scbr ? scbr : 1) + 32 * CSR_DLYBCT(csr);
 }
 
-inline static void xfer_master_wait_receive_start_tdr(SpiState *s)
+inline static uint64_t xfer_start_cycles(SpiState *s, uint8_t pcnr)
 {
-    s->wait_rcv.n = 1;
-    s->wait_rcv.ty = AT91_SPI_WAIT_RCV_TDR;
+    return CSR_DLYBS(s->reg_csr[pcnr/4]);
+}
 
-    // pause execution until data has been recieved to avoid timeouts       // TODO: remove?
-    pause_all_vcpus();
+inline static int64_t xfer_cycles_to_ns(SpiState *s, uint64_t cycles)
+{
+    if (!s->mclk)
+        return 0;
 
-    // if no server set up or it doesn't have a client, we already prepared rcvbuf
-    if (!s->server || !s->server->client)
-        xfer_master_wait_receive_finish(s);
+    return muldiv64(cycles, NANOSECONDS_PER_SECOND, s->mclk);
 }
 
+static uint32_t *xfer_units_reserve(SpiState *s, uint32_t n)
+{
+    buffer_reset(&s->sndbuf);
+    buffer_reserve(&s->sndbuf, n * sizeof(uint32_t));
+    s->sndbuf.offset = n * sizeof(uint32_t);
 
-static uint32_t xfer_master_unit_to_tdr(SpiState *s, uint32_t unit)
+    return (uint32_t *)s->sndbuf.buffer;
+}
+
+static void iox_transmit_units(SpiState *s, uint32_t *units, uint32_t n)
 {
-    uint8_t pcnr = (unit >> 24) & 0x0F;
-    if (pcnr >= 16) {
-        error_report("at91.spi: received invalid chip-select number: %d", pcnr);
+    uint8_t *data = (uint8_t *)units;
+    uint32_t len = n * sizeof(uint32_t);
+
+    if (!s->server)
+        return;
+
+    for (uint32_t i = 0; i < n; i++)
+        units[i] &= ~XFER_UNIT_LASTXFER;
+
+    int status = iox_send_data_multiframe_new(s->server, IOX_CAT_DATA, IOX_CID_DATA_OUT, len, data);
+    if (status) {
+        error_report("at91.spi: failed to transmit data: %d", status);
         abort();
     }
+}
 
-    uint8_t bits = num_transmit_bits(s, pcnr);
-    uint8_t bits_unit = ((unit >> 16) & 0xFF) + 8;
+static void iox_transmit_packed_frame(SpiState *s, uint8_t pcnr, uint8_t bits, bool end,
+                                      uint32_t *units, uint32_t n)
+{
+    struct iox_data_frame frame;
+    uint8_t *p;
+
+    buffer_reset(&s->pktbuf);
+    buffer_reserve(&s->pktbuf, SPI_PACKED_HDR_LEN + n * sizeof(uint16_t));
+    p = s->pktbuf.buffer;
+
+    p[0] = pcnr;
+    p[1] = bits;
+    p[2] = end ? SPI_PACKED_FLAG_END : 0;
+    p[3] = 0;
+    p += SPI_PACKED_HDR_LEN;
+
+    if (bits > 8) {
+        for (uint32_t i = 0; i < n; i++, p += sizeof(uint16_t))
+            stw_le_p(p, units[i] & 0xFFFF);
+    } else {
+        for (uint32_t i = 0; i < n; i++)
+            *p++ = units[i] & 0xFF;
+    }
+
+    frame.cat = IOX_CAT_DATA;
+    frame.id = IOX_CID_DATA_PACKED_OUT;
+    frame.len = p - s->pktbuf.buffer;
+    frame.payload = s->pktbuf.buffer;
 
-    if (bits != bits_unit) {
-        error_report("at91.spi: received invalid number of bits: got %d, expected %d", bits_unit, bits);
+    int status = iox_send_frame_new(s->server, &frame);
+    if (status) {
+        error_report("at91.spi: failed to transmit data: %d", status);
         abort();
     }
+}
+
+
+/*
+ * Chip-select bus for in-process devices, NULL if no device is attached to
+ * the chip select. Decoded chip selects (PCSDEC) are only available via IOX.
+ */
+static SSIBus *xfer_ssi_bus(SpiState *s, uint8_t pcnr)
+{
+    SSIBus *bus = s->ssi[pcnr / 4];
+
+    if (s->reg_mr & MR_PCSDEC)
+        return NULL;
+
+    return QTAILQ_EMPTY(&BUS(bus)->children) ? NULL : bus;
+}
+
+static void xfer_ssi_set_cs(SSIBus *bus, bool active)
+{
+    BusChild *kid;
+
+    QTAILQ_FOREACH(kid, &BUS(bus)->children, sibling) {
+        DeviceState *dev = kid->child;
+        SSISlaveClass *ssc = SSI_SLAVE_GET_CLASS(dev);
+
+        // devices without chip-select line handle it on their own
+        if (!object_resolve_path_component(OBJECT(dev), SSI_GPIO_CS "[0]"))
+            continue;
+
+        qemu_set_irq(qdev_get_gpio_in_named(dev, SSI_GPIO_CS, 0),
+                     active == (ssc->cs_polarity == SSI_CS_HIGH));
+    }
+}
+
+static void xfer_cs_deassert(SpiState *s)
+{
+    SSIBus *bus;
+
+    if (s->cs_active < 0)
+        return;
+
+    bus = xfer_ssi_bus(s, s->cs_active);
+    if (bus)
+        xfer_ssi_set_cs(bus, false);
+    else if (s->packed && iox_server_active(s->server))
+        iox_transmit_packed_frame(s, s->cs_active, num_transmit_bits(s, s->cs_active),
+                                  true, NULL, 0);
+
+    s->cs_active = -1;
+}
+
+static void xfer_cs_assert(SpiState *s, uint8_t pcnr)
+{
+    SSIBus *bus;
+
+    if (s->cs_active == pcnr)
+        return;
+
+    xfer_cs_deassert(s);
+
+    bus = xfer_ssi_bus(s, pcnr);
+    if (bus)
+        xfer_ssi_set_cs(bus, true);
+
+    s->cs_active = pcnr;
+}
+
+static void iox_transmit_packed(SpiState *s, uint32_t *units, uint32_t n)
+{
+    uint32_t max = iox_server_max_payload(s->server) - SPI_PACKED_HDR_LEN;
+    uint32_t i = 0;
+
+    if (!s->server)
+        return;
+
+    // one frame per chip-select assertion, split to the maximum payload
+    while (i < n) {
+        uint8_t pcnr = (units[i] >> 24) & 0x0F;
+        uint8_t bits = ((units[i] >> 16) & 0xFF) + 8;
+        uint32_t limit = max / (bits > 8 ? sizeof(uint16_t) : sizeof(uint8_t));
+        uint32_t j = i;
+        bool end;
+
+        while (j < n && j - i < limit && ((units[j] >> 24) & 0x0F) == pcnr) {
+            if (units[j++] & XFER_UNIT_LASTXFER)
+                break;
+        }
+
+        // without CSAAT, the transfer completion decides, see xfer_master_wait_receive_finish()
+        if (units[j - 1] & XFER_UNIT_LASTXFER)
+            end = true;
+        else if (j == n)
+            end = false;
+        else
+            end = ((units[j] >> 24) & 0x0F) != pcnr;
+
+        xfer_cs_assert(s, pcnr);
+        iox_transmit_packed_frame(s, pcnr, bits, end, units + i, j - i);
+
+        if (end)
+            s->cs_active = -1;
+
+        i = j;
+    }
+}
+
+/*
+ * Run a transfer through the in-process devices attached to the chip-select
+ * buses, storing the response in rcvbuf. Returns false if the transfer has
+ * to go via IOX instead.
+ */
+static bool xfer_ssi_transfer(SpiState *s, uint32_t *units, uint32_t n)
+{
+    bool ssi = false;
+    uint32_t *out;
+
+    for (uint32_t i = 0; i < n; i++) {
+        bool has_dev = xfer_ssi_bus(s, (units[i] >> 24) & 0x0F) != NULL;
+
+        if (i > 0 && has_dev != ssi) {
+            warn_report_once("at91.spi: transfer spans in-process and external devices, "
+                             "sending it via IOX");
+            return false;
+        }
+
+        ssi = has_dev;
+    }
+
+    if (!ssi)
+        return false;
+
+    buffer_reserve(&s->rcvbuf, n * sizeof(uint32_t));
+    out = (uint32_t *)buffer_end(&s->rcvbuf);
+
+    for (uint32_t i = 0; i < n; i++) {
+        uint8_t pcnr = (units[i] >> 24) & 0x0F;
+        uint8_t bits = ((units[i] >> 16) & 0xFF) + 8;
+        uint32_t rx;
+
+        xfer_cs_assert(s, pcnr);
+        rx = ssi_transfer(s->ssi[pcnr / 4], units[i] & 0xFFFF);
+        out[i] = to_xfer_unit(pcnr, bits, rx & ((1 << bits) - 1));
+
+        if (units[i] & XFER_UNIT_LASTXFER)
+            xfer_cs_deassert(s);
+    }
+
+    s->rcvbuf.offset += n * sizeof(uint32_t);
+    return true;
+}
+
+
+static void xfer_master_wait_receive_finish(SpiState *s);
+
+/*
+ * Start a master transfer of the units in sndbuf, taking the given number of
+ * master clock cycles. The transfer completes once that time has passed and
+ * the response has been received, whichever is later. Responses of
+ * in-process devices are available immediately.
+ */
+static void xfer_master_wait_receive_start(SpiState *s, enum wait_rcv_type ty,
+                                           uint32_t n, uint64_t cycles)
+{
+    uint32_t *units = (uint32_t *)s->sndbuf.buffer;
+
+    s->wait_rcv.ty = ty;
+    s->wait_rcv.n = n;
+    s->wait_rcv.mr = s->reg_mr;
+    s->wait_rcv.end = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + xfer_cycles_to_ns(s, cycles);
+
+    s->reg_sr &= ~SR_TXEMPTY;
+    timer_mod(s->xfer_timer, s->wait_rcv.end);
+
+    // LASTXFER written to SPI_CR applies to the last unit of this transfer
+    if (s->lastxfer && n) {
+        units[n - 1] |= XFER_UNIT_LASTXFER;
+        s->lastxfer = false;
+    }
+
+    s->wait_rcv.received = xfer_ssi_transfer(s, units, n);
+    if (s->wait_rcv.received)
+        return;
+
+    // if no server set up or it doesn't have a client: echo data to rcvbuf
+    s->wait_rcv.received = !iox_server_active(s->server);
+    if (s->wait_rcv.received) {
+        s->owed = 0;        // no client left to send late responses
+        buffer_reserve(&s->rcvbuf, s->sndbuf.offset);
+        buffer_append(&s->rcvbuf, s->sndbuf.buffer, s->sndbuf.offset);
+        return;
+    }
+
+    // keep idle-warp from skipping ahead to the response timeout
+    iox_server_set_response_pending(s->server, true);
+
+    if (s->packed) {
+        iox_transmit_packed(s, units, n);
+    } else {
+        xfer_cs_deassert(s);
+        iox_transmit_units(s, units, n);
+    }
+}
+
+static void xfer_master_fill_idle(SpiState *s)
+{
+    uint32_t *sent = (uint32_t *)s->sndbuf.buffer;
+    uint32_t have = s->rcvbuf.offset / sizeof(uint32_t);
+
+    // MISO stays high for all units the client did not answer
+    s->rcvbuf.offset = have * sizeof(uint32_t);
+    buffer_reserve(&s->rcvbuf, (s->wait_rcv.n - have) * sizeof(uint32_t));
+
+    for (uint32_t i = have; i < s->wait_rcv.n; i++) {
+        uint8_t bits = ((sent[i] >> 16) & 0xFF) + 8;
+        uint32_t unit = (sent[i] & 0x0FFF0000) | ((1 << bits) - 1);
+
+        buffer_append(&s->rcvbuf, &unit, sizeof(uint32_t));
+    }
+}
+
+static void xfer_master_timer(void *opaque)
+{
+    SpiState *s = opaque;
+    int64_t deadline;
+
+    if (s->wait_rcv.ty == AT91_SPI_WAIT_RCV_NONE)
+        return;
+
+    if (s->wait_rcv.received) {
+        xfer_master_wait_receive_finish(s);
+        return;
+    }
+
+    // no timeout set: wait until the client responds
+    if (!s->timeout)
+        return;
+
+    deadline = s->wait_rcv.end + (int64_t)s->timeout * SCALE_US;
+    if (qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) < deadline) {
+        timer_mod(s->xfer_timer, deadline);
+        return;
+    }
+
+    warn_report("at91.spi: no response from client within %u us, "
+                "completing transfer with idle data", s->timeout);
+
+    // the client may still answer, drop that instead of using it for the next transfer
+    s->owed += s->wait_rcv.n - MIN(s->rcvbuf.offset / sizeof(uint32_t), s->wait_rcv.n);
+
+    xfer_master_fill_idle(s);
+    xfer_master_wait_receive_finish(s);
+}
+
+/*
+ * Abort a running master transfer without completing it, e.g. on reset or
+ * when the SPI is disabled. Releases the chip select. A response the client
+ * still owes is dropped once it arrives.
+ */
+static void xfer_master_cancel(SpiState *s)
+{
+    timer_del(s->xfer_timer);
+
+    if (s->wait_rcv.ty != AT91_SPI_WAIT_RCV_NONE && !s->wait_rcv.received
+            && iox_server_active(s->server))
+        s->owed += s->wait_rcv.n - MIN(s->rcvbuf.offset / sizeof(uint32_t), s->wait_rcv.n);
+
+    xfer_cs_deassert(s);
+
+    s->wait_rcv.ty = AT91_SPI_WAIT_RCV_NONE;
+    s->wait_rcv.n = 0;
+    s->wait_rcv.received = false;
+    iox_server_set_response_pending(s->server, false);
+    s->tdr_pending = false;
+    s->lastxfer = false;
+
+    buffer_reset(&s->rcvbuf);
+    buffer_reset(&s->sndbuf);
+}
+
+
+/*
+ * Convert the i-th received unit to RDR format. Chip select and number of
+ * bits are taken from the unit sent, as the guest may have changed the mode
+ * and chip-select registers since the transfer has been started.
+ */
+static uint32_t xfer_master_unit_to_tdr(SpiState *s, uint32_t i)
+{
+    uint32_t unit = ((uint32_t *)s->rcvbuf.buffer)[i];
+    uint32_t sent = ((uint32_t *)s->sndbuf.buffer)[i];
+    uint8_t pcnr = (sent >> 24) & 0x0F;
+    uint8_t bits = ((sent >> 16) & 0xFF) + 8;
+
+    if ((unit & 0x0FFF0000) != (sent & 0x0FFF0000)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "at91.spi: response unit does not match transfer: "
+                      "got cs %d with %d bits, expected cs %d with %d bits\n",
+                      (unit >> 24) & 0x0F, ((unit >> 16) & 0xFF) + 8, pcnr, bits);
+    }
 
     uint16_t data = unit & ((1 << bits) - 1);
-    return pcnr_to_cs(s, pcnr) << 16 | data;
+    return pcnr_to_cs(s->wait_rcv.mr, pcnr) << 16 | data;
 }
 
 static uint32_t xfer_master_copy_to_rpr(SpiState *s, uint8_t *buf, uint32_t num_units, uint8_t unit_size)
@@ -273,16 +630,15 @@ static void xfer_master_read_to_dma_varps(SpiState *s)
     uint32_t *buf = g_new0(uint32_t, s->wait_rcv.n);
 
     for (int i = 0; i < s->wait_rcv.n; i++) {
-        uint32_t unit = ((uint32_t *)s->rcvbuf.buffer)[i];
-        uint32_t tdr = xfer_master_unit_to_tdr(s, unit);
+        uint32_t tdr = xfer_master_unit_to_tdr(s, i);
         buf[i] = tdr;
     }
 
     xfer_master_copy_to_dma(s, (uint8_t *)buf, s->wait_rcv.n, sizeof(uint32_t));
+    g_free(buf);
 
     // ensure RDR and serializer have correct values
-    uint32_t unit = ((uint32_t *)s->rcvbuf.buffer)[s->wait_rcv.n - 1];
-    uint32_t tdr = xfer_master_unit_to_tdr(s, unit);
+    uint32_t tdr = xfer_master_unit_to_tdr(s, s->wait_rcv.n - 1);
     s->serializer = tdr & 0xFFFF;
     s->reg_rdr = tdr & 0xFFFF;
 }
@@ -292,16 +648,15 @@ static void xfer_master_read_to_dma_novarps8(SpiState *s)
     uint8_t *buf = g_new0(uint8_t, s->wait_rcv.n);
 
     for (int i = 0; i < s->wait_rcv.n; i++) {
-        uint32_t unit = ((uint32_t *)s->rcvbuf.buffer)[i];
-        uint32_t tdr = xfer_master_unit_to_tdr(s, unit);
+        uint32_t tdr = xfer_master_unit_to_tdr(s, i);
         buf[i] = tdr & 0xFF;
     }
 
     xfer_master_copy_to_dma(s, buf, s->wait_rcv.n, sizeof(uint8_t));
+    g_free(buf);
 
     // ensure RDR and serializer have correct values
-    uint32_t unit = ((uint32_t *)s->rcvbuf.buffer)[s->wait_rcv.n - 1];
-    uint32_t tdr = xfer_master_unit_to_tdr(s, unit);
+    uint32_t tdr = xfer_master_unit_to_tdr(s, s->wait_rcv.n - 1);
     s->serializer = tdr & 0xFFFF;
     s->reg_rdr = tdr & 0xFFFF;
 }
@@ -311,45 +666,49 @@ static void xfer_master_read_to_dma_novarps16(SpiState *s)
     uint16_t *buf = g_new0(uint16_t, s->wait_rcv.n);
 
     for (int i = 0; i < s->wait_rcv.n; i++) {
-        uint32_t unit = ((uint32_t *)s->rcvbuf.buffer)[i];
-        uint32_t tdr = xfer_master_unit_to_tdr(s, unit);
+        uint32_t tdr = xfer_master_unit_to_tdr(s, i);
         buf[i] = tdr & 0xFFFF;
     }
 
     xfer_master_copy_to_dma(s, (uint8_t *)buf, s->wait_rcv.n, sizeof(uint16_t));
+    g_free(buf);
 
     // ensure RDR and serializer have correct values
-    uint32_t unit = ((uint32_t *)s->rcvbuf.buffer)[s->wait_rcv.n - 1];
-    uint32_t tdr = xfer_master_unit_to_tdr(s, unit);
+    uint32_t tdr = xfer_master_unit_to_tdr(s, s->wait_rcv.n - 1);
     s->serializer = tdr & 0xFFFF;
     s->reg_rdr = tdr & 0xFFFF;
 }
 
 static void xfer_master_read_to_tdr(SpiState *s)
 {
-    uint32_t unit = ((uint32_t *)s->rcvbuf.buffer)[s->wait_rcv.n - 1];
-    uint32_t tdr = xfer_master_unit_to_tdr(s, unit);
+    uint32_t tdr = xfer_master_unit_to_tdr(s, s->wait_rcv.n - 1);
 
     s->serializer = tdr & 0xFFFFF;
     s->reg_rdr = tdr;
     s->reg_sr |= SR_RDRF;
 }
 
+static void xfer_transmit_tdr(SpiState *s);
 static void xfer_transmit_tdr_master_finish(SpiState *s);
+static void xfer_dma_do_tcr_master_start(SpiState *s);
 static void xfer_dma_do_tcr_master_finish(SpiState *s);
 
-inline static void xfer_master_wait_receive_finish(SpiState *s)
+static void xfer_master_wait_receive_finish(SpiState *s)
 {
+    enum wait_rcv_type ty = s->wait_rcv.ty;
+
+    timer_del(s->xfer_timer);
+    iox_server_set_response_pending(s->server, false);
+
     if (s->reg_sr & SR_RDRF) {
         s->reg_sr |= SR_OVRES;
     }
 
     if (s->dma_rx_enabled) {
-        if (s->reg_mr & MR_PS) {
+        if (s->wait_rcv.mr & MR_PS) {
             xfer_master_read_to_dma_varps(s);
         } else {
-            uint8_t pcnr = pcs_to_nr(s, (s->reg_mr >> 16) & 0x0F);
-            uint8_t bits = num_transmit_bits(s, pcnr);
+            uint8_t bits = ((*(uint32_t *)s->sndbuf.buffer >> 16) & 0xFF) + 8;
 
             if (bits == 8) {
                 xfer_master_read_to_dma_novarps8(s);
@@ -361,40 +720,42 @@ inline static void xfer_master_wait_receive_finish(SpiState *s)
         xfer_master_read_to_tdr(s);
     }
 
-    if (s->wait_rcv.ty == AT91_SPI_WAIT_RCV_TDR)
-        xfer_transmit_tdr_master_finish(s);
-    else if (s->wait_rcv.ty == AT91_SPI_WAIT_RCV_DMA)
-        xfer_dma_do_tcr_master_finish(s);
-
     s->wait_rcv.ty = AT91_SPI_WAIT_RCV_NONE;
     s->wait_rcv.n = 0;
+    s->wait_rcv.received = false;
 
-    // all data recieved, resume CPU        // TODO: remove?
-    resume_all_vcpus();
-
-    update_irq(s);
-}
+    buffer_reset(&s->rcvbuf);
+    buffer_reset(&s->sndbuf);
 
+    // may start the next transfer, i.e. re-use wait_rcv and the buffers
+    if (ty == AT91_SPI_WAIT_RCV_TDR)
+        xfer_transmit_tdr_master_finish(s);
+    else if (ty == AT91_SPI_WAIT_RCV_DMA)
+        xfer_dma_do_tcr_master_finish(s);
 
-static void iox_transmit_units(SpiState *s, uint32_t *units, uint32_t n)
-{
-    uint8_t *data = (uint8_t *)units;
-    uint32_t len = n * sizeof(uint32_t);
+    // start transfers requested while this one was running
+    if (s->wait_rcv.ty == AT91_SPI_WAIT_RCV_NONE) {
+        if (s->tdr_pending) {
+            s->tdr_pending = false;
+            xfer_transmit_tdr(s);
+        } else if (s->dma_tx_enabled && s->pdc.reg_tcr) {
+            xfer_dma_do_tcr_master_start(s);
+        }
+    }
 
-    if (!s->server)
-        return;
+    // without CSAAT, NPCS rises only if the transmitter has run dry
+    if (s->wait_rcv.ty == AT91_SPI_WAIT_RCV_NONE && s->cs_active >= 0
+            && !(s->reg_csr[s->cs_active / 4] & CSR_CSAAT))
+        xfer_cs_deassert(s);
 
-    int status = iox_send_data_multiframe_new(s->server, IOX_CAT_DATA, IOX_CID_DATA_OUT, len, data);
-    if (status) {
-        error_report("at91.spi: failed to transmit data: %d", status);
-        abort();
-    }
+    update_irq(s);
 }
 
 static uint32_t xfer_transmit_dmabuf_varps(SpiState *s, void *dmabuf, uint32_t len)
 {
     // data is 32 bit full TDR format
     uint32_t num_units = len / sizeof(uint32_t);
+    uint64_t cycles = 0;
     uint32_t *units;
 
     if (len - num_units * sizeof(uint32_t) > 0) {
@@ -402,11 +763,7 @@ static uint32_t xfer_transmit_dmabuf_varps(SpiState *s, void *dmabuf, uint32_t l
         abort();
     }
 
-    units = g_new0(uint32_t, num_units);
-    if (!units) {
-        error_report("at91.spi: out of memory");
-        abort();
-    }
+    units = xfer_units_reserve(s, num_units);
 
     for (uint32_t i = 0; i < num_units; i++) {
         uint32_t tdr = le32_to_cpu(((uint32_t *)dmabuf)[i]);        // XXX: assumes little-endian
@@ -414,21 +771,16 @@ static uint32_t xfer_transmit_dmabuf_varps(SpiState *s, void *dmabuf, uint32_t l
         uint8_t bits = num_transmit_bits(s, pcnr);
         uint16_t data = tdr & ((1 << ((uint32_t)bits)) - 1);
 
-        // TODO: lastxfer?
-
         units[i] = to_xfer_unit(pcnr, bits, data);
-    }
+        if (tdr & TDR_LASTXFER)
+            units[i] |= XFER_UNIT_LASTXFER;
 
-    // if no server set up or it doesn't have a client: echo data to rcvbuf
-    if (!s->server || !s->server->client) {
-        buffer_reserve(&s->rcvbuf, num_units * sizeof(uint32_t));
-        buffer_append(&s->rcvbuf, units, num_units * sizeof(uint32_t));
+        if (i == 0)
+            cycles += xfer_start_cycles(s, pcnr);
+        cycles += xfer_unit_cycles(s, pcnr, bits);
     }
 
-    xfer_master_wait_receive_start_dma(s, num_units);
-    iox_transmit_units(s, units, num_units);
-    g_free(units);
-
+    xfer_master_wait_receive_start(s, AT91_SPI_WAIT_RCV_DMA, num_units, cycles);
     return num_units;
 }
 
@@ -439,6 +791,7 @@ static uint32_t xfer_transmit_dmabuf_novarps(SpiState *s, void *dmabuf, uint32_t
     uint8_t pcnr = pcs_to_nr(s, (s->reg_mr >> 16) & 0x0F);
     uint8_t bits = num_transmit_bits(s, pcnr);
     uint32_t num_units;
+    uint64_t cycles;
     uint32_t *units;
 
     if (bits > 8) {     // 16bit storage
@@ -451,11 +804,7 @@ static uint32_t xfer_transmit_dmabuf_novarps(SpiState *s, void *dmabuf, uint32_t
         num_units = len / sizeof(uint8_t);
     }
 
-    units = g_new0(uint32_t, num_units);
-    if (!units) {
-        error_report("at91.spi: out of memory");
-        abort();
-    }
+    units = xfer_units_reserve(s, num_units);
 
     if (bits > 8) {     // 16bit storage
         uint16_t mask = ((1 << ((uint32_t)bits)) - 1);
@@ -470,16 +819,9 @@ static uint32_t xfer_transmit_dmabuf_novarps(SpiState *s, void *dmabuf, uint32_t
         }
     }
 
-    // if no server set up or it doesn't have a client: echo data to rcvbuf
-    if (!s->server || !s->server->client) {
-        buffer_reserve(&s->rcvbuf, num_units * sizeof(uint32_t));
-        buffer_append(&s->rcvbuf, units, num_units * sizeof(uint32_t));
-    }
-
-    xfer_master_wait_receive_start_dma(s, num_units);
-    iox_transmit_units(s, units, num_units);
-    g_free(units);
+    cycles = xfer_start_cycles(s, pcnr) + num_units * xfer_unit_cycles(s, pcnr, bits);
 
+    xfer_master_wait_receive_start(s, AT91_SPI_WAIT_RCV_DMA, num_units, cycles);
     return num_units;
 }
 
@@ -501,23 +843,26 @@ static void xfer_transmit_tdr_master_finish(SpiState *s)
 static void xfer_transmit_tdr(SpiState *s)
 {
     if (s->reg_mr & MR_MSTR) {              // master mode
+        // transfer in progress: data stays in TDR until the serializer is free
+        if (s->wait_rcv.ty != AT91_SPI_WAIT_RCV_NONE) {
+            s->tdr_pending = true;
+            s->reg_sr &= ~SR_TDRE;
+            return;
+        }
+
         uint8_t pcnr = pcs_to_nr(s, (((s->reg_mr & MR_PS) ? s->reg_tdr : s->reg_mr) >> 16) & 0x0F);
         uint8_t bits = num_transmit_bits(s, pcnr);
         uint16_t data = s->reg_tdr & ((1 << ((uint32_t)bits)) - 1);
-        uint32_t unit = to_xfer_unit(pcnr, bits, data);
-
-        s->serializer = s->reg_tdr;
+        uint32_t *unit = xfer_units_reserve(s, 1);
 
-        // if no server set up or it doesn't have a client: echo data to rcvbuf
-        if (!s->server || !s->server->client) {
-            buffer_reserve(&s->rcvbuf, sizeof(uint32_t));
-            buffer_append(&s->rcvbuf, &unit, sizeof(uint32_t));
-        }
+        *unit = to_xfer_unit(pcnr, bits, data);
+        if ((s->reg_mr & MR_PS) && (s->reg_tdr & TDR_LASTXFER))
+            *unit |= XFER_UNIT_LASTXFER;
 
-        // TODO: lastxfer?
+        s->serializer = s->reg_tdr;
 
-        xfer_master_wait_receive_start_tdr(s);
-        iox_transmit_units(s, &unit, 1);
+        xfer_master_wait_receive_start(s, AT91_SPI_WAIT_RCV_TDR, 1,
+                                       xfer_start_cycles(s, pcnr) + xfer_unit_cycles(s, pcnr, bits));
     } else {                                // slave mode
         // Master needs to initiate transfer. It is possible to fill serializer
         // and transmit data register in preparation.
@@ -580,7 +925,7 @@ static void xfer_dma_do_tcr_master_finish(SpiState *s)
         xfer_dma_do_tcr_master_start(s);
     } else {
         s->dma_tx_enabled = false;
-        s->reg_sr |= SR_TXBUFE;
+        s->reg_sr |= SR_TXBUFE | SR_TXEMPTY;
     }
 
     s->reg_sr |= SR_ENDTX;
@@ -607,6 +952,10 @@ static void xfer_dma_tx_start(void *opaque)
         s->pdc.reg_tnpr = 0;
     }
 
+    // transfer in progress: started once it has been completed
+    if (s->wait_rcv.ty != AT91_SPI_WAIT_RCV_NONE)
+        return;
+
     if (s->pdc.reg_tcr)
         xfer_dma_do_tcr_master_start(s);
 }
@@ -618,23 +967,110 @@ static void xfer_dma_tx_stop(void *opaque)
 }
 
 
-static void iox_receive_data(SpiState *s, struct iox_data_frame *frame)
+/*
+ * Drop the first units of a response that are still owed to transfers
+ * completed by the timeout. Returns the number of units to skip.
+ */
+static uint32_t iox_receive_skip_owed(SpiState *s, uint32_t n)
+{
+    uint32_t skip = MIN(s->owed, n);
+
+    if (skip)
+        info_report("at91.spi: dropping %u units of late response", skip);
+
+    s->owed -= skip;
+    return skip;
+}
+
+static bool iox_receive_expected(SpiState *s)
 {
     if (s->wait_rcv.ty == AT91_SPI_WAIT_RCV_NONE) {
         warn_report("at91.spi: not expecting any data, dropping it");
-        return;
+        return false;
+    }
+
+    if (s->wait_rcv.received) {
+        warn_report("at91.spi: received more data than expected, dropping overflow");
+        return false;
     }
 
-    buffer_reserve(&s->rcvbuf, frame->len);
-    buffer_append(&s->rcvbuf, frame->payload, frame->len);
+    return true;
+}
+
+static void iox_receive_complete(SpiState *s)
+{
+    if (s->rcvbuf.offset < s->wait_rcv.n * sizeof(uint32_t))
+        return;
+
+    if (s->rcvbuf.offset > s->wait_rcv.n * sizeof(uint32_t))
+        warn_report("at91.spi: received more data than expected, dropping overflow");
 
-    if (s->rcvbuf.offset >= s->wait_rcv.n * sizeof(uint32_t)) {
-        if (s->rcvbuf.offset > s->wait_rcv.n * sizeof(uint32_t))
-            warn_report("at91.spi: received more data than expected, dropping overflow");
+    s->wait_rcv.received = true;
+    iox_server_set_response_pending(s->server, false);
 
+    // otherwise completed by the timer once the transfer time has passed
+    if (qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) >= s->wait_rcv.end)
         xfer_master_wait_receive_finish(s);
-        buffer_reset(&s->rcvbuf);
+}
+
+static void iox_receive_data(SpiState *s, struct iox_data_frame *frame)
+{
+    uint32_t skip = iox_receive_skip_owed(s, frame->len / sizeof(uint32_t));
+    uint32_t off = skip * sizeof(uint32_t);
+
+    if (off == frame->len)
+        return;
+
+    if (!iox_receive_expected(s))
+        return;
+
+    buffer_reserve(&s->rcvbuf, frame->len - off);
+    buffer_append(&s->rcvbuf, frame->payload + off, frame->len - off);
+
+    iox_receive_complete(s);
+}
+
+static void iox_receive_packed(SpiState *s, struct iox_data_frame *frame)
+{
+    uint8_t pcnr, bits, size;
+    uint32_t n, skip, *units;
+
+    if (frame->len < SPI_PACKED_HDR_LEN) {
+        warn_report("at91.spi: invalid packed data frame, dropping it");
+        return;
+    }
+
+    pcnr = frame->payload[0];
+    bits = frame->payload[1];
+    size = bits > 8 ? sizeof(uint16_t) : sizeof(uint8_t);
+    n = (frame->len - SPI_PACKED_HDR_LEN) / size;
+
+    if (pcnr >= 16 || bits < 8 || bits > 16) {
+        warn_report("at91.spi: invalid packed data frame, dropping it");
+        return;
     }
+
+    skip = iox_receive_skip_owed(s, n);
+    if (skip == n)
+        return;
+
+    if (!iox_receive_expected(s))
+        return;
+
+    n -= skip;
+
+    // convert to units, the format the transfer is completed from
+    buffer_reserve(&s->rcvbuf, n * sizeof(uint32_t));
+    units = (uint32_t *)buffer_end(&s->rcvbuf);
+
+    for (uint32_t i = 0; i < n; i++) {
+        const uint8_t *p = frame->payload + SPI_PACKED_HDR_LEN + (skip + i) * size;
+        units[i] = to_xfer_unit(pcnr, bits, size == 1 ? *p : lduw_le_p(p));
+    }
+
+    s->rcvbuf.offset += n * sizeof(uint32_t);
+
+    iox_receive_complete(s);
 }
 
 static void iox_receive(struct iox_data_frame *frame, void *opaque)
@@ -647,6 +1083,10 @@ static void iox_receive(struct iox_data_frame *frame, void *opaque)
         case IOX_CID_DATA_IN:
             iox_receive_data(s, frame);
             break;
+
+        case IOX_CID_DATA_PACKED_IN:
+            iox_receive_packed(s, frame);
+            break;
         }
         break;
 
@@ -721,11 +1161,15 @@ static void spi_mmio_write(void *opaque, hwaddr offset, uint64_t value, unsigned
             s->reg_sr |= SR_SPIENS | SR_TDRE | SR_TXEMPTY;
         }
         if (value & CR_SPIDIS) {
+            xfer_master_cancel(s);
             s->reg_sr &= ~(SR_SPIENS | SR_TDRE | SR_TXEMPTY);
         }
         if (value & CR_SWRST) {
             // TODO: keep enabled?
 
+            // a running transfer must not complete into the reset registers
+            xfer_master_cancel(s);
+
             // SPEC: Reset the SPI. A software-triggered hardware reset of the
             // SPI interface is performed. The SPI is in slave mode after
             // software reset.
@@ -751,7 +1195,13 @@ static void spi_mmio_write(void *opaque, hwaddr offset, uint64_t value, unsigned
             // peripheral by raising the corresponding NPCS line as soon as TD
             // transfer has completed.
 
-            // currently ignored as NPCS lines are not emulated
+            // Mark the unit waiting in TD, if any. Otherwise, data of a
+            // running transfer has already been sent, so release a held chip
+            // select right away. Without either, there is nothing to do.
+            if (s->tdr_pending)
+                s->lastxfer = true;
+            else if (s->cs_active >= 0)
+                xfer_cs_deassert(s);
         }
         update_irq(s);
         break;
@@ -864,10 +1314,27 @@ static void spi_device_realize(DeviceState *dev, Error **errp)
 {
     SpiState *s = AT91_SPI(dev);
     spi_reset_registers(s);
+    s->cs_active = -1;
 
     buffer_init(&s->rcvbuf, "at91.spi.rcvbuf");
     buffer_reserve(&s->rcvbuf, 1024);
 
+    buffer_init(&s->sndbuf, "at91.spi.sndbuf");
+    buffer_reserve(&s->sndbuf, 1024);
+
+    buffer_init(&s->pktbuf, "at91.spi.pktbuf");
+
+    s->xfer_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, xfer_master_timer, s);
+
+    for (int i = 0; i < ARRAY_SIZE(s->ssi); i++) {
+        g_autofree char *name = NULL;
+
+        if (s->bus_name)
+            name = g_strdup_printf("%s.cs%d", s->bus_name, i);
+
+        s->ssi[i] = ssi_create_bus(dev, name);
+    }
+
     if (s->socket) {
         SocketAddress addr;
         addr.type = SOCKET_ADDRESS_TYPE_UNIX;
@@ -880,6 +1347,7 @@ static void spi_device_realize(DeviceState *dev, Error **errp)
         }
 
         iox_server_set_handler(srv, iox_receive, s);
+        iox_server_set_iothread(srv, s->iothread);
 
         if (iox_server_open(srv, &addr, errp))
             return;
@@ -898,20 +1366,83 @@ static void spi_device_unrealize(DeviceState *dev, Error **errp)
         s->server = NULL;
     }
 
+    timer_free(s->xfer_timer);
+    s->xfer_timer = NULL;
+
     buffer_free(&s->rcvbuf);
+    buffer_free(&s->sndbuf);
+    buffer_free(&s->pktbuf);
 }
 
 static void spi_device_reset(DeviceState *dev)
 {
     SpiState *s = AT91_SPI(dev);
+
+    xfer_master_cancel(s);
     spi_reset_registers(s);
+
+    // devices may have been attached after realize, start with all deselected
+    for (int i = 0; i < ARRAY_SIZE(s->ssi); i++)
+        xfer_ssi_set_cs(s->ssi[i], false);
 }
 
 static Property spi_device_properties[] = {
     DEFINE_PROP_STRING("socket", SpiState, socket),
+    DEFINE_PROP_LINK("iothread", SpiState, iothread, TYPE_IOTHREAD, IOThread *),
+    DEFINE_PROP_UINT32("timeout", SpiState, timeout, 100000),
+    DEFINE_PROP_BOOL("packed", SpiState, packed, false),
+    DEFINE_PROP_STRING("bus-name", SpiState, bus_name),
     DEFINE_PROP_END_OF_LIST(),
 };
 
+static int spi_post_load(void *opaque, int version_id)
+{
+    SpiState *s = opaque;
+
+    iox_server_set_response_pending(s->server, s->wait_rcv.ty != AT91_SPI_WAIT_RCV_NONE
+                                               && !s->wait_rcv.received);
+    return 0;
+}
+
+/*
+ * Note: If a master transfer is waiting for data from the client
+ * (wait_rcv.ty != AT91_SPI_WAIT_RCV_NONE), it completes as soon as the
+ * (re-connected) client sends its response, or with idle data after the
+ * timeout.
+ */
+static const VMStateDescription vmstate_at91_spi = {
+    .name = "at91-spi",
+    .version_id = 6,
+    .minimum_version_id = 6,
+    .post_load = spi_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_IOX_BUFFER(rcvbuf, SpiState),
+        VMSTATE_IOX_BUFFER(sndbuf, SpiState),
+        VMSTATE_UINT32(mclk, SpiState),
+        VMSTATE_UINT32(reg_mr, SpiState),
+        VMSTATE_UINT32(reg_sr, SpiState),
+        VMSTATE_UINT32(reg_imr, SpiState),
+        VMSTATE_UINT32(reg_rdr, SpiState),
+        VMSTATE_UINT32(reg_tdr, SpiState),
+        VMSTATE_UINT32_ARRAY(reg_csr, SpiState, 4),
+        VMSTATE_UINT16(serializer, SpiState),
+        VMSTATE_BOOL(dma_rx_enabled, SpiState),
+        VMSTATE_BOOL(dma_tx_enabled, SpiState),
+        VMSTATE_UINT32(wait_rcv.ty, SpiState),
+        VMSTATE_UINT32(wait_rcv.n, SpiState),
+        VMSTATE_INT64(wait_rcv.end, SpiState),
+        VMSTATE_BOOL(wait_rcv.received, SpiState),
+        VMSTATE_UINT32(wait_rcv.mr, SpiState),
+        VMSTATE_UINT32(owed, SpiState),
+        VMSTATE_BOOL(tdr_pending, SpiState),
+        VMSTATE_BOOL(lastxfer, SpiState),
+        VMSTATE_INT8(cs_active, SpiState),
+        VMSTATE_TIMER_PTR(xfer_timer, SpiState),
+        VMSTATE_AT91_PDC(pdc, SpiState),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 static void spi_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -920,6 +1451,7 @@ static void spi_class_init(ObjectClass *klass, void *data)
     dc->unrealize = spi_device_unrealize;
     dc->reset = spi_device_reset;
     device_class_set_props(dc, spi_device_properties);
+    dc->vmsd = &vmstate_at91_spi;
 }
 
 static const TypeInfo spi_device_info = {
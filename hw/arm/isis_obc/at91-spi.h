@@ -4,7 +4,8 @@
  * Emulation of devices connected to the SPI is done via outside processes
  * communicating via the IOX server (for details see ioxfer-server.h). The
  * socket address can be set via the "socket" property (as is done and defined
- * in iobc_board.c).
+ * in iobc_board.c), socket I/O can be moved to an I/O thread via the
+ * "iothread" property.
  *
  * Multiple operations are possible via the IOX server. For data transfer
  * these are:
@@ -12,17 +13,65 @@
  *   IOX_CID_DATA_OUT, Payload contains raw data).
  * - Transfer data from client process to AT91 (category IOX_CAT_DATA, ID
  *   IOX_CID_DATA_IN, payload contains raw data).
+ * By default, data is exchanged as sequence of 32 bit (native endian) units,
+ * each containing chip-select number (bits 24-31), number of bits minus eight
+ * (bits 16-23) and data (bits 0-15).
+ *
+ * Alternatively, with the "packed" property set, data is sent as one frame
+ * per chip-select assertion (category IOX_CAT_DATA, ID IOX_CID_DATA_PACKED_OUT)
+ * with a four byte header (chip-select number, number of bits, flags,
+ * reserved) followed by the data, one byte per unit for eight bit units, two
+ * bytes (little endian) otherwise. A frame ends at a change of chip select and
+ * at LASTXFER. Frames exceeding the maximum payload length are split, only the
+ * last part of a chip-select assertion has flag SPI_PACKED_FLAG_END (bit 0)
+ * set, indicating that the chip select is deasserted afterwards. A frame
+ * without data may be sent to deassert the chip select after the fact (e.g.
+ * for LASTXFER written to SPI_CR, or once a transfer has completed without
+ * CSAAT set and without the guest having reloaded TDR). The client responds
+ * to each frame with one frame in the same format (ID IOX_CID_DATA_PACKED_IN,
+ * flags ignored) containing the same number of units. Responses in packed
+ * format are accepted regardless of the property.
  * Particular care should be taken regarding the synchronous transmit/receive
  * nature of the SPI interface: SPI tranfers can only read and write at the
  * same time, meaning when data is being sent by the AT91, it intrinsically
  * receives the same amount of data at the same time. Due to this, as soon as
- * the AT91 (master mode) initiates a data transfer (sends data), the
- * emulation is paused until the client has sent back the same amount of data,
- * which is considered to be read during the transmit operation. Failure of
- * the client to send this data will block the emulation. Excess data is
- * ignored. In essence, a client for the AT91 SPI in master mode should always
- * follow up a data frame receival by sending the exact same amount of data
- * back.
+ * the AT91 (master mode) initiates a data transfer (sends data), the transfer
+ * is only completed once the client has sent back the same amount of data,
+ * which is considered to be read during the transmit operation. Excess data
+ * is ignored. In essence, a client for the AT91 SPI in master mode should
+ * always follow up a data frame receival by sending the exact same amount of
+ * data back.
+ *
+ * Transfers are asynchronous, the guest keeps running while waiting for the
+ * client. Each transfer takes the time given by the chip-select registers
+ * (DLYBS once, SCBR per bit and DLYBCT per unit) in virtual time. RDRF,
+ * ENDRX and RXBUFF are raised once this time has passed and the response of
+ * the client has been received. If the client does not respond within the
+ * time set via the "timeout" property (in microseconds, default 100 ms,
+ * zero to wait indefinitely) after that, a warning is printed and the
+ * transfer is completed with all bits of the missing units set, as if no
+ * device had driven MISO. The units the client still owes are dropped once
+ * they arrive, so the responses to following transfers stay in sync. While
+ * waiting for the client, idle-warp (see iobc-idle_warp.h) is held off, so
+ * the timeout passes in real time. Without connected client, the sent data
+ * is echoed back.
+ *
+ * In-process devices:
+ * For each of the four chip selects (NPCS0 to NPCS3), an SSI bus is provided
+ * to which QEMU SSI slave devices (e.g. m25p80 flash or the FM25V F-RAM of
+ * spi-fram.h) can be attached. The buses are named "<bus-name>.cs<n>", with
+ * the prefix set via the "bus-name" property ("spi0" and "spi1" on the iOBC
+ * board), e.g.
+ *
+ *   -device fm25v,bus=spi0.cs0,file=fram.bin
+ *
+ * Transfers to a chip select with attached device are handled in-process
+ * without involving IOX, with the chip-select line driven according to
+ * CSAAT and LASTXFER. As on the AT91, without CSAAT the chip select is only
+ * deasserted once a transfer completes and no further data has been written
+ * to TDR (or queued via DMA) in the meantime. Chip selects without attached
+ * device, decoded chip selects (PCSDEC), and transfers spanning both kinds of
+ * chip selects go via IOX as described above.
  *
  * As due to the different nature of the transport it is not possible to
  * emulate all failure modes and flags. Thus a mechanism for fault injection
@@ -45,7 +94,9 @@
 #define HW_ARM_ISIS_OBC_SPI_H
 
 #include "qemu/osdep.h"
+#include "qemu/timer.h"
 #include "hw/sysbus.h"
+#include "hw/ssi/ssi.h"
 
 #include "at91-pdc.h"
 #include "ioxfer-server.h"
@@ -69,8 +120,19 @@ typedef struct {
     qemu_irq irq;
 
     char* socket;
+    IOThread *iothread;
     IoXferServer *server;
     Buffer rcvbuf;
+    Buffer sndbuf;
+    Buffer pktbuf;
+    bool packed;
+
+    char *bus_name;
+    SSIBus *ssi[4];
+    int8_t cs_active;
+
+    uint32_t timeout;
+    QEMUTimer *xfer_timer;
 
     unsigned mclk;
 
@@ -88,7 +150,13 @@ typedef struct {
     struct {
         enum wait_rcv_type ty;
         uint32_t n;
+        int64_t end;
+        bool received;
+        uint32_t mr;
     } wait_rcv;
+    uint32_t owed;
+    bool tdr_pending;
+    bool lastxfer;
 
     At91Pdc pdc;
 } SpiState;
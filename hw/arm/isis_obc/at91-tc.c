@@ -17,6 +17,7 @@
 #include "at91-pmc.h"
 #include "qemu/error-report.h"
 #include "hw/irq.h"
+#include "migration/vmstate.h"
 
 
 #define TC_CCR      0x00
@@ -106,6 +107,12 @@ static void tc_irq_update(TcChanState *s)
     qemu_set_irq(s->irq, !!(s->reg_sr & s->reg_imr & 0xff));
 }
 
+static void tc_clk_rebase(TcChanState *s)
+{
+    s->ref_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    s->ref_ticks = 0;
+}
+
 static void tc_clk_update(TcChanState *s)
 {
     unsigned clock = 0;
@@ -151,67 +158,40 @@ static void tc_clk_update(TcChanState *s)
 
     // note: BURST is not implemented
 
+    // callers must sync the counter before changing its clock
     s->clk = clock;
-
-    if (s->timer && s->clk) {
-        ptimer_transaction_begin(s->timer);
-        ptimer_set_freq(s->timer, s->clk);
-        ptimer_transaction_commit(s->timer);
-    }
+    tc_clk_rebase(s);
 }
 
-static void tc_clk_start(TcChanState *s)
-{
-    if (!(s->reg_sr & SR_CLKSTA))
-        return;
-
-    ptimer_transaction_begin(s->timer);
-    ptimer_set_freq(s->timer, s->clk);
-    ptimer_set_limit(s->timer, 1, 0);
-    ptimer_run(s->timer, 0);
-    ptimer_transaction_commit(s->timer);
-}
 
-static void tc_clk_stop(TcChanState *s)
-{
-    ptimer_transaction_begin(s->timer);
-    ptimer_stop(s->timer);
-    ptimer_transaction_commit(s->timer);
-}
-
-void at91_tc_set_master_clock(TcState *s, unsigned mclk)
-{
-    s->mclk = mclk;
-
-    for (int i = 0; i < AT91_TC_NUM_CHANNELS; i++)
-        tc_clk_update(&s->chan[i]);
-}
+/*
+ * Counter model.
+ *
+ * Instead of running a callback for each counter clock tick, the counter
+ * value is computed lazily: Whenever the channel is accessed, the number of
+ * ticks elapsed since the last access is computed from the virtual clock and
+ * the counter is advanced by that amount (tc_sync). Ticks that do not change
+ * anything but the counter value (i.e. ticks not hitting a compare value,
+ * overflow, or direction change) are skipped in bulk. A timer is only armed
+ * for the next tick setting a status flag that has its interrupt enabled
+ * (tc_schedule).
+ *
+ * The tc_count_* functions only operate on the counter state (cv, sr, cstep,
+ * running) and can thus be used on copies of the channel state.
+ */
 
-static void tc_trigger(TcChanState *s)
+static uint32_t tc_count_cmp(TcChanState *s)
 {
-    if (s->reg_cmr & CMR_WAVE) {
-        if (!(CMR_WAVSEL(s) & 0x01)) {      // sawtooth
-            s->reg_cv = 0;
-        } else {                            // triangular
-            s->cstep = -(s->cstep);
-        }
-
-    } else {
-        s->reg_cv = 0;
-    }
-
-    tc_clk_start(s);
+    return (CMR_WAVSEL(s) & 0x02) ? s->reg_rc : 0xffff;
 }
 
-static void tc_timer_tick(void *opaque)
+static void tc_count_tick(TcChanState *s)
 {
-    TcChanState *s = opaque;
-
     if (s->reg_cv == 0xffff)
         s->reg_sr |= SR_COVFS;
 
     if (s->reg_cmr & CMR_WAVE) {
-        uint32_t cmp = (CMR_WAVSEL(s) & 0x02) ? s->reg_rc : 0xffff;
+        uint32_t cmp = tc_count_cmp(s);
 
         if (!(CMR_WAVSEL(s) & 0x01)) {      // sawtooth
             if (s->reg_cv == cmp)
@@ -231,18 +211,18 @@ static void tc_timer_tick(void *opaque)
             s->reg_sr |= SR_CPAS;
 
         if (s->reg_cv == s->reg_rb)
-            s->reg_sr |= SR_CPAS;
+            s->reg_sr |= SR_CPBS;
 
         if (s->reg_cv == s->reg_rc) {
             s->reg_sr |= SR_CPCS;
 
             if (s->reg_cmr & CMR_CPCDIS) {
                 s->reg_sr &= ~SR_CLKSTA;
-                tc_clk_stop(s);
+                s->running = false;
             }
 
             if (s->reg_cmr & CMR_CPCSTOP)
-                tc_clk_stop(s);
+                s->running = false;
         }
 
     } else {
@@ -257,12 +237,235 @@ static void tc_timer_tick(void *opaque)
     }
 
     // not implemented: register capture on edge detection
+}
+
+/*
+ * Number of upcoming ticks that only increment (or decrement) the counter
+ * value, i.e. that can be skipped without evaluating them one by one.
+ */
+static uint32_t tc_count_plain_ticks(TcChanState *s)
+{
+    bool wave = s->reg_cmr & CMR_WAVE;
+    uint32_t cmp = tc_count_cmp(s);
+    uint32_t post[3] = { s->reg_rc, s->reg_rc, s->reg_rc };
+    uint32_t cv = s->reg_cv;
+    uint32_t limit;
+
+    if (wave) {
+        post[0] = s->reg_ra;
+        post[1] = s->reg_rb;
+    }
+
+    if (!wave || !(CMR_WAVSEL(s) & 0x01) || s->cstep > 0) {
+        // counting up: stop before overflow, cmp, or hitting a compare value
+        limit = 0xffff;
+
+        if (wave && cmp >= cv && cmp < limit)
+            limit = cmp;
+
+        if (wave && (CMR_WAVSEL(s) & 0x01) && cv == 0)
+            limit = 0;
+
+        for (int i = 0; i < 3; i++) {
+            if (post[i] > cv && post[i] - 1 < limit)
+                limit = post[i] - 1;
+        }
+
+        return limit - cv;
+
+    } else {
+        // counting down: stop before zero, cmp, or hitting a compare value
+        if (cv == 0xffff)
+            return 0;
+
+        limit = 0;
+
+        if (cmp <= cv && cmp > limit)
+            limit = cmp;
+
+        for (int i = 0; i < 3; i++) {
+            if (post[i] < cv && post[i] + 1 > limit)
+                limit = post[i] + 1;
+        }
+
+        return cv - limit;
+    }
+}
+
+/*
+ * Advance the counter by the given number of ticks, or until the counter
+ * stops or a flag in stop_mask has been newly set. Returns the number of
+ * ticks processed.
+ */
+static uint64_t tc_count_advance(TcChanState *s, uint64_t ticks, uint32_t stop_mask)
+{
+    uint64_t done = 0;
+
+    while (done < ticks && s->running) {
+        uint64_t n = MIN(tc_count_plain_ticks(s), ticks - done);
+        uint32_t sr;
+
+        if (n) {
+            if ((s->reg_cmr & CMR_WAVE) && (CMR_WAVSEL(s) & 0x01) && s->cstep < 0)
+                s->reg_cv -= n;
+            else
+                s->reg_cv += n;
+
+            done += n;
+            continue;
+        }
+
+        sr = s->reg_sr;
+        tc_count_tick(s);
+        done += 1;
+
+        if (s->reg_sr & ~sr & stop_mask)
+            break;
+    }
+
+    return done;
+}
+
+/*
+ * Length of the counter cycle in ticks, or zero if the counter has not yet
+ * entered its cycle (e.g. when CV is above RC). The counter is guaranteed to
+ * enter its cycle after at most 0x10001 ticks.
+ */
+static uint64_t tc_count_period(TcChanState *s)
+{
+    uint32_t cmp = tc_count_cmp(s);
+
+    if (s->reg_cmr & CMR_WAVE) {
+        if (!(CMR_WAVSEL(s) & 0x01)) {      // sawtooth
+            return s->reg_cv <= cmp ? cmp + 1 : 0;
+        } else if (cmp == 0) {              // triangular, degenerate
+            return (s->cstep < 0 || s->reg_cv == 0) ? 0x10000 : 0;
+        } else {                            // triangular
+            return s->reg_cv <= cmp ? 2 * cmp : 0;
+        }
+
+    } else if ((s->reg_cmr & CMR_CPCTRG) && s->reg_rc) {
+        return s->reg_cv < s->reg_rc ? s->reg_rc : 0;
+
+    } else {
+        return 0x10000;
+    }
+}
+
+static void tc_count_run(TcChanState *s, uint64_t ticks)
+{
+    uint64_t period = tc_count_period(s);
+
+    if (!period && ticks > 0x10001) {
+        ticks -= tc_count_advance(s, 0x10001, 0);
+        period = tc_count_period(s);
+    }
+
+    // status flags are sticky, so after one full cycle the remaining full
+    // cycles do not change anything
+    if (period && ticks > 2 * period) {
+        ticks -= tc_count_advance(s, period, 0);
+        ticks %= period;
+    }
+
+    tc_count_advance(s, ticks, 0);
+}
+
+static void tc_sync(TcChanState *s)
+{
+    uint64_t total;
+
+    if (!s->running || !s->clk)
+        return;
+
+    total = muldiv64(qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) - s->ref_ns,
+                     s->clk, NANOSECONDS_PER_SECOND);
+
+    tc_count_run(s, total - s->ref_ticks);
+    s->ref_ticks = total;
 
     tc_irq_update(s);
 }
 
+static void tc_schedule(TcChanState *s)
+{
+    uint32_t wanted = s->reg_imr & ~s->reg_sr & (SR_COVFS | SR_CPAS | SR_CPBS | SR_CPCS);
+    TcChanState tmp;
+    uint64_t n;
+
+    if (!s->running || !s->clk || !wanted) {
+        timer_del(s->timer);
+        return;
+    }
+
+    // every flag is set at least once within entering the cycle plus one
+    // full cycle, so if we don't find it here, it will never be set
+    tmp = *s;
+    n = tc_count_advance(&tmp, 0x20001, wanted);
+
+    if (!(tmp.reg_sr & wanted)) {
+        timer_del(s->timer);
+        return;
+    }
+
+    timer_mod(s->timer, s->ref_ns + 1 + muldiv64(s->ref_ticks + n,
+                                                 NANOSECONDS_PER_SECOND, s->clk));
+}
+
+static void tc_clk_start(TcChanState *s)
+{
+    if (!(s->reg_sr & SR_CLKSTA))
+        return;
+
+    s->running = true;
+    tc_clk_rebase(s);
+}
+
+static void tc_clk_stop(TcChanState *s)
+{
+    s->running = false;
+    timer_del(s->timer);
+}
+
+void at91_tc_set_master_clock(TcState *s, unsigned mclk)
+{
+    s->mclk = mclk;
+
+    for (int i = 0; i < AT91_TC_NUM_CHANNELS; i++) {
+        tc_sync(&s->chan[i]);
+        tc_clk_update(&s->chan[i]);
+        tc_schedule(&s->chan[i]);
+    }
+}
+
+static void tc_trigger(TcChanState *s)
+{
+    if (s->reg_cmr & CMR_WAVE) {
+        if (!(CMR_WAVSEL(s) & 0x01)) {      // sawtooth
+            s->reg_cv = 0;
+        } else {                            // triangular
+            s->cstep = -(s->cstep);
+        }
+
+    } else {
+        s->reg_cv = 0;
+    }
+
+    tc_clk_start(s);
+}
+
+static void tc_timer_tick(void *opaque)
+{
+    TcChanState *s = opaque;
+
+    tc_sync(s);
+    tc_schedule(s);
+}
+
 static uint64_t tc_chan_mmio_read(TcChanState *s, hwaddr offset, unsigned size)
 {
+    tc_sync(s);
+
     switch (offset) {
     case TC_CMR:
         return s->reg_cmr;
@@ -285,6 +488,7 @@ static uint64_t tc_chan_mmio_read(TcChanState *s, hwaddr offset, unsigned size)
             s->reg_sr &= ~(SR_COVFS | SR_LOVRS | SR_CPAS | SR_CPBS | SR_CPCS
                            | SR_LDRAS | SR_LDRBS | SR_ETRGS);
             tc_irq_update(s);
+            tc_schedule(s);
             return tmp;
         }
 
@@ -299,6 +503,8 @@ static uint64_t tc_chan_mmio_read(TcChanState *s, hwaddr offset, unsigned size)
 
 static void tc_chan_mmio_write(TcChanState *s, hwaddr offset, uint64_t value, unsigned size)
 {
+    tc_sync(s);
+
     switch (offset) {
     case TC_CCR:
         if ((value & CCR_CLKEN) && !(value & CCR_CLKDIS)) {
@@ -363,6 +569,8 @@ static void tc_chan_mmio_write(TcChanState *s, hwaddr offset, uint64_t value, un
         error_report("at91.tc: illegal write access at 0x%02lx (value: 0x%02lx)", offset, value);
         abort();
     }
+
+    tc_schedule(s);
 }
 
 
@@ -411,8 +619,11 @@ static void tc_mmio_write(void *opaque, hwaddr offset, uint64_t value, unsigned
 
     case TC_BCR:
         if (value & BCR_SYNC) {
-            for (int i = 0; i < AT91_TC_NUM_CHANNELS; i++)
+            for (int i = 0; i < AT91_TC_NUM_CHANNELS; i++) {
+                tc_sync(&s->chan[i]);
                 tc_trigger(&s->chan[i]);
+                tc_schedule(&s->chan[i]);
+            }
         }
         return;
 
@@ -445,7 +656,7 @@ static void tc_device_init(Object *obj)
 
     for (int i = 0; i < AT91_TC_NUM_CHANNELS; i++) {
         s->chan[i].parent = s;
-        s->chan[i].timer = ptimer_init(tc_timer_tick, &s->chan[i], PTIMER_POLICY_DEFAULT);
+        s->chan[i].timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, tc_timer_tick, &s->chan[i]);
         sysbus_init_irq(sbd, &s->chan[i].irq);
     }
 
@@ -458,6 +669,8 @@ static void tc_reset_registers(TcState *s)
     s->reg_bmr = 0;
 
     for (int i = 0; i < AT91_TC_NUM_CHANNELS; i++) {
+        tc_clk_stop(&s->chan[i]);
+
         s->chan[i].cstep   = 1;
         s->chan[i].reg_cmr = 0;
         s->chan[i].reg_cv  = 0;
@@ -481,12 +694,48 @@ static void tc_device_reset(DeviceState *dev)
     tc_reset_registers(s);
 }
 
+static const VMStateDescription vmstate_at91_tc_chan = {
+    .name = "at91-tc-chan",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(clk, TcChanState),
+        VMSTATE_TIMER_PTR(timer, TcChanState),
+        VMSTATE_BOOL(running, TcChanState),
+        VMSTATE_INT64(ref_ns, TcChanState),
+        VMSTATE_UINT64(ref_ticks, TcChanState),
+        VMSTATE_INT32(cstep, TcChanState),
+        VMSTATE_UINT32(reg_cmr, TcChanState),
+        VMSTATE_UINT32(reg_cv, TcChanState),
+        VMSTATE_UINT32(reg_ra, TcChanState),
+        VMSTATE_UINT32(reg_rb, TcChanState),
+        VMSTATE_UINT32(reg_rc, TcChanState),
+        VMSTATE_UINT32(reg_sr, TcChanState),
+        VMSTATE_UINT32(reg_imr, TcChanState),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
+static const VMStateDescription vmstate_at91_tc = {
+    .name = "at91-tc",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_ARRAY(chan, TcState, AT91_TC_NUM_CHANNELS, 1,
+                             vmstate_at91_tc_chan, TcChanState),
+        VMSTATE_UINT32(mclk, TcState),
+        VMSTATE_UINT32(reg_bmr, TcState),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 static void tc_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
 
     dc->realize = tc_device_realize;
     dc->reset = tc_device_reset;
+    dc->vmsd = &vmstate_at91_tc;
 }
 
 static const TypeInfo tc_device_info = {
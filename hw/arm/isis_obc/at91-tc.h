@@ -13,7 +13,7 @@
 #define HW_ARM_ISIS_OBC_TC_H
 
 #include "qemu/osdep.h"
-#include "hw/ptimer.h"
+#include "qemu/timer.h"
 #include "hw/sysbus.h"
 
 
@@ -31,9 +31,15 @@ typedef struct {
     TcState *parent;
 
     unsigned clk;
-    ptimer_state *timer;
+    QEMUTimer *timer;
     qemu_irq irq;
 
+    // counter value is computed lazily from virtual time, based on the
+    // reference point (ref_ns, ref_ticks) set when the counter was started
+    bool running;
+    int64_t ref_ns;
+    uint64_t ref_ticks;
+
     int cstep;
     uint32_t reg_cmr;
     uint32_t reg_cv;
@@ -12,6 +12,7 @@
 // Overview of TODOs:
 // - Slave mode (only master mode implemented).
 // - Software-reset (CR_SWRST) not implemented.
+// - In-process slaves: no 10-bit addressing, no general call.
 
 #include "at91-twi.h"
 #include "exec/address-spaces.h"
@@ -19,6 +20,7 @@
 #include "qapi/error.h"
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
+#include "migration/vmstate.h"
 
 #define IOX_CAT_DATA            0x01
 #define IOX_CAT_FAULT           0x02
@@ -142,6 +144,102 @@ static int iox_send_chars(TwiState *s, uint8_t* data, unsigned len)
     return iox_send_data_multiframe_new(s->server, IOX_CAT_DATA, IOX_CID_DATA_OUT, len, data);
 }
 
+
+static bool xfer_i2c_present(TwiState *s)
+{
+    BusChild *kid;
+
+    QTAILQ_FOREACH(kid, &s->bus->qbus.children, sibling) {
+        if (I2C_SLAVE(kid->child)->address == MMR_DADR(s))
+            return true;
+    }
+
+    return false;
+}
+
+static void xfer_i2c_nack(TwiState *s)
+{
+    // SPEC: If a NACK is received, the STOP is automatically performed.
+    i2c_end_transfer(s->bus);
+    s->i2c.active = false;
+    s->i2c.stop = false;
+
+    // SPEC: Set at the same time as TXCOMP.
+    s->reg_sr |= SR_NACK | SR_TXCOMP;
+    twi_update_irq(s);
+}
+
+static bool xfer_i2c_start(TwiState *s, bool read)
+{
+    unsigned n;
+
+    s->i2c.stop = false;
+    s->reg_sr &= ~SR_TXCOMP;
+
+    // Internal address bytes are sent MSB first in a write transfer, reads
+    // continue after them with a repeated start.
+    if (!read || MMR_IADRSZ(s)) {
+        if (i2c_start_transfer(s->bus, MMR_DADR(s), 0))
+            goto nack;
+
+        for (n = MMR_IADRSZ(s); n > 0; n--) {
+            if (i2c_send(s->bus, (s->reg_iadr >> ((n - 1) * 8)) & 0xff))
+                goto nack;
+        }
+    }
+
+    if (read && i2c_start_transfer(s->bus, MMR_DADR(s), 1))
+        goto nack;
+
+    s->i2c.active = true;
+    return true;
+
+nack:
+    xfer_i2c_nack(s);
+    return false;
+}
+
+static void xfer_start(TwiState *s, bool read)
+{
+    // addresses without in-process slave are handled by the IOX client
+    s->i2c.local = xfer_i2c_present(s);
+
+    if (s->i2c.local)
+        xfer_i2c_start(s, read);
+    else
+        xfer_send_frame_start(s);
+}
+
+static void xfer_stop(TwiState *s)
+{
+    if (!s->i2c.local) {
+        xfer_send_frame_stop(s);
+        return;
+    }
+
+    if (s->i2c.active)
+        i2c_end_transfer(s->bus);
+
+    s->i2c.active = false;
+    s->i2c.stop = false;
+}
+
+static int xfer_send_chars(TwiState *s, uint8_t *data, unsigned len)
+{
+    unsigned i;
+
+    if (!s->i2c.local)
+        return iox_send_chars(s, data, len);
+
+    // after a NACK the transfer has been stopped, drop the remaining data
+    for (i = 0; i < len && s->i2c.active; i++) {
+        if (i2c_send(s->bus, data[i]))
+            xfer_i2c_nack(s);
+    }
+
+    return 0;
+}
+
 static int xfer_dma_tx_do_tcr(TwiState *s)
 {
     uint8_t *data = g_new0(uint8_t, s->pdc.reg_tcr);
@@ -156,7 +254,7 @@ static int xfer_dma_tx_do_tcr(TwiState *s)
         return -EIO;
     }
 
-    int status = iox_send_chars(s, data, s->pdc.reg_tcr);
+    int status = xfer_send_chars(s, data, s->pdc.reg_tcr);
     g_free(data);
 
     s->pdc.reg_tpr += s->pdc.reg_tcr;
@@ -172,9 +270,9 @@ static void xfer_chrtx_timer_tick(void *opaque)
     // If we reach this point, we assuem that the transmission writes to THR
     // are complete. Send all buffered data with start and stop frames.
 
-    xfer_send_frame_start(s);
-    iox_send_chars(s, s->sendbuf.buffer, s->sendbuf.offset);
-    xfer_send_frame_stop(s);
+    xfer_start(s, false);
+    xfer_send_chars(s, s->sendbuf.buffer, s->sendbuf.offset);
+    xfer_stop(s);
 
     buffer_reset(&s->sendbuf);
 
@@ -329,12 +427,80 @@ static void xfer_receiver_dma(TwiState *s)
 }
 
 
+static void xfer_i2c_recv(TwiState *s, bool last)
+{
+    uint8_t chr = i2c_recv(s->bus);
+
+    // the master acknowledges all but the last byte, followed by STOP
+    if (last) {
+        i2c_nack(s->bus);
+        i2c_end_transfer(s->bus);
+
+        s->i2c.active = false;
+        s->i2c.stop = false;
+        s->reg_sr |= SR_TXCOMP;
+    }
+
+    if (s->dma_rx_enabled && s->pdc.reg_rcr) {
+        buffer_reserve(&s->rcvbuf, 1);
+        buffer_append(&s->rcvbuf, &chr, 1);
+        xfer_receiver_dma(s);
+    } else {
+        xfer_chr_receive(s, chr);
+    }
+}
+
+static void xfer_i2c_recv_dma(TwiState *s)
+{
+    // In-process slaves are clocked on demand: fill the DMA buffers, the
+    // first byte after them is only received once the guest asks for it
+    // (via STOP or by reading RHR).
+    while (s->i2c.active && s->dma_rx_enabled && s->pdc.reg_rcr)
+        xfer_i2c_recv(s, s->i2c.stop);
+}
+
+static void xfer_read_start(TwiState *s, bool stop)
+{
+    xfer_start(s, true);
+
+    if (!s->i2c.active)
+        return;
+
+    // SPEC: In single data byte master read, the START and STOP must both
+    // be set.
+    if (stop)
+        xfer_i2c_recv(s, true);
+    else if (s->dma_rx_enabled && s->pdc.reg_rcr)
+        xfer_i2c_recv_dma(s);
+    else
+        xfer_i2c_recv(s, false);
+}
+
+static void xfer_read_stop(TwiState *s)
+{
+    if (!s->i2c.active)
+        return;
+
+    // SPEC: In multiple data bytes master read, the STOP must be set after
+    // the last data received but one.
+    //
+    // If that byte has not been read yet, the last byte is received when RHR
+    // is read. Otherwise (e.g. PDC transfer of all but the last byte), the
+    // last byte is received right away.
+    if (s->reg_sr & SR_RXRDY)
+        s->i2c.stop = true;
+    else
+        xfer_i2c_recv(s, true);
+}
+
+
 static void xfer_dma_rx_start(void *opaque)
 {
     TwiState *s = opaque;
 
     s->dma_rx_enabled = true;
     xfer_receiver_dma(s);
+    xfer_i2c_recv_dma(s);
 }
 
 static void xfer_dma_rx_stop(void *opaque)
@@ -350,7 +516,7 @@ static void xfer_dma_tx_start(void *opaque)
     if (!s->pdc.reg_tcr)
         return;
 
-    xfer_send_frame_start(s);
+    xfer_start(s, false);
 
     if (s->pdc.reg_tcr) {
         int status = xfer_dma_tx_do_tcr(s);
@@ -374,7 +540,7 @@ static void xfer_dma_tx_start(void *opaque)
         }
     }
 
-    xfer_send_frame_stop(s);
+    xfer_stop(s);
 
     s->reg_sr |= SR_ENDTX | SR_TXBUFE | SR_TXCOMP | SR_TXRDY;
     twi_update_irq(s);
@@ -476,9 +642,17 @@ static uint64_t twi_mmio_read(void *opaque, hwaddr offset, unsigned size)
         return s->reg_imr;
 
     case TWI_RHR:
-        s->reg_sr &= ~SR_RXRDY;
-        twi_update_irq(s);
-        return s->reg_rhr;
+        {
+            uint32_t rhr = s->reg_rhr;
+            s->reg_sr &= ~SR_RXRDY;
+
+            // in-process slave: the master continues with the next byte
+            if (s->i2c.active && !s->dma_rx_enabled)
+                xfer_i2c_recv(s, s->i2c.stop);
+
+            twi_update_irq(s);
+            return rhr;
+        }
 
     case PDC_START...PDC_END:
         return at91_pdc_get_register(&s->pdc, offset);
@@ -500,7 +674,11 @@ static void twi_mmio_write(void *opaque, hwaddr offset, uint64_t value, unsigned
             if (s->mode != AT91_TWI_MODE_MASTER || !(s->reg_mmr & MMR_MREAD))
                 warn_report("at91.twi: sending start frame when not in master-read mode");
 
-            xfer_send_frame_start(s);
+            // writes to in-process slaves start with the first character
+            if (s->reg_mmr & MMR_MREAD)
+                xfer_read_start(s, value & CR_STOP);
+            else if (!xfer_i2c_present(s))
+                xfer_send_frame_start(s);
 
             // SPEC: A frame beginning with a START bit is transmitted
             // according to the features defined in the mode register.
@@ -514,7 +692,13 @@ static void twi_mmio_write(void *opaque, hwaddr offset, uint64_t value, unsigned
             if (s->mode != AT91_TWI_MODE_MASTER)
                 warn_report("at91.twi: sending stop frame when not in master mode");
 
-            xfer_send_frame_stop(s);
+            // Decide by the current address, the last transfer may have gone
+            // elsewhere. Single byte reads from in-process slaves are done
+            // with START, writes to them stop on their own.
+            if (!xfer_i2c_present(s))
+                xfer_send_frame_stop(s);
+            else if ((s->reg_mmr & MMR_MREAD) && !(value & CR_START))
+                xfer_read_stop(s);
 
             // SPEC: STOP Condition is sent just after completing the current
             // byte transmission in master read mode.
@@ -687,6 +871,10 @@ static void twi_reset_registers(TwiState *s)
 
     s->dma_rx_enabled = false;
 
+    s->i2c.local = false;
+    s->i2c.active = false;
+    s->i2c.stop = false;
+
     twi_update_clock(s);
 }
 
@@ -694,6 +882,8 @@ static void twi_device_realize(DeviceState *dev, Error **errp)
 {
     TwiState *s = AT91_TWI(dev);
 
+    s->bus = i2c_init_bus(dev, "i2c");
+
     twi_reset_registers(s);
 
     buffer_init(&s->rcvbuf, "at91.twi.rcvbuf");
@@ -714,6 +904,7 @@ static void twi_device_realize(DeviceState *dev, Error **errp)
         }
 
         iox_server_set_handler(srv, iox_receive, s);
+        iox_server_set_iothread(srv, s->iothread);
 
         if (iox_server_open(srv, &addr, errp))
             return;
@@ -738,14 +929,46 @@ static void twi_device_unrealize(DeviceState *dev, Error **errp)
 static void twi_device_reset(DeviceState *dev)
 {
     TwiState *s = AT91_TWI(dev);
+
+    if (s->i2c.active)
+        i2c_end_transfer(s->bus);
+
     twi_reset_registers(s);
 }
 
 static Property twi_device_properties[] = {
     DEFINE_PROP_STRING("socket", TwiState, socket),
+    DEFINE_PROP_LINK("iothread", TwiState, iothread, TYPE_IOTHREAD, IOThread *),
     DEFINE_PROP_END_OF_LIST(),
 };
 
+static const VMStateDescription vmstate_at91_twi = {
+    .name = "at91-twi",
+    .version_id = 2,
+    .minimum_version_id = 2,
+    .fields = (VMStateField[]) {
+        VMSTATE_IOX_BUFFER(rcvbuf, TwiState),
+        VMSTATE_IOX_BUFFER(sendbuf, TwiState),
+        VMSTATE_PTIMER(chrtx_timer, TwiState),
+        VMSTATE_UINT32(mode, TwiState),
+        VMSTATE_UINT32(mclk, TwiState),
+        VMSTATE_UINT32(clock, TwiState),
+        VMSTATE_UINT32(reg_mmr, TwiState),
+        VMSTATE_UINT32(reg_smr, TwiState),
+        VMSTATE_UINT32(reg_iadr, TwiState),
+        VMSTATE_UINT32(reg_cwgr, TwiState),
+        VMSTATE_UINT32(reg_sr, TwiState),
+        VMSTATE_UINT32(reg_imr, TwiState),
+        VMSTATE_UINT32(reg_rhr, TwiState),
+        VMSTATE_AT91_PDC(pdc, TwiState),
+        VMSTATE_BOOL(dma_rx_enabled, TwiState),
+        VMSTATE_BOOL(i2c.local, TwiState),
+        VMSTATE_BOOL(i2c.active, TwiState),
+        VMSTATE_BOOL(i2c.stop, TwiState),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 static void twi_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -754,6 +977,7 @@ static void twi_class_init(ObjectClass *klass, void *data)
     dc->unrealize = twi_device_unrealize;
     dc->reset = twi_device_reset;
     device_class_set_props(dc, twi_device_properties);
+    dc->vmsd = &vmstate_at91_twi;
 }
 
 static const TypeInfo twi_device_info = {
@@ -4,7 +4,8 @@
  * Emulation of devices connected to TWI/I2C is done via outside processes
  * communicating via the IOX server (for details see ioxfer-server.h). The
  * socket address can be set via the "socket" property (as is done and defined
- * in iobc_board.c).
+ * in iobc_board.c), socket I/O can be moved to an I/O thread via the
+ * "iothread" property.
  * - Transfer data from AT19 to client process (category IOX_CAT_DATA, ID
  *   IOX_CID_DATA_OUT, Payload contains raw data).
  * - Transfer data from client process to AT91 (category IOX_CAT_DATA, ID
@@ -30,6 +31,27 @@
  * - NACK (category IOX_CAT_FAULT, ID IOX_CID_FAULT_NACK)
  * - ARBLST (category IOX_CAT_FAULT, ID IOX_CID_FAULT_ARBLST)
  *
+ * In-process slaves:
+ * The TWI also provides an I2C bus named "i2c", to which QEMU I2C slave
+ * models can be attached by address, e.g. via
+ *
+ *   -device at24c-eeprom,bus=i2c,address=0x50,rom-size=8192
+ *   -device tmp105,bus=i2c,address=0x48
+ *
+ * Register-map peripherals driven by an external simulator can be attached
+ * via the i2c-regmap device (see i2c-regmap.h).
+ *
+ * Transfers addressing a slave on this bus (MMR.DADR) are done in-process and
+ * do not use the IOX server, transfers to all other addresses are forwarded
+ * to the IOX client as described above. Write transfers (THR or PDC) are
+ * sent as START, DADR+W, the IADR bytes (MSB first, as configured via
+ * MMR.IADRSZ), the data and STOP. Read transfers are started via CR_START and
+ * send the IADR bytes in a write transfer first, followed by a repeated
+ * START with DADR+R if MMR.IADRSZ is set. Bytes are then received as the
+ * guest consumes them (via RHR or PDC), until the byte following CR_STOP,
+ * which is NACKed and followed by STOP, as on the real bus. A NACK of the
+ * slave sets SR.NACK and ends the transfer.
+ *
  * Additional notes:
  * - Master clock of AT91 must be set/updated via at91_twi_set_master_clock.
  *
@@ -47,6 +69,7 @@
 #include "qemu/osdep.h"
 #include "hw/sysbus.h"
 #include "hw/ptimer.h"
+#include "hw/i2c/i2c.h"
 
 #include "at91-pdc.h"
 #include "ioxfer-server.h"
@@ -69,11 +92,19 @@ typedef struct {
     qemu_irq irq;
 
     char* socket;
+    IOThread *iothread;
     IoXferServer *server;
     Buffer rcvbuf;
     Buffer sendbuf;
     ptimer_state *chrtx_timer;
 
+    I2CBus *bus;
+    struct {
+        bool local;         // current transfer addresses an in-process slave
+        bool active;        // slave addressed and not stopped or NACKed
+        bool stop;          // STOP requested, receive one more byte
+    } i2c;
+
     TwiMode mode;
     unsigned mclk;
     unsigned clock;
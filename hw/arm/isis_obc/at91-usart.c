@@ -10,7 +10,6 @@
  */
 
 // Overview of TODOs:
-// - No read timeout: Has to be injected maually when transmitting to AT91.
 // - DTR/RTS and RI/DSR/DCD/CTS pins unimplemented (as are
 //   DTREN/DTRDIS/RTSEN/RTSDIS).
 // - Simulate shift register not implemented, data is transferred immediately
@@ -31,9 +30,11 @@
 #include "at91-usart.h"
 #include "exec/address-spaces.h"
 #include "qemu/error-report.h"
+#include "qemu/host-utils.h"
 #include "qapi/error.h"
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
+#include "migration/vmstate.h"
 
 
 #define IOX_CAT_DATA            0x01
@@ -174,6 +175,8 @@ enum chmode {
 #define BRGR_CD(s)      (s->reg_brgr & 0xFFFF)
 #define BRGR_FP(s)      ((s->reg_brgr & 0xFF0000) >> 16)
 
+#define RTOR_TO(s)      (s->reg_rtor & 0xFFFF)
+
 
 static int iox_send_chars(UsartState *s, uint8_t* data, unsigned len);
 
@@ -254,6 +257,32 @@ void at91_usart_set_master_clock(UsartState *s, unsigned mclk)
 }
 
 
+static void rto_start(UsartState *s)
+{
+    if (!RTOR_TO(s) || !s->baud) {
+        timer_del(s->rto_timer);
+        return;
+    }
+
+    // TO is given in bit periods
+    timer_mod(s->rto_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL)
+              + muldiv64(RTOR_TO(s), NANOSECONDS_PER_SECOND, s->baud));
+}
+
+static void rto_expire(void *opaque)
+{
+    UsartState *s = opaque;
+
+    // Characters still buffered are considered to be on the line, the
+    // counter is restarted once they have been transferred.
+    if (!buffer_empty(&s->rcvbuf))
+        return;
+
+    s->reg_csr |= CSR_TIMEOUT;
+    update_irq(s);
+}
+
+
 static void xfer_chr_receive(UsartState *s, uint16_t chr, bool rxsynh)
 {
     if ((s->reg_csr & CSR_RXRDY) && s->rx_enabled) {
@@ -264,6 +293,8 @@ static void xfer_chr_receive(UsartState *s, uint16_t chr, bool rxsynh)
     s->reg_rhr = (chr & RHR_RXCHR) | (rxsynh ? RHR_RXSYNH : 0);
     s->reg_csr |= CSR_RXRDY;
 
+    rto_start(s);
+
     update_irq(s);
 }
 
@@ -317,6 +348,39 @@ static void xfer_receiver_dma_rcr(UsartState *s)
     buffer_advance(&s->rcvbuf, len);
     s->pdc.reg_rpr += len;
     s->pdc.reg_rcr -= len;
+
+    if (len)
+        rto_start(s);
+}
+
+static size_t xfer_receiver_dma_direct(UsartState *s, const uint8_t *data, size_t len)
+{
+    MemTxAttrs attrs = MEMTXATTRS_UNSPECIFIED;
+    size_t done = 0;
+
+    // Write received data straight to the PDC buffers (RPR, then RNPR once
+    // moved up), without going through the receive buffer.
+    for (int i = 0; i < 2 && s->pdc.reg_rcr && done < len; i++) {
+        size_t n = MIN(len - done, s->pdc.reg_rcr);
+
+        MemTxResult result = address_space_write(&address_space_memory, s->pdc.reg_rpr,
+                                                 attrs, data + done, n);
+        if (result) {
+            error_report("at91.usart: failed to write memory: %d", result);
+            abort();
+        }
+
+        s->pdc.reg_rpr += n;
+        s->pdc.reg_rcr -= n;
+        done += n;
+
+        xfer_receiver_dma_updreg(s);
+    }
+
+    if (done)
+        rto_start(s);
+
+    return done;
 }
 
 static void xfer_receiver_dma_rhr(UsartState *s)
@@ -391,8 +455,11 @@ static void xfer_chr_transmit(UsartState *s, uint16_t chr, bool txsynh)
     uint8_t bchr = chr;
     iox_send_chars(s, &bchr, 1);
 
-    s->reg_csr |= CSR_TXRDY;
-    s->reg_csr |= CSR_TXEMPTY;
+    // hold TXRDY low while the IOX output queue is congested
+    if (iox_server_congested(s->server))
+        s->reg_csr &= ~(CSR_TXRDY | CSR_TXEMPTY);
+    else
+        s->reg_csr |= CSR_TXRDY | CSR_TXEMPTY;
 }
 
 
@@ -412,20 +479,43 @@ static void xfer_dma_rx_stop(void *opaque)
 
 static int xfer_dma_tx_do_tcr(UsartState *s)
 {
-    uint8_t *data = g_new0(uint8_t, s->pdc.reg_tcr);
-    if (!data)
-        return -ENOMEM;
+    hwaddr addr = s->pdc.reg_tpr;
+    size_t len = s->pdc.reg_tcr;
+    int status = 0;
 
-    MemTxResult result = address_space_rw(&address_space_memory, s->pdc.reg_tpr,
-                                          MEMTXATTRS_UNSPECIFIED, data, s->pdc.reg_tcr, false);
-    if (result) {
-        g_free(data);
-        error_report("at91.usart: failed to read memory: %d", result);
-        return -EIO;
-    }
+    // Send straight from guest memory. The IOX server writes header and
+    // payload in one go and only copies the data if it has to queue it.
+    while (len && !status) {
+        hwaddr maplen = len;
+        uint8_t *data;
+
+        data = address_space_map(&address_space_memory, addr, &maplen, false,
+                                 MEMTXATTRS_UNSPECIFIED);
+
+        if (!data) {
+            // not mappable right now (e.g. bounce buffer in use), go via a
+            // temporary buffer
+            maplen = len;
+            data = g_malloc(maplen);
+
+            MemTxResult result = address_space_rw(&address_space_memory, addr,
+                                                  MEMTXATTRS_UNSPECIFIED, data, maplen, false);
+            if (result) {
+                g_free(data);
+                error_report("at91.usart: failed to read memory: %d", result);
+                return -EIO;
+            }
 
-    int status = iox_send_chars(s, data, s->pdc.reg_tcr);
-    g_free(data);
+            status = iox_send_chars(s, data, maplen);
+            g_free(data);
+        } else {
+            status = iox_send_chars(s, data, maplen);
+            address_space_unmap(&address_space_memory, data, maplen, false, maplen);
+        }
+
+        addr += maplen;
+        len -= maplen;
+    }
 
     s->pdc.reg_tpr += s->pdc.reg_tcr;
     s->pdc.reg_tcr = 0;
@@ -437,6 +527,10 @@ static void xfer_dma_tx_start(void *opaque)
 {
     UsartState *s = opaque;
 
+    // defer transfer until the IOX output queue has been drained
+    if (iox_server_congested(s->server))
+        return;
+
     if (s->pdc.reg_tcr) {
         int status = xfer_dma_tx_do_tcr(s);
         if (status) {
@@ -472,12 +566,26 @@ static void xfer_dma_tx_stop(void *opaque)
 static int iox_receive_data(UsartState *s, struct iox_data_frame *frame)
 {
     bool in_progress = !buffer_empty(&s->rcvbuf);
+    const uint8_t *data = frame->payload;
+    size_t len = frame->len;
 
     if (!s->rx_enabled)
         return iox_send_u32_resp(s->server, frame, ENXIO);
 
-    buffer_reserve(&s->rcvbuf, frame->len);
-    buffer_append(&s->rcvbuf, frame->payload, frame->len);
+    // receiver idle with DMA active: data goes straight to guest memory,
+    // only what does not fit is buffered
+    if (!in_progress && s->rx_dma_enabled && !(s->reg_csr & CSR_RXRDY)) {
+        size_t n = xfer_receiver_dma_direct(s, data, len);
+
+        data += n;
+        len -= n;
+    }
+
+    if (len) {
+        buffer_reserve(&s->rcvbuf, len);
+        buffer_append(&s->rcvbuf, data, len);
+    }
+
     int status = iox_send_u32_resp(s->server, frame, 0);
     if (status)
         return status;
@@ -538,6 +646,20 @@ static void iox_receive(struct iox_data_frame *frame, void *opaque)
     }
 }
 
+static void iox_drain(void *opaque)
+{
+    UsartState *s = opaque;
+
+    // output queue has been drained, resume transmission
+    if (s->tx_enabled)
+        s->reg_csr |= CSR_TXRDY | CSR_TXEMPTY;
+
+    if (s->pdc.reg_ptsr & PTSR_TXTEN)
+        xfer_dma_tx_start(s);
+
+    update_irq(s);
+}
+
 static int iox_send_chars(UsartState *s, uint8_t* data, unsigned len)
 {
     if (!s->server)
@@ -617,6 +739,7 @@ static void usart_mmio_write(void *opaque, hwaddr offset, uint64_t value, unsign
     case US_CR:
         if (value & CR_RSTRX) {
             s->rx_enabled = false;
+            timer_del(s->rto_timer);
             s->reg_csr &= ~(CSR_PARE | CSR_FRAME | CSR_OVRE | CSR_MANERR);
             s->reg_csr &= ~(CSR_RXBRK | CSR_TIMEOUT | CSR_ENDRX | CSR_RXBUFF | CSR_NACK);
 
@@ -680,11 +803,10 @@ static void usart_mmio_write(void *opaque, hwaddr offset, uint64_t value, unsign
             warn_report("at91.usart US_CR.STPBRK: not supported yet");
         }
         if (value & CR_STTTO) {
+            // SPEC: Starts waiting for a character before clocking the
+            // time-out counter. Resets the status bit TIMEOUT in US_CSR.
             s->reg_csr &= ~CSR_TIMEOUT;
-
-            // NOTE: Not implemented in emulation, use fault-injection for timeout.
-            // Starts waiting for a character before clocking the time-out
-            // counter. Resets the status bit TIMEOUT in US_CSR.
+            timer_del(s->rto_timer);
         }
         if (value & CR_SENDA) {
             // TODO: CR_SENDA
@@ -705,8 +827,9 @@ static void usart_mmio_write(void *opaque, hwaddr offset, uint64_t value, unsign
             update_irq(s);
         }
         if (value & CR_RETTO) {
-            // SPEC: Restart Time-out.
-            // NOTE: Use fault injection for emulation.
+            // SPEC: Restart Time-out. The counter starts counting down
+            // immediately from the value TO.
+            rto_start(s);
         }
         if (value & CR_DTREN) {
             // TODO: CR_DTREN
@@ -760,16 +883,11 @@ static void usart_mmio_write(void *opaque, hwaddr offset, uint64_t value, unsign
     case US_RTOR:
         s->reg_rtor = value;
 
-        // NOTE: Use fault injection for emulation.
-        // The code below is mainly intended for documentation.
-
-        if (s->reg_rtor) {
-            // SPEC: enable/start timeout
-        } else {
+        // Note: A new value takes effect with the next character received
+        // or RETTO, as the counter is only loaded then.
+        if (!RTOR_TO(s)) {
             s->reg_csr &= ~CSR_TIMEOUT;
-
-            // SPEC: disable/stop timeout
-
+            timer_del(s->rto_timer);
             update_irq(s);
         }
 
@@ -861,6 +979,7 @@ static void usart_reset_registers(UsartState *s)
     s->reg_if   = 0x00;
     s->reg_man  = 0x30011004;
 
+    timer_del(s->rto_timer);
     at91_pdc_reset_registers(&s->pdc);
 }
 
@@ -868,6 +987,8 @@ static void usart_device_realize(DeviceState *dev, Error **errp)
 {
     UsartState *s = AT91_USART(dev);
 
+    s->rto_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, rto_expire, s);
+
     usart_reset_registers(s);
 
     buffer_init(&s->rcvbuf, "at91.usart.rcvbuf");
@@ -885,6 +1006,8 @@ static void usart_device_realize(DeviceState *dev, Error **errp)
         }
 
         iox_server_set_handler(srv, iox_receive, s);
+        iox_server_set_iothread(srv, s->iothread);
+        iox_server_set_drain_handler(srv, iox_drain);
 
         if (iox_server_open(srv, &addr, errp))
             return;
@@ -903,6 +1026,9 @@ static void usart_device_unrealize(DeviceState *dev, Error **errp)
         s->server = NULL;
     }
 
+    timer_free(s->rto_timer);
+    s->rto_timer = NULL;
+
     buffer_free(&s->rcvbuf);
 }
 
@@ -916,9 +1042,38 @@ static void usart_device_reset(DeviceState *dev)
 
 static Property usart_device_properties[] = {
     DEFINE_PROP_STRING("socket", UsartState, socket),
+    DEFINE_PROP_LINK("iothread", UsartState, iothread, TYPE_IOTHREAD, IOThread *),
     DEFINE_PROP_END_OF_LIST(),
 };
 
+static const VMStateDescription vmstate_at91_usart = {
+    .name = "at91-usart",
+    .version_id = 2,
+    .minimum_version_id = 2,
+    .fields = (VMStateField[]) {
+        VMSTATE_IOX_BUFFER(rcvbuf, UsartState),
+        VMSTATE_UINT32(mclk, UsartState),
+        VMSTATE_UINT32(baud, UsartState),
+        VMSTATE_UINT32(reg_mr, UsartState),
+        VMSTATE_UINT32(reg_imr, UsartState),
+        VMSTATE_UINT32(reg_csr, UsartState),
+        VMSTATE_UINT32(reg_rhr, UsartState),
+        VMSTATE_UINT32(reg_brgr, UsartState),
+        VMSTATE_UINT32(reg_rtor, UsartState),
+        VMSTATE_UINT32(reg_ttgr, UsartState),
+        VMSTATE_UINT32(reg_fidi, UsartState),
+        VMSTATE_UINT32(reg_ner, UsartState),
+        VMSTATE_UINT32(reg_if, UsartState),
+        VMSTATE_UINT32(reg_man, UsartState),
+        VMSTATE_TIMER_PTR(rto_timer, UsartState),
+        VMSTATE_BOOL(rx_dma_enabled, UsartState),
+        VMSTATE_BOOL(rx_enabled, UsartState),
+        VMSTATE_BOOL(tx_enabled, UsartState),
+        VMSTATE_AT91_PDC(pdc, UsartState),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 static void usart_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -927,6 +1082,7 @@ static void usart_class_init(ObjectClass *klass, void *data)
     dc->unrealize = usart_device_unrealize;
     dc->reset = usart_device_reset;
     device_class_set_props(dc, usart_device_properties);
+    dc->vmsd = &vmstate_at91_usart;
 }
 
 static const TypeInfo usart_device_info = {
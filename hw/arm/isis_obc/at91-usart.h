@@ -4,7 +4,8 @@
  * Emulation of devices connected to the USART is done via outside processes
  * communicating via the IOX server (for details see ioxfer-server.h). The
  * socket address can be set via the "socket" property (as is done and defined
- * in iobc_board.c).
+ * in iobc_board.c), socket I/O can be moved to an I/O thread via the
+ * "iothread" property.
  *
  * Multiple operations are possible via the IOX server. For data transfer
  * these are:
@@ -26,14 +27,15 @@
  * - PARE (category IOX_CAT_FAULT, ID IOX_CID_FAULT_PARE)
  * - TIMEOUT (category IOX_CAT_FAULT, ID IOX_CID_FAULT_TIMEOUT)
  *
- * Note especially that, since the receiver timeout can not be emulated, it is
- * imperative to inject this timeout manually if communication relies on it.
- * This is the case when a receive operation is started with a buffer that may
- * be larger than the expected length of the data to be recieved. In this case
- * one would rely on the timeout to detect the end of the
- * data-frame/transmission burst. This detection cannot be reliably emulated
- * and thus the timeout has to be manually fault-injected by the sender/client
- * after the data transmission has been completed.
+ * The receiver timeout (US_RTOR) is emulated in virtual time: the counter is
+ * (re)started with TO bit periods (as derived from the baud rate) whenever a
+ * character is moved to RHR or to a PDC buffer, and sets TIMEOUT on expiry.
+ * Characters received via IOX but not yet consumed by the guest count as the
+ * line still being busy, the timeout only expires once they have been
+ * transferred. As on hardware, STTTO stops the counter until the next
+ * character is received and clears TIMEOUT, RETTO restarts it immediately.
+ * Injecting TIMEOUT via IOX is thus only needed to emulate faults; it is
+ * still supported for clients relying on it.
  *
  * Additional notes:
  * - Master clock of AT91 must be set/updated via at91_usart_set_master_clock.
@@ -51,6 +53,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/buffer.h"
+#include "qemu/timer.h"
 #include "hw/sysbus.h"
 
 #include "at91-pdc.h"
@@ -67,6 +70,7 @@ typedef struct {
     qemu_irq irq;
 
     char* socket;
+    IOThread *iothread;
     IoXferServer *server;
     Buffer rcvbuf;
 
@@ -85,6 +89,8 @@ typedef struct {
     uint32_t reg_if;
     uint32_t reg_man;
 
+    QEMUTimer *rto_timer;
+
     bool rx_dma_enabled;
     bool rx_enabled;
     bool tx_enabled;
@@ -12,6 +12,7 @@
 #include "gpio-led.h"
 #include "qemu/error-report.h"
 #include "hw/qdev-properties.h"
+#include "migration/vmstate.h"
 
 
 static void gpio_led_irq_handle(void *opaque, int n, int level)
@@ -49,6 +50,16 @@ static Property gpio_led_properties[] = {
     DEFINE_PROP_END_OF_LIST(),
 };
 
+static const VMStateDescription vmstate_gpio_led = {
+    .name = "at91-gpio_led",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_INT32(state, GpioLedState),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 static void gpio_led_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -56,6 +67,7 @@ static void gpio_led_class_init(ObjectClass *klass, void *data)
     dc->realize = gpio_led_device_realize;
     dc->reset = gpio_led_device_reset;
     device_class_set_props(dc, gpio_led_properties);
+    dc->vmsd = &vmstate_gpio_led;
 }
 
 static const TypeInfo gpio_led_device_info = {
@@ -0,0 +1,236 @@
+/*
+ * Generic register-map I2C slave backed by a shared memory file.
+ *
+ * See i2c-regmap.h for details.
+ *
+ * Copyright (c) 2019-2020 KSat e.V. Stuttgart
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or, at your
+ * option, any later version. See the COPYING file in the top-level directory.
+ */
+
+#include "i2c-regmap.h"
+#include "iobc-mapped_file.h"
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "qemu/bswap.h"
+#include "qemu/units.h"
+#include "hw/qdev-properties.h"
+#include "migration/vmstate.h"
+
+
+static void regmap_log(I2cRegmapState *s, uint8_t value)
+{
+    struct i2c_regmap_log_entry *entry;
+
+    if (!s->log_size)
+        return;
+
+    entry = &s->log_entries[s->log_head % s->log_size];
+    entry->reg = cpu_to_le16(s->reg);
+    entry->value = value;
+    entry->flags = s->start ? I2C_REGMAP_LOG_START : 0;
+
+    // publish the entry before the head, readers poll the head
+    smp_wmb();
+    atomic_set(&s->log->head, cpu_to_le32(++s->log_head));
+
+    s->start = false;
+}
+
+static int regmap_event(I2CSlave *i2c, enum i2c_event event)
+{
+    I2cRegmapState *s = I2C_REGMAP(i2c);
+
+    switch (event) {
+    case I2C_START_SEND:
+        s->count = 0;
+        s->start = true;
+        break;
+
+    case I2C_START_RECV:
+    case I2C_FINISH:
+    case I2C_NACK:
+        break;
+    }
+
+    return 0;
+}
+
+static int regmap_send(I2CSlave *i2c, uint8_t data)
+{
+    I2cRegmapState *s = I2C_REGMAP(i2c);
+
+    // register address first, big-endian
+    if (s->count < s->addr_width) {
+        s->reg = s->count ? (s->reg << 8) | data : data;
+
+        if (++s->count == s->addr_width)
+            s->reg %= s->size;
+
+        return 0;
+    }
+
+    s->mem[s->reg] = data;
+    regmap_log(s, data);
+
+    s->reg = (s->reg + 1) % s->size;
+    return 0;
+}
+
+static uint8_t regmap_recv(I2CSlave *i2c)
+{
+    I2cRegmapState *s = I2C_REGMAP(i2c);
+    uint8_t data = atomic_read(&s->mem[s->reg]);
+
+    s->reg = (s->reg + 1) % s->size;
+    return data;
+}
+
+static void regmap_realize(DeviceState *dev, Error **errp)
+{
+    I2cRegmapState *s = I2C_REGMAP(dev);
+    uint32_t log_offset;
+
+    if (!s->size || s->size > 64 * KiB) {
+        error_setg(errp, "i2c-regmap: size must be between 1 and 64 KiB");
+        return;
+    }
+
+    if (s->addr_width != 1 && s->addr_width != 2) {
+        error_setg(errp, "i2c-regmap: addr-width must be 1 or 2");
+        return;
+    }
+
+    if (s->log_size > 1 * MiB) {
+        error_setg(errp, "i2c-regmap: log-size must not exceed 1M entries");
+        return;
+    }
+
+    log_offset = ROUND_UP(s->size, 8);
+    s->mem_size = log_offset;
+    if (s->log_size) {
+        s->mem_size += sizeof(struct i2c_regmap_log_hdr)
+                     + s->log_size * sizeof(struct i2c_regmap_log_entry);
+    }
+
+    if (s->file) {
+        s->mem = iobc_map_file("i2c-regmap", s->file, s->mem_size, errp);
+        if (!s->mem)
+            return;
+
+        s->mapped = true;
+    } else {
+        s->mem = g_malloc0(s->mem_size);
+        s->mapped = false;
+    }
+
+    s->log = NULL;
+    s->log_entries = NULL;
+    s->log_head = 0;
+
+    if (s->log_size) {
+        s->log = (struct i2c_regmap_log_hdr *)(s->mem + log_offset);
+        s->log_entries = (struct i2c_regmap_log_entry *)(s->log + 1);
+
+        // continue an existing log of the same layout, readers may still
+        // be attached to it
+        if (le32_to_cpu(s->log->len) == s->log_size) {
+            s->log_head = le32_to_cpu(s->log->head);
+        } else {
+            s->log->head = 0;
+            s->log->len = cpu_to_le32(s->log_size);
+        }
+    }
+}
+
+static void regmap_unrealize(DeviceState *dev, Error **errp)
+{
+    I2cRegmapState *s = I2C_REGMAP(dev);
+
+    if (s->mapped)
+        iobc_unmap_file(s->mem, s->mem_size);
+    else
+        g_free(s->mem);
+
+    s->mem = NULL;
+    s->log = NULL;
+    s->log_entries = NULL;
+}
+
+static void regmap_reset(DeviceState *dev)
+{
+    I2cRegmapState *s = I2C_REGMAP(dev);
+
+    // register contents are owned by the simulator, keep them
+    s->reg = 0;
+    s->count = 0;
+    s->start = false;
+}
+
+static int regmap_post_load(void *opaque, int version_id)
+{
+    I2cRegmapState *s = opaque;
+
+    if (s->reg >= s->size)
+        return -EINVAL;
+
+    if (s->log)
+        s->log->head = cpu_to_le32(s->log_head);
+
+    return 0;
+}
+
+static Property regmap_properties[] = {
+    DEFINE_PROP_STRING("file", I2cRegmapState, file),
+    DEFINE_PROP_UINT32("size", I2cRegmapState, size, 256),
+    DEFINE_PROP_UINT8("addr-width", I2cRegmapState, addr_width, 1),
+    DEFINE_PROP_UINT32("log-size", I2cRegmapState, log_size, 256),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static const VMStateDescription vmstate_i2c_regmap = {
+    .name = "i2c-regmap",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = regmap_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_I2C_SLAVE(parent_obj, I2cRegmapState),
+        VMSTATE_UINT16(reg, I2cRegmapState),
+        VMSTATE_UINT8(count, I2cRegmapState),
+        VMSTATE_BOOL(start, I2cRegmapState),
+        VMSTATE_UINT32(log_head, I2cRegmapState),
+        VMSTATE_VBUFFER_UINT32(mem, I2cRegmapState, 0, NULL, mem_size),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
+static void regmap_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    I2CSlaveClass *sc = I2C_SLAVE_CLASS(klass);
+
+    sc->event = regmap_event;
+    sc->send = regmap_send;
+    sc->recv = regmap_recv;
+
+    dc->realize = regmap_realize;
+    dc->unrealize = regmap_unrealize;
+    dc->reset = regmap_reset;
+    device_class_set_props(dc, regmap_properties);
+    dc->vmsd = &vmstate_i2c_regmap;
+}
+
+static const TypeInfo i2c_regmap_info = {
+    .name = TYPE_I2C_REGMAP,
+    .parent = TYPE_I2C_SLAVE,
+    .instance_size = sizeof(I2cRegmapState),
+    .class_init = regmap_class_init,
+};
+
+static void i2c_regmap_register_types(void)
+{
+    type_register_static(&i2c_regmap_info);
+}
+
+type_init(i2c_regmap_register_types)
@@ -0,0 +1,95 @@
+/*
+ * Generic register-map I2C slave backed by a shared memory file.
+ *
+ * I2C slave for register-map peripherals (EPS, magnetometer, temperature
+ * sensors, ...), to be attached to the I2C bus of the AT91 TWI (see
+ * at91-twi.h), e.g. via
+ *
+ *   -device i2c-regmap,address=0x1e,size=256,file=mag.bin
+ *
+ * The register contents live in a file that is mapped shared, so an external
+ * simulator can update them at its own rate instead of answering each TWI
+ * transfer via IOX. A transfer consists of the register address (MMR.IADRSZ
+ * of the TWI, sent big-endian, "addr-width" bytes), followed by data bytes.
+ * Reads start at the last register address and auto-increment, as do
+ * writes. Register addresses wrap around at the end of the register map.
+ *
+ * Writes of the guest are applied to the register map and additionally
+ * logged to a ring directly following it in the file (at offset "size"
+ * rounded up to 8 bytes), so the simulator can react to them:
+ *
+ *   struct i2c_regmap_log_hdr      (little-endian)
+ *   struct i2c_regmap_log_entry    ["log-size" entries]
+ *
+ * The entry for the n-th written byte (counting from zero) is stored at index
+ * n % len. The head is updated after the entry has been written, readers
+ * keep track of their own position and have missed entries if the head is
+ * more than len entries ahead. The first byte of each write transfer is
+ * marked with I2C_REGMAP_LOG_START.
+ *
+ * Registers are neither locked nor updated atomically, registers spanning
+ * multiple bytes may thus be read partially updated. The simulator should
+ * only update registers that it owns.
+ *
+ * Properties:
+ * - address: I2C slave address.
+ * - size: size of the register map in bytes (1 to 64 KiB, default 256).
+ * - addr-width: register address width in bytes (1 or 2, default 1).
+ * - log-size: number of entries of the write log (default 256, 0 disables
+ *   the log).
+ * - file: backing file. It is created if it does not exist and extended if
+ *   it is smaller than register map and log. Without file, the memory is
+ *   anonymous and initially zero.
+ *
+ * Copyright (c) 2019-2020 KSat e.V. Stuttgart
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or, at your
+ * option, any later version. See the COPYING file in the top-level directory.
+ */
+
+#ifndef HW_ARM_ISIS_OBC_I2C_REGMAP_H
+#define HW_ARM_ISIS_OBC_I2C_REGMAP_H
+
+#include "qemu/osdep.h"
+#include "hw/i2c/i2c.h"
+
+
+#define TYPE_I2C_REGMAP "i2c-regmap"
+#define I2C_REGMAP(obj) OBJECT_CHECK(I2cRegmapState, (obj), TYPE_I2C_REGMAP)
+
+#define I2C_REGMAP_LOG_START    BIT(0)
+
+
+struct i2c_regmap_log_hdr {
+    uint32_t head;          // number of entries written so far
+    uint32_t len;           // number of entries in the ring
+};
+
+struct i2c_regmap_log_entry {
+    uint16_t reg;
+    uint8_t value;
+    uint8_t flags;
+};
+
+typedef struct {
+    I2CSlave parent_obj;
+
+    char *file;
+    uint32_t size;
+    uint8_t addr_width;
+    uint32_t log_size;
+
+    uint8_t *mem;
+    uint32_t mem_size;
+    bool mapped;
+
+    struct i2c_regmap_log_hdr *log;
+    struct i2c_regmap_log_entry *log_entries;
+    uint32_t log_head;
+
+    uint16_t reg;
+    uint8_t count;
+    bool start;
+} I2cRegmapState;
+
+#endif /* HW_ARM_ISIS_OBC_I2C_REGMAP_H */
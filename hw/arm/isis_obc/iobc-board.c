@@ -14,15 +14,23 @@
 #include "qemu-common.h"
 #include "qemu/error-report.h"
 #include "qapi/error.h"
+#include "qapi/visitor.h"
 #include "hw/hw.h"
 #include "hw/loader.h"
 #include "hw/boards.h"
 #include "hw/arm/boot.h"
 #include "hw/misc/unimp.h"
+#include "hw/qdev-core.h"
 #include "sysemu/sysemu.h"
+#include "migration/vmstate.h"
 #include "cpu.h"
 
 #include "iobc-reserved_memory.h"
+#include "iobc-idle_warp.h"
+#include "iobc-fork_server.h"
+#include "ioxfer-server.h"
+#include "ioxfer-replay.h"
+#include "ioxfer-trace.h"
 #include "at91-pmc.h"
 #include "at91-aic.h"
 #include "at91-aic_stub.h"
@@ -40,19 +48,44 @@
 #include "at91-tc.h"
 
 
-#define SOCKET_TWI      "/tmp/qemu_at91_twi"
-#define SOCKET_USART0   "/tmp/qemu_at91_usart0"
-#define SOCKET_USART1   "/tmp/qemu_at91_usart1"
-#define SOCKET_USART2   "/tmp/qemu_at91_usart2"
-#define SOCKET_USART3   "/tmp/qemu_at91_usart3"
-#define SOCKET_USART4   "/tmp/qemu_at91_usart4"
-#define SOCKET_USART5   "/tmp/qemu_at91_usart5"
-#define SOCKET_SPI0     "/tmp/qemu_at91_spi0"
-#define SOCKET_SPI1     "/tmp/qemu_at91_spi1"
-#define SOCKET_PIOA     "/tmp/qemu_at91_pioa"
-#define SOCKET_PIOB     "/tmp/qemu_at91_piob"
-#define SOCKET_PIOC     "/tmp/qemu_at91_pioc"
-#define SOCKET_SDRAMC   "/tmp/qemu_at91_sdramc"
+#define IOX_DIR_DEFAULT "/tmp"
+
+enum iobc_iox_socket {
+    IOX_SOCKET_TWI,
+    IOX_SOCKET_USART0,
+    IOX_SOCKET_USART1,
+    IOX_SOCKET_USART2,
+    IOX_SOCKET_USART3,
+    IOX_SOCKET_USART4,
+    IOX_SOCKET_USART5,
+    IOX_SOCKET_SPI0,
+    IOX_SOCKET_SPI1,
+    IOX_SOCKET_PIOA,
+    IOX_SOCKET_PIOB,
+    IOX_SOCKET_PIOC,
+    IOX_SOCKET_SDRAMC,
+    __IOX_SOCKET_NUM,
+};
+
+// machine property suffix (iox-socket-<name>) and default file name in iox-dir
+static const struct {
+    const char *name;
+    const char *file;
+} iobc_iox_sockets[__IOX_SOCKET_NUM] = {
+    [IOX_SOCKET_TWI]    = { "twi",    "qemu_at91_twi"    },
+    [IOX_SOCKET_USART0] = { "usart0", "qemu_at91_usart0" },
+    [IOX_SOCKET_USART1] = { "usart1", "qemu_at91_usart1" },
+    [IOX_SOCKET_USART2] = { "usart2", "qemu_at91_usart2" },
+    [IOX_SOCKET_USART3] = { "usart3", "qemu_at91_usart3" },
+    [IOX_SOCKET_USART4] = { "usart4", "qemu_at91_usart4" },
+    [IOX_SOCKET_USART5] = { "usart5", "qemu_at91_usart5" },
+    [IOX_SOCKET_SPI0]   = { "spi0",   "qemu_at91_spi0"   },
+    [IOX_SOCKET_SPI1]   = { "spi1",   "qemu_at91_spi1"   },
+    [IOX_SOCKET_PIOA]   = { "pioa",   "qemu_at91_pioa"   },
+    [IOX_SOCKET_PIOB]   = { "piob",   "qemu_at91_piob"   },
+    [IOX_SOCKET_PIOC]   = { "pioc",   "qemu_at91_pioc"   },
+    [IOX_SOCKET_SDRAMC] = { "sdramc", "qemu_at91_sdramc" },
+};
 
 #define ADDR_BOOTMEM    0x00000000
 #define ADDR_SDRAMC     0x20000000
@@ -130,6 +163,21 @@ typedef struct {
 } IobcBoardState;
 
 
+#define TYPE_IOBC_MACHINE   MACHINE_TYPE_NAME("isis-obc")
+#define IOBC_MACHINE(obj)   OBJECT_CHECK(IobcMachineState, (obj), TYPE_IOBC_MACHINE)
+
+typedef struct {
+    MachineState parent_obj;
+
+    IobcIdleWarp idle_warp;
+    IobcForkServer fork_server;
+
+    // IOX socket directory and per-device overrides, NULL for default
+    char *iox_dir;
+    char *iox_socket[__IOX_SOCKET_NUM];
+} IobcMachineState;
+
+
 static void iobc_bootmem_remap(void *opaque, at91_bootmem_region target)
 {
     IobcBoardState *s = opaque;
@@ -149,6 +197,34 @@ static void iobc_bootmem_remap(void *opaque, at91_bootmem_region target)
     memory_region_transaction_commit();
 }
 
+static int iobc_board_post_load(void *opaque, int version_id)
+{
+    IobcBoardState *s = opaque;
+    int i;
+
+    if (s->mem_boot_target >= __AT91_BOOTMEM_NUM_REGIONS)
+        return -EINVAL;
+
+    // re-apply bootmem mapping (REMAP state is held by the matrix)
+    memory_region_transaction_begin();
+    for (i = 0; i < __AT91_BOOTMEM_NUM_REGIONS; i++)
+        memory_region_set_enabled(&s->mem_boot[i], i == s->mem_boot_target);
+    memory_region_transaction_commit();
+
+    return 0;
+}
+
+static const VMStateDescription vmstate_iobc_board = {
+    .name = "iobc-board",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = iobc_board_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(mem_boot_target, IobcBoardState),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 static void iobc_mkclk_changed(void *opaque, unsigned clock)
 {
     IobcBoardState *s = opaque;
@@ -169,14 +245,45 @@ static void iobc_mkclk_changed(void *opaque, unsigned clock)
     at91_tc_set_master_clock(AT91_TC(s->dev_tc345), clock);
 }
 
+/*
+ * Set the IOX socket of the given device. Overrides may be absolute or
+ * relative to iox-dir, an empty override disables the socket.
+ */
+static void iobc_assign_iox_socket(IobcMachineState *m, DeviceState *dev, enum iobc_iox_socket idx)
+{
+    const char *dir = m->iox_dir ? m->iox_dir : IOX_DIR_DEFAULT;
+    const char *file = m->iox_socket[idx] ? m->iox_socket[idx] : iobc_iox_sockets[idx].file;
+    g_autofree char *path = NULL;
+
+    if (!file[0])
+        return;
+
+    if (g_path_is_absolute(file))
+        path = g_strdup(file);
+    else
+        path = g_build_filename(dir, file, NULL);
+
+    qdev_prop_set_string(dev, "socket", path);
+}
+
 static void iobc_init(MachineState *machine)
 {
+    IobcMachineState *m = IOBC_MACHINE(machine);
     MemoryRegion *address_space_mem = get_system_memory();
     IobcBoardState *s = g_new(IobcBoardState, 1);
     int i;
 
     s->cpu = ARM_CPU(cpu_create(machine->cpu_type));
 
+    // icount may not have been configured when the option has been set
+    iobc_idle_warp_init(&m->idle_warp, CPU(s->cpu));
+    iobc_idle_warp_set_enabled(&m->idle_warp, m->idle_warp.enabled);
+
+    if (m->iox_dir && g_mkdir_with_parents(m->iox_dir, 0700)) {
+        error_report("Unable to create IOX socket directory %s: %s", m->iox_dir, strerror(errno));
+        exit(1);
+    }
+
     /* Memory Map for AT91SAM9G20 (current implementation status)                              */
     /*                                                                                         */
     /* start        length       description        notes                                      */
@@ -250,6 +357,8 @@ static void iobc_init(MachineState *machine)
     s->mem_boot_target = AT91_BMS_INIT ? AT91_BOOTMEM_ROM : AT91_BOOTMEM_EBI_NCS0;
     memory_region_set_enabled(&s->mem_boot[s->mem_boot_target], true);
 
+    vmstate_register(NULL, 0, &vmstate_iobc_board, s);
+
     // reserved memory, accessing this will abort
     create_reserved_memory_region("iobc.undefined", 0x90000000, 0xF0000000 - 0x90000000);
     create_reserved_memory_region("iobc.periph.reserved0", 0xF0000000, 0xFFFA0000 - 0xF0000000);
@@ -297,19 +406,19 @@ static void iobc_init(MachineState *machine)
 
     // Parallel Input Ouput Controller
     s->dev_pio_a = qdev_create(NULL, TYPE_AT91_PIO);
-    qdev_prop_set_string(s->dev_pio_a, "socket", SOCKET_PIOA);
+    iobc_assign_iox_socket(m, s->dev_pio_a, IOX_SOCKET_PIOA);
     qdev_init_nofail(s->dev_pio_a);
     sysbus_mmio_map(SYS_BUS_DEVICE(s->dev_pio_a), 0, 0xFFFFF400);
     sysbus_connect_irq(SYS_BUS_DEVICE(s->dev_pio_a), 0, s->irq_aic[2]);
 
     s->dev_pio_b = qdev_create(NULL, TYPE_AT91_PIO);
-    qdev_prop_set_string(s->dev_pio_b, "socket", SOCKET_PIOB);
+    iobc_assign_iox_socket(m, s->dev_pio_b, IOX_SOCKET_PIOB);
     qdev_init_nofail(s->dev_pio_b);
     sysbus_mmio_map(SYS_BUS_DEVICE(s->dev_pio_b), 0, 0xFFFFF600);
     sysbus_connect_irq(SYS_BUS_DEVICE(s->dev_pio_b), 0, s->irq_aic[3]);
 
     s->dev_pio_c = qdev_create(NULL, TYPE_AT91_PIO);
-    qdev_prop_set_string(s->dev_pio_c, "socket", SOCKET_PIOC);
+    iobc_assign_iox_socket(m, s->dev_pio_c, IOX_SOCKET_PIOC);
     qdev_init_nofail(s->dev_pio_c);
     sysbus_mmio_map(SYS_BUS_DEVICE(s->dev_pio_c), 0, 0xFFFFF800);
     sysbus_connect_irq(SYS_BUS_DEVICE(s->dev_pio_c), 0, s->irq_aic[4]);
@@ -318,64 +427,66 @@ static void iobc_init(MachineState *machine)
 
     // TWI
     s->dev_twi = qdev_create(NULL, TYPE_AT91_TWI);
-    qdev_prop_set_string(s->dev_twi, "socket", SOCKET_TWI);
+    iobc_assign_iox_socket(m, s->dev_twi, IOX_SOCKET_TWI);
     qdev_init_nofail(s->dev_twi);
     sysbus_mmio_map(SYS_BUS_DEVICE(s->dev_twi), 0, 0xFFFAC000);
     sysbus_connect_irq(SYS_BUS_DEVICE(s->dev_twi), 0, s->irq_aic[11]);
 
     // USARTs
     s->dev_usart0 = qdev_create(NULL, TYPE_AT91_USART);
-    qdev_prop_set_string(s->dev_usart0, "socket", SOCKET_USART0);
+    iobc_assign_iox_socket(m, s->dev_usart0, IOX_SOCKET_USART0);
     qdev_init_nofail(s->dev_usart0);
     sysbus_mmio_map(SYS_BUS_DEVICE(s->dev_usart0), 0, 0xFFFB0000);
     sysbus_connect_irq(SYS_BUS_DEVICE(s->dev_usart0), 0, s->irq_aic[6]);
 
     s->dev_usart1 = qdev_create(NULL, TYPE_AT91_USART);
-    qdev_prop_set_string(s->dev_usart1, "socket", SOCKET_USART1);
+    iobc_assign_iox_socket(m, s->dev_usart1, IOX_SOCKET_USART1);
     qdev_init_nofail(s->dev_usart1);
     sysbus_mmio_map(SYS_BUS_DEVICE(s->dev_usart1), 0, 0xFFFB4000);
     sysbus_connect_irq(SYS_BUS_DEVICE(s->dev_usart1), 0, s->irq_aic[7]);
 
     s->dev_usart2 = qdev_create(NULL, TYPE_AT91_USART);
-    qdev_prop_set_string(s->dev_usart2, "socket", SOCKET_USART2);
+    iobc_assign_iox_socket(m, s->dev_usart2, IOX_SOCKET_USART2);
     qdev_init_nofail(s->dev_usart2);
     sysbus_mmio_map(SYS_BUS_DEVICE(s->dev_usart2), 0, 0xFFFB8000);
     sysbus_connect_irq(SYS_BUS_DEVICE(s->dev_usart2), 0, s->irq_aic[8]);
 
     s->dev_usart3 = qdev_create(NULL, TYPE_AT91_USART);
-    qdev_prop_set_string(s->dev_usart3, "socket", SOCKET_USART3);
+    iobc_assign_iox_socket(m, s->dev_usart3, IOX_SOCKET_USART3);
     qdev_init_nofail(s->dev_usart3);
     sysbus_mmio_map(SYS_BUS_DEVICE(s->dev_usart3), 0, 0xFFFD0000);
     sysbus_connect_irq(SYS_BUS_DEVICE(s->dev_usart3), 0, s->irq_aic[23]);
 
     s->dev_usart4 = qdev_create(NULL, TYPE_AT91_USART);
-    qdev_prop_set_string(s->dev_usart4, "socket", SOCKET_USART4);
+    iobc_assign_iox_socket(m, s->dev_usart4, IOX_SOCKET_USART4);
     qdev_init_nofail(s->dev_usart4);
     sysbus_mmio_map(SYS_BUS_DEVICE(s->dev_usart4), 0, 0xFFFD4000);
     sysbus_connect_irq(SYS_BUS_DEVICE(s->dev_usart4), 0, s->irq_aic[24]);
 
     s->dev_usart5 = qdev_create(NULL, TYPE_AT91_USART);
-    qdev_prop_set_string(s->dev_usart5, "socket", SOCKET_USART5);
+    iobc_assign_iox_socket(m, s->dev_usart5, IOX_SOCKET_USART5);
     qdev_init_nofail(s->dev_usart5);
     sysbus_mmio_map(SYS_BUS_DEVICE(s->dev_usart5), 0, 0xFFFD8000);
     sysbus_connect_irq(SYS_BUS_DEVICE(s->dev_usart5), 0, s->irq_aic[25]);
 
     // SPIs
     s->dev_spi0 = qdev_create(NULL, TYPE_AT91_SPI);
-    qdev_prop_set_string(s->dev_spi0, "socket", SOCKET_SPI0);
+    qdev_prop_set_string(s->dev_spi0, "bus-name", "spi0");
+    iobc_assign_iox_socket(m, s->dev_spi0, IOX_SOCKET_SPI0);
     qdev_init_nofail(s->dev_spi0);
     sysbus_mmio_map(SYS_BUS_DEVICE(s->dev_spi0), 0, 0xFFFC8000);
     sysbus_connect_irq(SYS_BUS_DEVICE(s->dev_spi0), 0, s->irq_aic[12]);
 
     s->dev_spi1 = qdev_create(NULL, TYPE_AT91_SPI);
-    qdev_prop_set_string(s->dev_spi1, "socket", SOCKET_SPI1);
+    qdev_prop_set_string(s->dev_spi1, "bus-name", "spi1");
+    iobc_assign_iox_socket(m, s->dev_spi1, IOX_SOCKET_SPI1);
     qdev_init_nofail(s->dev_spi1);
     sysbus_mmio_map(SYS_BUS_DEVICE(s->dev_spi1), 0, 0xFFFCC000);
     sysbus_connect_irq(SYS_BUS_DEVICE(s->dev_spi1), 0, s->irq_aic[13]);
 
     // SDRAMC
     s->dev_sdramc = qdev_create(NULL, TYPE_AT91_SDRAMC);
-    qdev_prop_set_string(s->dev_sdramc, "socket", SOCKET_SDRAMC);
+    iobc_assign_iox_socket(m, s->dev_sdramc, IOX_SOCKET_SDRAMC);
     qdev_init_nofail(s->dev_sdramc);
     sysbus_mmio_map(SYS_BUS_DEVICE(s->dev_sdramc), 0, 0xFFFFEA00);
     sysbus_connect_irq(SYS_BUS_DEVICE(s->dev_sdramc), 0, s->irq_sysc[2]);
@@ -465,11 +576,257 @@ static void iobc_init(MachineState *machine)
     arm_load_kernel(s->cpu, machine, &iobc_board_binfo);
 }
 
-static void iobc_machine_init(MachineClass *mc)
+static bool iobc_get_idle_warp(Object *obj, Error **errp)
+{
+    return IOBC_MACHINE(obj)->idle_warp.enabled;
+}
+
+static void iobc_set_idle_warp(Object *obj, bool value, Error **errp)
+{
+    iobc_idle_warp_set_enabled(&IOBC_MACHINE(obj)->idle_warp, value);
+}
+
+static void iobc_get_idle_warp_speedup(Object *obj, Visitor *v, const char *name,
+                                       void *opaque, Error **errp)
+{
+    double value = iobc_idle_warp_speedup(&IOBC_MACHINE(obj)->idle_warp);
+    visit_type_number(v, name, &value, errp);
+}
+
+static void iobc_get_idle_warp_skipped(Object *obj, Visitor *v, const char *name,
+                                       void *opaque, Error **errp)
+{
+    int64_t value = IOBC_MACHINE(obj)->idle_warp.warped_ns;
+    visit_type_int64(v, name, &value, errp);
+}
+
+static void iobc_set_fork(Object *obj, const char *value, Error **errp)
+{
+    iobc_fork_server_fork(&IOBC_MACHINE(obj)->fork_server, value, errp);
+}
+
+static void iobc_get_fork_pid(Object *obj, Visitor *v, const char *name,
+                              void *opaque, Error **errp)
+{
+    int64_t value = IOBC_MACHINE(obj)->fork_server.last_pid;
+    visit_type_int64(v, name, &value, errp);
+}
+
+static void iobc_get_iox_queue_limit(Object *obj, Visitor *v, const char *name,
+                                     void *opaque, Error **errp)
+{
+    uint64_t value = iox_get_queue_limit();
+    visit_type_size(v, name, &value, errp);
+}
+
+static void iobc_set_iox_queue_limit(Object *obj, Visitor *v, const char *name,
+                                     void *opaque, Error **errp)
 {
+    Error *err = NULL;
+    uint64_t value;
+
+    visit_type_size(v, name, &value, &err);
+    if (err) {
+        error_propagate(errp, err);
+        return;
+    }
+
+    if (!value) {
+        error_setg(errp, "iox-queue-limit must be greater than zero");
+        return;
+    }
+
+    iox_set_queue_limit(value);
+}
+
+static char *iobc_get_iox_dir(Object *obj, Error **errp)
+{
+    IobcMachineState *m = IOBC_MACHINE(obj);
+    return g_strdup(m->iox_dir ? m->iox_dir : IOX_DIR_DEFAULT);
+}
+
+static void iobc_set_iox_dir(Object *obj, const char *value, Error **errp)
+{
+    IobcMachineState *m = IOBC_MACHINE(obj);
+
+    g_free(m->iox_dir);
+    m->iox_dir = g_strdup(value);
+}
+
+static void iobc_get_iox_socket(Object *obj, Visitor *v, const char *name,
+                                void *opaque, Error **errp)
+{
+    IobcMachineState *m = IOBC_MACHINE(obj);
+    unsigned idx = (uintptr_t)opaque;
+    char *value = m->iox_socket[idx] ? m->iox_socket[idx] : (char *)iobc_iox_sockets[idx].file;
+
+    visit_type_str(v, name, &value, errp);
+}
+
+static void iobc_set_iox_socket(Object *obj, Visitor *v, const char *name,
+                                void *opaque, Error **errp)
+{
+    IobcMachineState *m = IOBC_MACHINE(obj);
+    unsigned idx = (uintptr_t)opaque;
+    Error *err = NULL;
+    char *value;
+
+    visit_type_str(v, name, &value, &err);
+    if (err) {
+        error_propagate(errp, err);
+        return;
+    }
+
+    g_free(m->iox_socket[idx]);
+    m->iox_socket[idx] = value;
+}
+
+static char *iobc_get_iox_trace(Object *obj, Error **errp)
+{
+    const char *path = iox_trace_path();
+    return g_strdup(path ? path : "");
+}
+
+static void iobc_set_iox_trace(Object *obj, const char *value, Error **errp)
+{
+    if (value[0])
+        iox_trace_start(value, errp);
+    else
+        iox_trace_stop();
+}
+
+static char *iobc_get_iox_replay(Object *obj, Error **errp)
+{
+    const char *path = iox_replay_path();
+    return g_strdup(path ? path : "");
+}
+
+static void iobc_set_iox_replay(Object *obj, const char *value, Error **errp)
+{
+    // servers are attached to the replay when opened, i.e. on realize
+    if (qdev_hotplug) {
+        error_setg(errp, "iox-replay can only be set on startup");
+        return;
+    }
+
+    iox_replay_load(value, errp);
+}
+
+static bool iobc_get_iox_replay_diverged(Object *obj, Error **errp)
+{
+    return iox_replay_diverged();
+}
+
+static void iobc_get_iox_stats(Object *obj, Visitor *v, const char *name,
+                               void *opaque, Error **errp)
+{
+    iox_visit_stats(v, name, errp);
+}
+
+static void iobc_machine_class_init(ObjectClass *oc, void *data)
+{
+    MachineClass *mc = MACHINE_CLASS(oc);
+    unsigned i;
+
     mc->desc = "ISIS-OBC for CubeSat";
     mc->init = iobc_init;
     mc->default_cpu_type = ARM_CPU_TYPE_NAME("arm926");
+
+    object_class_property_add_bool(oc, "idle-warp", iobc_get_idle_warp,
+                                   iobc_set_idle_warp, &error_abort);
+    object_class_property_set_description(oc, "idle-warp",
+            "Advance virtual time to the next timer deadline while the CPU is halted",
+            &error_abort);
+
+    // statistics, query via qom-get
+    object_class_property_add(oc, "idle-warp-speedup", "number",
+                              iobc_get_idle_warp_speedup, NULL, NULL, NULL,
+                              &error_abort);
+    object_class_property_set_description(oc, "idle-warp-speedup",
+            "Ratio of elapsed virtual time to elapsed real time", &error_abort);
+
+    object_class_property_add(oc, "idle-warp-skipped", "int",
+                              iobc_get_idle_warp_skipped, NULL, NULL, NULL,
+                              &error_abort);
+    object_class_property_set_description(oc, "idle-warp-skipped",
+            "Virtual time skipped by idle-warp, in nanoseconds", &error_abort);
+
+    // fork-server, see iobc-fork_server.h
+    object_class_property_add_str(oc, "fork", NULL, iobc_set_fork, &error_abort);
+    object_class_property_set_description(oc, "fork",
+            "Fork a child process with IOX sockets in the given directory",
+            &error_abort);
+
+    object_class_property_add(oc, "fork-pid", "int",
+                              iobc_get_fork_pid, NULL, NULL, NULL,
+                              &error_abort);
+    object_class_property_set_description(oc, "fork-pid",
+            "PID of the last forked child process", &error_abort);
+
+    // IOX output queue, see ioxfer-server.h
+    object_class_property_add(oc, "iox-queue-limit", "size",
+                              iobc_get_iox_queue_limit, iobc_set_iox_queue_limit,
+                              NULL, NULL, &error_abort);
+    object_class_property_set_description(oc, "iox-queue-limit",
+            "High-water mark of the IOX output queues, in bytes", &error_abort);
+
+    // IOX sockets, allows running multiple instances side by side
+    object_class_property_add_str(oc, "iox-dir", iobc_get_iox_dir, iobc_set_iox_dir,
+                                  &error_abort);
+    object_class_property_set_description(oc, "iox-dir",
+            "Directory for the IOX sockets, created if it does not exist",
+            &error_abort);
+
+    for (i = 0; i < __IOX_SOCKET_NUM; i++) {
+        g_autofree char *name = g_strdup_printf("iox-socket-%s", iobc_iox_sockets[i].name);
+        g_autofree char *desc = g_strdup_printf("IOX socket of %s, absolute or relative "
+                                                "to iox-dir, empty to disable",
+                                                iobc_iox_sockets[i].name);
+
+        object_class_property_add(oc, name, "str",
+                                  iobc_get_iox_socket, iobc_set_iox_socket,
+                                  NULL, (void *)(uintptr_t)i, &error_abort);
+        object_class_property_set_description(oc, name, desc, &error_abort);
+    }
+
+    // IOX traffic capture, see ioxfer-trace.h
+    object_class_property_add_str(oc, "iox-trace", iobc_get_iox_trace, iobc_set_iox_trace,
+                                  &error_abort);
+    object_class_property_set_description(oc, "iox-trace",
+            "Capture all IOX frames to the given file, empty to stop capturing",
+            &error_abort);
+
+    // IOX replay, see ioxfer-replay.h
+    object_class_property_add_str(oc, "iox-replay", iobc_get_iox_replay, iobc_set_iox_replay,
+                                  &error_abort);
+    object_class_property_set_description(oc, "iox-replay",
+            "Feed all IOX servers from the given trace instead of their sockets",
+            &error_abort);
+
+    object_class_property_add_bool(oc, "iox-replay-diverged",
+                                   iobc_get_iox_replay_diverged, NULL, &error_abort);
+    object_class_property_set_description(oc, "iox-replay-diverged",
+            "Whether device output has diverged from the replayed trace",
+            &error_abort);
+
+    object_class_property_add(oc, "iox-stats", "list",
+                              iobc_get_iox_stats, NULL, NULL, NULL,
+                              &error_abort);
+    object_class_property_set_description(oc, "iox-stats",
+            "IOX output queue depth, stall time and dropped frames per server",
+            &error_abort);
+}
+
+static const TypeInfo iobc_machine_info = {
+    .name = TYPE_IOBC_MACHINE,
+    .parent = TYPE_MACHINE,
+    .instance_size = sizeof(IobcMachineState),
+    .class_init = iobc_machine_class_init,
+};
+
+static void iobc_machine_register_types(void)
+{
+    type_register_static(&iobc_machine_info);
 }
 
-DEFINE_MACHINE("isis-obc", iobc_machine_init)
+type_init(iobc_machine_register_types)
@@ -0,0 +1,103 @@
+/*
+ * Fork-server support for the ISIS-OBC board.
+ *
+ * See iobc-fork_server.h for details.
+ *
+ * Copyright (c) 2019-2020 KSat e.V. Stuttgart
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or, at your
+ * option, any later version. See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
+#include "qapi/error.h"
+#include "block/block.h"
+#include "monitor/monitor.h"
+#include "sysemu/cpus.h"
+#include "sysemu/runstate.h"
+#include "sysemu/tcg.h"
+
+#include "iobc-fork_server.h"
+#include "ioxfer-server.h"
+#include "ioxfer-trace.h"
+
+
+static void iobc_fork_child(IobcForkServer *fs, const char *dir)
+{
+    Error *err = NULL;
+
+    // only this thread survived the fork, take over for the lost ones
+    monitor_fork_child();
+    qemu_tcg_fork_child_vcpus();
+
+    // the workers of the thread pool are gone, create a new pool on demand
+    qemu_get_aio_context()->thread_pool = NULL;
+
+    // the trace belongs to the parent
+    iox_trace_fork_child();
+
+    if (iox_servers_fork_child(dir, &err)) {
+        error_report_err(err);
+        exit(1);
+    }
+
+    fs->last_pid = 0;
+    fs->children = 0;
+
+    info_report("iobc: fork child %d started", getpid());
+    vm_start();
+}
+
+int iobc_fork_server_fork(IobcForkServer *fs, const char *dir, Error **errp)
+{
+    pid_t pid;
+
+    if (!tcg_enabled()) {
+        error_setg(errp, "iobc: fork is only supported with TCG");
+        return -1;
+    }
+
+    if (runstate_is_running()) {
+        error_setg(errp, "iobc: VM must be stopped before forking");
+        return -1;
+    }
+
+    if (iox_servers_use_iothread()) {
+        error_setg(errp, "iobc: fork is not supported with IOX I/O threads");
+        return -1;
+    }
+
+    if (!g_file_test(dir, G_FILE_TEST_IS_DIR)) {
+        error_setg(errp, "iobc: fork: '%s' is not a directory", dir);
+        return -1;
+    }
+
+    // requests handled by the thread pool would be lost in the child
+    bdrv_drain_all();
+
+    // let RCU re-initialize itself in the child
+    rcu_enable_atfork();
+    pid = fork();
+    rcu_disable_atfork();
+
+    if (pid < 0) {
+        error_setg_errno(errp, errno, "iobc: fork failed");
+        return -1;
+    }
+
+    if (pid == 0) {
+        iobc_fork_child(fs, dir);
+        return 0;
+    }
+
+    qemu_add_child_watch(pid);
+
+    fs->last_pid = pid;
+    fs->children += 1;
+
+    info_report("iobc: forked child %d (sockets in %s)", pid, dir);
+    return 0;
+}
@@ -0,0 +1,51 @@
+/*
+ * Fork-server support for the ISIS-OBC board.
+ *
+ * Allows to clone a running (e.g. booted) iOBC into any number of child
+ * processes via fork(), each continuing from the exact same state. Children
+ * share all guest memory (SDRAM, NOR flash, ...) with the parent on a
+ * copy-on-write basis, making them cheap to create.
+ *
+ * Usage (via QMP on a socket monitor of the parent):
+ * 1. Stop the VM at the desired point, e.g. via "stop" or by hitting a
+ *    breakpoint via the GDB stub.
+ * 2. Fork a child via
+ *      { "execute": "qom-set", "arguments": { "path": "/machine",
+ *        "property": "fork", "value": "/path/to/dir" } }
+ *    The child re-opens all IOX servers in the given (existing) directory,
+ *    using the file name of the original socket (e.g. qemu_at91_usart0), and
+ *    starts running immediately. The parent stays stopped.
+ * 3. Query the PID of the child via qom-get of the "fork-pid" property.
+ *
+ * Notes:
+ * - Children inherit but do not use the monitors of the parent, they are
+ *   controlled via their IOX sockets and terminated via signals.
+ * - Only supported with TCG. Additional I/O threads (-object iothread) and
+ *   a PID file (-pidfile) are not supported.
+ * - Other character devices (e.g. DBGU on stdio) are shared with the parent.
+ *
+ * Copyright (c) 2019-2020 KSat e.V. Stuttgart
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or, at your
+ * option, any later version. See the COPYING file in the top-level directory.
+ */
+
+#ifndef HW_ARM_ISIS_OBC_FORK_SERVER_H
+#define HW_ARM_ISIS_OBC_FORK_SERVER_H
+
+#include "qemu/osdep.h"
+
+
+typedef struct {
+    int64_t last_pid;
+    uint64_t children;
+} IobcForkServer;
+
+
+/*
+ * Fork a new child process using the given directory for its IOX sockets.
+ * Returns zero in both parent and child on success. The VM must be stopped.
+ */
+int iobc_fork_server_fork(IobcForkServer *fs, const char *dir, Error **errp);
+
+#endif /* HW_ARM_ISIS_OBC_FORK_SERVER_H */
@@ -0,0 +1,137 @@
+/*
+ * Idle time-warp for the ISIS-OBC board.
+ *
+ * See iobc-idle_warp.h for details.
+ *
+ * Copyright (c) 2019-2020 KSat e.V. Stuttgart
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or, at your
+ * option, any later version. See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
+#include "sysemu/cpus.h"
+#include "sysemu/runstate.h"
+
+#include "iobc-idle_warp.h"
+#include "ioxfer-server.h"
+
+
+static unsigned idle_warp_holds;
+
+static int64_t idle_warp_delta(IobcIdleWarp *w)
+{
+    if (!w->enabled || !runstate_is_running())
+        return 0;
+
+    if (!w->cpu->halted || cpu_has_work(w->cpu))
+        return 0;
+
+    if (iox_input_pending() || iox_output_pending() || iox_response_pending())
+        return 0;
+
+    if (idle_warp_holds)
+        return 0;
+
+    // -1 if there is no timer, 0 if timers are already expired
+    return MAX(qemu_clock_deadline_ns_all(QEMU_CLOCK_VIRTUAL, QEMU_TIMER_ATTR_ALL), 0);
+}
+
+static bool idle_warp_fds_ready(MainLoopPoll *poll)
+{
+    for (int i = 0; i < poll->pollfds->len; i++) {
+        if (g_array_index(poll->pollfds, GPollFD, i).revents)
+            return true;
+    }
+
+    return false;
+}
+
+static void idle_warp_poll_notify(Notifier *notifier, void *data)
+{
+    IobcIdleWarp *w = container_of(notifier, IobcIdleWarp, poll_notifier);
+    MainLoopPoll *poll = data;
+    int64_t delta;
+
+    switch (poll->state) {
+    case MAIN_LOOP_POLL_FILL:
+        // don't block in poll, we check for events and warp afterwards
+        w->armed = idle_warp_delta(w) > 0;
+        if (w->armed)
+            poll->timeout = 0;
+        break;
+
+    case MAIN_LOOP_POLL_OK:
+        if (!w->armed)
+            break;
+
+        w->armed = false;
+
+        // let the main loop handle pending I/O first
+        if (idle_warp_fds_ready(poll))
+            break;
+
+        // conditions may have changed while polling, so re-check
+        delta = idle_warp_delta(w);
+        if (delta > 0) {
+            cpu_clock_warp(delta);
+
+            w->warped_ns += delta;
+            w->warps += 1;
+        }
+        break;
+
+    case MAIN_LOOP_POLL_ERR:
+        w->armed = false;
+        break;
+    }
+}
+
+void iobc_idle_warp_init(IobcIdleWarp *w, CPUState *cpu)
+{
+    w->cpu = cpu;
+    w->armed = false;
+
+    w->ref_real = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    w->ref_virt = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    w->warped_ns = 0;
+    w->warps = 0;
+
+    w->poll_notifier.notify = idle_warp_poll_notify;
+    main_loop_poll_add_notifier(&w->poll_notifier);
+}
+
+void iobc_idle_warp_set_enabled(IobcIdleWarp *w, bool enabled)
+{
+    if (enabled && use_icount) {
+        warn_report("iobc: idle-warp is not supported with icount, use -icount sleep=off instead");
+        enabled = false;
+    }
+
+    w->enabled = enabled;
+}
+
+void iobc_idle_warp_hold(void)
+{
+    idle_warp_holds += 1;
+}
+
+void iobc_idle_warp_release(void)
+{
+    assert(idle_warp_holds > 0);
+    idle_warp_holds -= 1;
+}
+
+double iobc_idle_warp_speedup(IobcIdleWarp *w)
+{
+    int64_t real = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - w->ref_real;
+    int64_t virt = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) - w->ref_virt;
+
+    if (real <= 0)
+        return 1.0;
+
+    return (double)virt / (double)real;
+}
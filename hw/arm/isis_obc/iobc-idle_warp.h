@@ -0,0 +1,70 @@
+/*
+ * Idle time-warp for the ISIS-OBC board.
+ *
+ * Skips over periods in which the CPU is halted (e.g. by disabling the
+ * processor clock in the idle loop, see at91-pmc.h): Instead of waiting in
+ * real time for the next timer to expire, QEMU_CLOCK_VIRTUAL is advanced
+ * directly to the earliest pending deadline of all virtual-clock timers
+ * (PIT, RTT, TC, TWI, ...). Virtual time will thus run faster than real time
+ * while the firmware is idle.
+ *
+ * Time is not warped while
+ * - the CPU has pending work (e.g. interrupts),
+ * - any file descriptor of the main loop is ready (e.g. an IOX client has
+ *   sent data that has not been processed yet),
+ * - any IOX server has only received a part of a frame,
+ * - any device waits for the response of an IOX client (e.g. the SPI in
+ *   master mode),
+ * - any device holds it off, e.g. while block I/O is in flight,
+ * - the VM is not running.
+ *
+ * Warping is not available in icount mode, which provides its own mechanism
+ * (-icount sleep=off).
+ *
+ * Copyright (c) 2019-2020 KSat e.V. Stuttgart
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or, at your
+ * option, any later version. See the COPYING file in the top-level directory.
+ */
+
+#ifndef HW_ARM_ISIS_OBC_IDLE_WARP_H
+#define HW_ARM_ISIS_OBC_IDLE_WARP_H
+
+#include "qemu/osdep.h"
+#include "qemu/notify.h"
+#include "hw/core/cpu.h"
+
+
+typedef struct {
+    CPUState *cpu;
+    Notifier poll_notifier;
+
+    bool enabled;
+    bool armed;
+
+    // statistics
+    int64_t ref_real;
+    int64_t ref_virt;
+    int64_t warped_ns;
+    uint64_t warps;
+} IobcIdleWarp;
+
+
+void iobc_idle_warp_init(IobcIdleWarp *w, CPUState *cpu);
+void iobc_idle_warp_set_enabled(IobcIdleWarp *w, bool enabled);
+
+/*
+ * Hold off warping while a device waits for something completing in real
+ * time, e.g. asynchronous block I/O. Calls nest, each hold must be paired
+ * with a release. Must be called with the BQL held.
+ */
+void iobc_idle_warp_hold(void);
+void iobc_idle_warp_release(void);
+
+/*
+ * Ratio of elapsed virtual time to elapsed real time since the warp has been
+ * initialized.
+ */
+double iobc_idle_warp_speedup(IobcIdleWarp *w);
+
+#endif /* HW_ARM_ISIS_OBC_IDLE_WARP_H */
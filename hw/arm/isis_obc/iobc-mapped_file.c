@@ -0,0 +1,49 @@
+/*
+ * Shared memory file backing for ISIS-OBC devices.
+ *
+ * See iobc-mapped_file.h for details.
+ *
+ * Copyright (c) 2019-2020 KSat e.V. Stuttgart
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or, at your
+ * option, any later version. See the COPYING file in the top-level directory.
+ */
+
+#include "iobc-mapped_file.h"
+
+#include <sys/mman.h>
+
+
+void *iobc_map_file(const char *owner, const char *path, size_t size, Error **errp)
+{
+    struct stat st;
+    void *mem;
+    int fd;
+
+    fd = qemu_open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "%s: cannot open '%s'", owner, path);
+        return NULL;
+    }
+
+    if (fstat(fd, &st) || (st.st_size < size && ftruncate(fd, size))) {
+        error_setg_errno(errp, errno, "%s: cannot resize '%s'", owner, path);
+        qemu_close(fd);
+        return NULL;
+    }
+
+    mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    qemu_close(fd);
+
+    if (mem == MAP_FAILED) {
+        error_setg_errno(errp, errno, "%s: cannot map '%s'", owner, path);
+        return NULL;
+    }
+
+    return mem;
+}
+
+void iobc_unmap_file(void *mem, size_t size)
+{
+    munmap(mem, size);
+}
@@ -0,0 +1,34 @@
+/*
+ * Shared memory file backing for ISIS-OBC devices.
+ *
+ * Maps a file into memory so that device contents (e.g. F-RAM or register
+ * maps) persist across runs and can be accessed by other processes while the
+ * emulator is running. The file is created if it does not exist and grown to
+ * the requested size if it is smaller, existing contents are kept.
+ *
+ * Copyright (c) 2019-2020 KSat e.V. Stuttgart
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or, at your
+ * option, any later version. See the COPYING file in the top-level directory.
+ */
+
+#ifndef HW_ARM_ISIS_OBC_MAPPED_FILE_H
+#define HW_ARM_ISIS_OBC_MAPPED_FILE_H
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+
+
+/*
+ * Map the first size bytes of the file at path, shared and writable. Errors
+ * are reported via errp, prefixed with the given owner (e.g. the device
+ * name). Returns NULL on failure.
+ */
+void *iobc_map_file(const char *owner, const char *path, size_t size, Error **errp);
+
+/*
+ * Unmap memory returned by iobc_map_file().
+ */
+void iobc_unmap_file(void *mem, size_t size);
+
+#endif /* HW_ARM_ISIS_OBC_MAPPED_FILE_H */
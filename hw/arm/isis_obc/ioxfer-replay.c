@@ -0,0 +1,369 @@
+/*
+ * I/O Transfer Server (IOX) replay.
+ *
+ * See ioxfer-replay.h for details.
+ *
+ * Copyright (c) 2019-2020 KSat e.V. Stuttgart
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or, at your
+ * option, any later version. See the COPYING file in the top-level directory.
+ */
+
+#include "ioxfer-replay.h"
+#include "ioxfer-trace.h"
+#include "qemu/bswap.h"
+#include "qemu/error-report.h"
+#include "qemu/notify.h"
+#include "qemu/timer.h"
+#include "sysemu/sysemu.h"
+
+
+struct iox_replay_frame {
+    int64_t time;
+    struct iox_data_frame frame;
+};
+
+struct IoXferReplayStream {
+    char *name;
+    IoXferServer *server;
+    QEMUTimer *timer;
+
+    GArray *input;          // struct iox_replay_frame
+    GArray *output;         // struct iox_replay_frame
+    unsigned next_in;
+    unsigned next_out;
+    uint32_t max_payload;
+};
+
+struct iox_replay {
+    char *path;
+    gchar *data;            // trace contents, payloads point into this
+    gsize size;
+
+    IoXferReplayStream *streams[256];
+    GPtrArray *unknown;     // streams of servers not in the recording
+
+    bool diverged;
+    uint64_t matched;
+};
+
+static struct iox_replay *iox_replay;
+static Notifier iox_replay_exit_notifier;
+
+
+static IoXferReplayStream *iox_replay_stream_new(const char *name)
+{
+    IoXferReplayStream *rs = g_new0(IoXferReplayStream, 1);
+
+    rs->name = g_strdup(name);
+    rs->input = g_array_new(false, false, sizeof(struct iox_replay_frame));
+    rs->output = g_array_new(false, false, sizeof(struct iox_replay_frame));
+    rs->max_payload = 0xff;
+
+    return rs;
+}
+
+static void iox_replay_report(IoXferReplayStream *rs, const char *what,
+                              const struct iox_replay_frame *expected,
+                              const struct iox_data_frame *actual)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    g_autofree char *exp = NULL;
+    g_autofree char *act = NULL;
+
+    iox_replay->diverged = true;
+
+    act = g_strdup_printf("seq=0x%02x cat=0x%02x id=0x%02x len=%u",
+                          actual->seq, actual->cat, actual->id, actual->len);
+
+    if (!expected) {
+        error_report("iox: replay diverged at %" PRId64 " ns on %s: %s output %s",
+                     now, rs->name, what, act);
+        return;
+    }
+
+    exp = g_strdup_printf("seq=0x%02x cat=0x%02x id=0x%02x len=%u",
+                          expected->frame.seq, expected->frame.cat, expected->frame.id,
+                          expected->frame.len);
+
+    error_report("iox: replay diverged at %" PRId64 " ns on %s, output frame %u: %s, "
+                 "expected %s (recorded at %" PRId64 " ns), got %s",
+                 now, rs->name, rs->next_out, what, exp, expected->time, act);
+}
+
+void iox_replay_output(IoXferReplayStream *rs, const struct iox_data_frame *frame)
+{
+    struct iox_replay_frame *expected;
+
+    // only report the first divergence, anything after that is noise
+    if (iox_replay->diverged)
+        return;
+
+    if (rs->next_out >= rs->output->len) {
+        iox_replay_report(rs, "unexpected", NULL, frame);
+        return;
+    }
+
+    expected = &g_array_index(rs->output, struct iox_replay_frame, rs->next_out);
+
+    if (expected->frame.seq != frame->seq || expected->frame.cat != frame->cat
+            || expected->frame.id != frame->id || expected->frame.len != frame->len) {
+        iox_replay_report(rs, "different header", expected, frame);
+        return;
+    }
+
+    if (frame->len && memcmp(expected->frame.payload, frame->payload, frame->len)) {
+        iox_replay_report(rs, "different payload", expected, frame);
+        return;
+    }
+
+    rs->next_out++;
+    iox_replay->matched++;
+}
+
+static void iox_replay_arm(IoXferReplayStream *rs)
+{
+    struct iox_replay_frame *next;
+
+    if (rs->next_in >= rs->input->len)
+        return;
+
+    next = &g_array_index(rs->input, struct iox_replay_frame, rs->next_in);
+    timer_mod(rs->timer, next->time);
+}
+
+static void iox_replay_inject(void *opaque)
+{
+    IoXferReplayStream *rs = opaque;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    while (rs->next_in < rs->input->len) {
+        struct iox_replay_frame *next;
+
+        next = &g_array_index(rs->input, struct iox_replay_frame, rs->next_in);
+        if (next->time > now)
+            break;
+
+        rs->next_in++;
+        iox_server_inject(rs->server, &next->frame);
+    }
+
+    iox_replay_arm(rs);
+}
+
+IoXferReplayStream *iox_replay_attach(IoXferServer *srv, const char *name)
+{
+    IoXferReplayStream *rs = NULL;
+    unsigned i;
+
+    if (!iox_replay)
+        return NULL;
+
+    for (i = 0; i < ARRAY_SIZE(iox_replay->streams) && !rs; i++) {
+        if (iox_replay->streams[i] && !strcmp(iox_replay->streams[i]->name, name))
+            rs = iox_replay->streams[i];
+    }
+
+    // any output of a server not in the recording is a divergence
+    if (!rs) {
+        rs = iox_replay_stream_new(name);
+        g_ptr_array_add(iox_replay->unknown, rs);
+    }
+
+    if (rs->server)
+        return rs;
+
+    rs->server = srv;
+    rs->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, iox_replay_inject, rs);
+    iox_replay_arm(rs);
+
+    return rs;
+}
+
+void iox_replay_detach(IoXferReplayStream *rs)
+{
+    if (!rs->server)
+        return;
+
+    timer_free(rs->timer);
+    rs->timer = NULL;
+    rs->server = NULL;
+}
+
+uint32_t iox_replay_max_payload(IoXferReplayStream *rs)
+{
+    return rs->max_payload;
+}
+
+const char *iox_replay_path(void)
+{
+    return iox_replay ? iox_replay->path : NULL;
+}
+
+bool iox_replay_diverged(void)
+{
+    return iox_replay && iox_replay->diverged;
+}
+
+static void iox_replay_exit(Notifier *n, void *data)
+{
+    uint64_t missing = 0;
+    unsigned i;
+
+    if (iox_replay->diverged)
+        return;
+
+    for (i = 0; i < ARRAY_SIZE(iox_replay->streams); i++) {
+        if (iox_replay->streams[i])
+            missing += iox_replay->streams[i]->output->len - iox_replay->streams[i]->next_out;
+    }
+
+    if (missing)
+        info_report("iox: replay matched %" PRIu64 " output frames, %" PRIu64
+                    " recorded frames not reached", iox_replay->matched, missing);
+    else
+        info_report("iox: replay matched all %" PRIu64 " output frames", iox_replay->matched);
+}
+
+static int iox_replay_parse(struct iox_replay *r, Error **errp)
+{
+    const uint8_t *data = (const uint8_t *)r->data;
+    uint64_t dropped = 0;
+    gsize pos;
+
+    if (r->size < IOX_TRACE_HDR_LEN || memcmp(data, IOX_TRACE_MAGIC, 8)) {
+        error_setg(errp, "iox: %s is not an IOX trace", r->path);
+        return -1;
+    }
+
+    if (ldl_le_p(data + 8) != IOX_TRACE_VERSION) {
+        error_setg(errp, "iox: unsupported trace version %u", ldl_le_p(data + 8));
+        return -1;
+    }
+
+    pos = ldl_le_p(data + 12);
+    if (pos < IOX_TRACE_HDR_LEN || pos > r->size) {
+        error_setg(errp, "iox: malformed trace %s", r->path);
+        return -1;
+    }
+
+    while (r->size - pos >= IOX_TRACE_REC_HDR_LEN) {
+        const uint8_t *rec = data + pos;
+        uint32_t size = ldl_le_p(rec);
+        uint8_t type = rec[4];
+        uint8_t server = rec[5];
+        uint8_t flags = rec[6];
+        const uint8_t *body = rec + IOX_TRACE_REC_HDR_LEN;
+        uint32_t len = size - IOX_TRACE_REC_HDR_LEN;
+        IoXferReplayStream *rs = r->streams[server];
+        struct iox_replay_frame f;
+        g_autofree char *name = NULL;
+        g_autofree char *base = NULL;
+
+        if (size < IOX_TRACE_REC_HDR_LEN || size > r->size - pos) {
+            warn_report("iox: trace %s is truncated", r->path);
+            break;
+        }
+
+        pos += size;
+
+        switch (type) {
+        case IOX_TRACE_REC_SERVER:
+            name = g_strndup((const char *)body, len);
+            base = g_path_get_basename(name);
+
+            if (!rs)
+                r->streams[server] = iox_replay_stream_new(base);
+            break;
+
+        case IOX_TRACE_REC_FRAME:
+            if (!rs || len < IOX_TRACE_FRAME_HDR_LEN
+                    || ldl_le_p(body + 4) != len - IOX_TRACE_FRAME_HDR_LEN) {
+                error_setg(errp, "iox: malformed frame record in trace %s", r->path);
+                return -1;
+            }
+
+            f.time = ldq_le_p(rec + 8);
+            f.frame.seq = body[0];
+            f.frame.cat = body[1];
+            f.frame.id = body[2];
+            f.frame.len = ldl_le_p(body + 4);
+            f.frame.payload = (uint8_t *)body + IOX_TRACE_FRAME_HDR_LEN;
+
+            if (flags & IOX_TRACE_FLAG_OUT) {
+                g_array_append_val(rs->output, f);
+
+                // output has been split into frames of at most this size
+                if (f.frame.len > 0xff)
+                    rs->max_payload = IOX_FRAME_MAX_PAYLOAD;
+            } else {
+                g_array_append_val(rs->input, f);
+            }
+            break;
+
+        case IOX_TRACE_REC_DROPPED:
+            if (len >= sizeof(uint64_t))
+                dropped += ldq_le_p(body);
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    if (dropped)
+        warn_report("iox: %" PRIu64 " records have been dropped while recording %s, "
+                    "replay will diverge", dropped, r->path);
+
+    return 0;
+}
+
+int iox_replay_load(const char *path, Error **errp)
+{
+    struct iox_replay *r;
+    GError *err = NULL;
+    unsigned i;
+
+    if (iox_replay) {
+        error_setg(errp, "iox: already replaying %s", iox_replay->path);
+        return -1;
+    }
+
+    r = g_new0(struct iox_replay, 1);
+    r->path = g_strdup(path);
+    r->unknown = g_ptr_array_new();
+
+    if (!g_file_get_contents(path, &r->data, &r->size, &err)) {
+        error_setg(errp, "iox: cannot read trace %s: %s", path, err->message);
+        g_error_free(err);
+        goto err;
+    }
+
+    if (iox_replay_parse(r, errp))
+        goto err;
+
+    iox_replay = r;
+
+    iox_replay_exit_notifier.notify = iox_replay_exit;
+    qemu_add_exit_notifier(&iox_replay_exit_notifier);
+
+    info_report("iox: replaying %s", path);
+    return 0;
+
+err:
+    // streams are not attached yet, nothing else references them
+    for (i = 0; i < ARRAY_SIZE(r->streams); i++) {
+        if (r->streams[i]) {
+            g_array_free(r->streams[i]->input, true);
+            g_array_free(r->streams[i]->output, true);
+            g_free(r->streams[i]->name);
+            g_free(r->streams[i]);
+        }
+    }
+
+    g_ptr_array_free(r->unknown, true);
+    g_free(r->data);
+    g_free(r->path);
+    g_free(r);
+    return -1;
+}
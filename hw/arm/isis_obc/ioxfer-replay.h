@@ -0,0 +1,71 @@
+/*
+ * I/O Transfer Server (IOX) replay.
+ *
+ * Feeds the IOX servers of all devices from a trace recorded via
+ * ioxfer-trace.h instead of their sockets, e.g. to reproduce a failed test
+ * without the original device simulators. While replaying, servers do not
+ * listen on their sockets. Servers are matched to the recording via the
+ * file name of their socket (e.g. qemu_at91_usart0), so the socket directory
+ * may differ between recording and replay.
+ *
+ * Input frames are passed to the device at their recorded virtual time,
+ * output frames of the device are compared to the recording, in order and
+ * per server. The first divergence (different or unexpected output frame)
+ * is reported, further output is not compared anymore. Deterministic replay
+ * requires the same guest, the same configuration and -icount, with a trace
+ * recorded from startup.
+ *
+ * Copyright (c) 2019-2020 KSat e.V. Stuttgart
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or, at your
+ * option, any later version. See the COPYING file in the top-level directory.
+ */
+
+#ifndef HW_ARM_ISIS_OBC_IOXFER_REPLAY_H
+#define HW_ARM_ISIS_OBC_IOXFER_REPLAY_H
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+
+#include "ioxfer-server.h"
+
+
+/*
+ * Load the given trace and replay it to all servers opened afterwards. Must
+ * be called before any server has been opened.
+ */
+int iox_replay_load(const char *path, Error **errp);
+
+/*
+ * Path of the replayed trace, NULL if not replaying.
+ */
+const char *iox_replay_path(void);
+
+/*
+ * Whether output of any device has diverged from the recording.
+ */
+bool iox_replay_diverged(void);
+
+/*
+ * Attach a server to the recorded stream with the given name (socket file
+ * name) and start injecting its input. Returns NULL if not replaying.
+ */
+IoXferReplayStream *iox_replay_attach(IoXferServer *srv, const char *name);
+
+/*
+ * Stop injecting input into the server attached to the stream.
+ */
+void iox_replay_detach(IoXferReplayStream *rs);
+
+/*
+ * Maximum payload length of output frames in the recording, used to split
+ * output in the same way as during recording.
+ */
+uint32_t iox_replay_max_payload(IoXferReplayStream *rs);
+
+/*
+ * Compare an output frame of the device to the recording.
+ */
+void iox_replay_output(IoXferReplayStream *rs, const struct iox_data_frame *frame);
+
+#endif /* HW_ARM_ISIS_OBC_IOXFER_REPLAY_H */
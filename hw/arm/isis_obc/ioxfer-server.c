@@ -10,152 +10,1588 @@
  */
 
 #include "ioxfer-server.h"
+#include "ioxfer-replay.h"
+#include "ioxfer-trace.h"
+
+#include <sys/file.h>
+
+#include "qemu/atomic.h"
+#include "qemu/bitmap.h"
+#include "qemu/bswap.h"
 #include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/memfd.h"
+#include "qemu/sockets.h"
+#include "qemu/timer.h"
 #include "qapi/error.h"
+#include "qapi/clone-visitor.h"
+#include "qapi/qapi-visit-sockets.h"
+#include "qapi/visitor.h"
+#include "block/aio-wait.h"
+#include "sysemu/replay.h"
+#include "sysemu/sysemu.h"
+#include "migration/qemu-file-types.h"
+
+
+static void server_accept(QIONetListener *listener, QIOChannelSocket *sioc, gpointer data);
+static gboolean client_receive(QIOChannel *ioc, GIOCondition cond, gpointer data);
+static gboolean client_hup(QIOChannel *ioc, GIOCondition cond, gpointer data);
+static gboolean client_writable(QIOChannel *ioc, GIOCondition cond, gpointer data);
+
+static QLIST_HEAD(, IoXferServer) iox_servers = QLIST_HEAD_INITIALIZER(iox_servers);
+static Notifier iox_exit_notifier;
+
+static void iox_servers_exit(Notifier *n, void *data);
+static size_t iox_queue_limit = IOX_QUEUE_LIMIT_DEFAULT;
+static uint8_t iox_trace_next_id;
+
+
+#define IOX_FRAME_HDR_V1_LEN    4
+#define IOX_FRAME_HDR_V2_LEN    8
+#define IOX_FRAME_HDR_MAX_LEN   IOX_FRAME_HDR_V2_LEN
+
+#define IOX_INPUT_CHUNK         0x10000
+#define IOX_OUTPUT_IOV_MAX      64
+
+static unsigned iox_frame_hdr_len(IoXferClient *cl)
+{
+    return cl->version >= 2 ? IOX_FRAME_HDR_V2_LEN : IOX_FRAME_HDR_V1_LEN;
+}
+
+static uint32_t iox_frame_max_payload(IoXferClient *cl)
+{
+    return cl->version >= 2 ? IOX_FRAME_MAX_PAYLOAD : 0xff;
+}
+
+static unsigned iox_frame_hdr_encode(IoXferClient *cl, uint8_t *hdr, uint8_t seq,
+                                     uint8_t cat, uint8_t id, uint32_t len)
+{
+    hdr[0] = seq;
+    hdr[1] = cat;
+    hdr[2] = id;
+
+    if (cl->version >= 2) {
+        hdr[3] = 0;
+        stl_le_p(hdr + 4, len);
+        return IOX_FRAME_HDR_V2_LEN;
+    }
+
+    hdr[3] = len;
+    return IOX_FRAME_HDR_V1_LEN;
+}
+
+static void iox_frame_hdr_decode(IoXferClient *cl, const uint8_t *hdr, struct iox_data_frame *frame)
+{
+    frame->seq = hdr[0];
+    frame->cat = hdr[1];
+    frame->id  = hdr[2];
+    frame->len = cl->version >= 2 ? ldl_le_p(hdr + 4) : hdr[3];
+}
+
+
+/*
+ * Payload of a queued output frame. Shared by all clients the frame has been
+ * queued for, so that it is copied only once.
+ */
+struct iox_out_blob {
+    unsigned refcnt;
+    uint8_t data[];
+};
+
+/*
+ * Output frame queued on a client. The header is encoded per client, as it
+ * depends on the protocol version. Sent counts both header and payload.
+ */
+struct iox_out_entry {
+    uint8_t hdr[IOX_FRAME_HDR_MAX_LEN];
+    unsigned hdr_len;
+    uint32_t len;
+    size_t sent;
+    struct iox_out_blob *blob;
+};
+
+static struct iox_out_blob *iox_out_blob_new(const uint8_t *data, uint32_t len)
+{
+    struct iox_out_blob *blob = g_malloc(sizeof(struct iox_out_blob) + len);
+
+    blob->refcnt = 1;
+    memcpy(blob->data, data, len);
+    return blob;
+}
+
+static struct iox_out_blob *iox_out_blob_ref(struct iox_out_blob *blob)
+{
+    blob->refcnt++;
+    return blob;
+}
+
+static void iox_out_blob_unref(struct iox_out_blob *blob)
+{
+    if (blob && !--blob->refcnt)
+        g_free(blob);
+}
+
+static void iox_out_entry_free(struct iox_out_entry *e)
+{
+    iox_out_blob_unref(e->blob);
+    g_free(e);
+}
+
+
+static size_t iox_out_depth(IoXferServer *srv)
+{
+    return atomic_read(&srv->out_depth) + atomic_read(&srv->io_out_bytes);
+}
+
+static void iox_out_update(IoXferClient *cl, ssize_t delta)
+{
+    cl->out_bytes += delta;
+
+    // congestion of the device is determined by the queue of the input owner
+    if (cl == cl->server->owner)
+        atomic_set(&cl->server->out_depth, cl->out_bytes);
+}
+
+static void iox_out_stall_begin(IoXferClient *cl)
+{
+    if (cl->out_stalled)
+        return;
+
+    cl->out_stalled = true;
+    cl->out_stall_start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+}
+
+static bool iox_out_stall_end(IoXferClient *cl)
+{
+    if (!cl->out_stalled)
+        return false;
+
+    cl->out_stalled = false;
+    atomic_add(&cl->server->out_stall_ns,
+               qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - cl->out_stall_start);
+    return true;
+}
+
+static void iox_server_wakeup(IoXferServer *srv)
+{
+    // the speed of the clients must not influence a recorded execution
+    if (replay_mode != REPLAY_MODE_NONE)
+        return;
+
+    // with an I/O thread, only wake up the device if it has asked us to
+    if (srv->iothread) {
+        if (atomic_xchg(&srv->io_wakeup, false))
+            qemu_bh_schedule(srv->io_drain_bh);
+
+        return;
+    }
+
+    if (srv->drain_handler)
+        srv->drain_handler(srv->handler_opaque);
+}
+
+static void iox_out_drained(IoXferClient *cl)
+{
+    IoXferServer *srv = cl->server;
+    bool stalled = iox_out_stall_end(cl);
+
+    if (cl != srv->owner)
+        return;
+
+    // frames in transit may have congested the device as well
+    if (stalled || srv->iothread)
+        iox_server_wakeup(srv);
+}
+
+static void iox_out_queue(IoXferClient *cl, const uint8_t *hdr, unsigned hdr_len,
+                          const uint8_t *data, uint32_t len, size_t sent,
+                          struct iox_out_blob **blob)
+{
+    struct iox_out_entry *e = g_new(struct iox_out_entry, 1);
+
+    memcpy(e->hdr, hdr, hdr_len);
+    e->hdr_len = hdr_len;
+    e->len = len;
+    e->sent = sent;
+    e->blob = NULL;
+
+    // payload is copied only once, no matter how many clients queue it
+    if (len) {
+        if (!*blob)
+            *blob = iox_out_blob_new(data, len);
+
+        e->blob = iox_out_blob_ref(*blob);
+    }
+
+    iox_out_stall_begin(cl);
+    g_queue_push_tail(&cl->outq, e);
+    iox_out_update(cl, hdr_len + len - sent);
+}
+
+static void iox_out_consume(IoXferClient *cl, size_t n)
+{
+    iox_out_update(cl, -(ssize_t)n);
+
+    while (n) {
+        struct iox_out_entry *e = g_queue_peek_head(&cl->outq);
+        size_t left = e->hdr_len + e->len - e->sent;
+
+        if (n < left) {
+            e->sent += n;
+            break;
+        }
+
+        n -= left;
+        g_queue_pop_head(&cl->outq);
+        iox_out_entry_free(e);
+    }
+}
+
+static void iox_out_clear(IoXferClient *cl)
+{
+    struct iox_out_entry *e;
+
+    while ((e = g_queue_pop_head(&cl->outq)))
+        iox_out_entry_free(e);
+
+    iox_out_update(cl, -(ssize_t)cl->out_bytes);
+}
+
+
+static uint32_t iox_shm_ring_used(struct iox_shm_ring *ring)
+{
+    return atomic_load_acquire(&ring->head) - ring->tail;
+}
+
+static uint32_t iox_shm_ring_free(struct iox_shm_ring *ring)
+{
+    return IOX_SHM_RING_SIZE - (ring->head - atomic_load_acquire(&ring->tail));
+}
+
+static void iox_shm_ring_write(struct iox_shm_ring *ring, uint32_t pos, const void *data, uint32_t len)
+{
+    uint32_t off = (ring->head + pos) & (IOX_SHM_RING_SIZE - 1);
+    uint32_t n = MIN(len, IOX_SHM_RING_SIZE - off);
+
+    memcpy(ring->data + off, data, n);
+    memcpy(ring->data, (const uint8_t *)data + n, len - n);
+}
+
+static void iox_shm_ring_peek(struct iox_shm_ring *ring, uint32_t pos, void *data, uint32_t len)
+{
+    uint32_t off = (ring->tail + pos) & (IOX_SHM_RING_SIZE - 1);
+    uint32_t n = MIN(len, IOX_SHM_RING_SIZE - off);
+
+    memcpy(data, ring->data + off, n);
+    memcpy((uint8_t *)data + n, ring->data, len - n);
+}
+
+static uint8_t *iox_shm_ring_ptr(struct iox_shm_ring *ring, uint32_t pos, uint32_t len,
+                                 uint8_t *bounce)
+{
+    uint32_t off = (ring->tail + pos) & (IOX_SHM_RING_SIZE - 1);
+
+    if (off + len <= IOX_SHM_RING_SIZE)
+        return ring->data + off;
+
+    // data wraps around the end of the ring, we need a contiguous copy
+    iox_shm_ring_peek(ring, pos, bounce, len);
+    return bounce;
+}
+
+static void iox_shm_receive(IoXferClient *cl);
+static void iox_shm_flush(IoXferClient *cl);
+
+static void iox_shm_doorbell(EventNotifier *e)
+{
+    IoXferClient *cl = container_of(e, IoXferClient, shm.rx_doorbell);
+
+    event_notifier_test_and_clear(e);
+
+    // the doorbell is rung both for new data and for free space
+    iox_shm_flush(cl);
+    iox_shm_receive(cl);
+}
+
+static int iox_shm_init(IoXferClient *cl, Error **errp)
+{
+    size_t ring_size = sizeof(struct iox_shm_ring) + IOX_SHM_RING_SIZE;
+    int ret;
+
+    cl->shm.size = 2 * ring_size;
+    cl->shm.mem = qemu_memfd_alloc("iox-shm", cl->shm.size, 0, &cl->shm.memfd, errp);
+    if (!cl->shm.mem)
+        return -1;
+
+    ret = event_notifier_init(&cl->shm.tx_doorbell, false);
+    if (ret) {
+        error_setg_errno(errp, -ret, "iox: cannot create doorbell");
+        goto err_tx;
+    }
+
+    ret = event_notifier_init(&cl->shm.rx_doorbell, false);
+    if (ret) {
+        error_setg_errno(errp, -ret, "iox: cannot create doorbell");
+        goto err_rx;
+    }
+
+    cl->shm.tx = cl->shm.mem;
+    cl->shm.rx = (struct iox_shm_ring *)((uint8_t *)cl->shm.mem + ring_size);
+
+    // we go to sleep right away and want to be notified of any new data
+    cl->shm.rx->consumer_waiting = 1;
+
+    cl->shm.bounce = g_malloc(IOX_FRAME_MAX_PAYLOAD);
+    event_notifier_set_handler(&cl->shm.rx_doorbell, iox_shm_doorbell);
+    return 0;
+
+err_rx:
+    event_notifier_cleanup(&cl->shm.tx_doorbell);
+err_tx:
+    qemu_memfd_free(cl->shm.mem, cl->shm.size, cl->shm.memfd);
+    return -1;
+}
+
+static void iox_shm_destroy(IoXferClient *cl)
+{
+    event_notifier_set_handler(&cl->shm.rx_doorbell, NULL);
+    g_free(cl->shm.bounce);
+
+    event_notifier_cleanup(&cl->shm.rx_doorbell);
+    event_notifier_cleanup(&cl->shm.tx_doorbell);
+    qemu_memfd_free(cl->shm.mem, cl->shm.size, cl->shm.memfd);
+}
+
+static void iox_shm_free(IoXferClient *cl)
+{
+    if (!cl->shm.active)
+        return;
+
+    iox_shm_destroy(cl);
+    cl->shm.active = false;
+}
+
+static int iox_client_reply(IoXferClient *cl, uint8_t seq, uint8_t id, uint32_t len,
+                            const uint8_t *data);
+
+static void iox_shm_setup(IoXferClient *cl, uint8_t seq)
+{
+    uint8_t buf[IOX_FRAME_HDR_MAX_LEN + sizeof(uint32_t)];
+    struct iovec iov = { .iov_base = buf };
+    Error *err = NULL;
+    int fds[3];
+
+    // doorbells are bound to the main loop
+    if (cl->server->iothread) {
+        iox_client_reply(cl, seq, IOX_CID_TRANSPORT_SHM_REJECT, 0, NULL);
+        return;
+    }
+
+    if (cl->shm.active) {
+        warn_report("iox: shared-memory transport already set up");
+        return;
+    }
+
+    // queued output has to go via the socket, we cannot switch before that
+    if (!g_queue_is_empty(&cl->outq)) {
+        warn_report("iox: output pending, rejecting shared-memory transport");
+        iox_client_reply(cl, seq, IOX_CID_TRANSPORT_SHM_REJECT, 0, NULL);
+        return;
+    }
+
+    if (iox_shm_init(cl, &err)) {
+        warn_report_err(err);
+        iox_client_reply(cl, seq, IOX_CID_TRANSPORT_SHM_REJECT, 0, NULL);
+        return;
+    }
+
+    iov.iov_len = iox_frame_hdr_encode(cl, buf, seq, IOX_CAT_TRANSPORT,
+                                       IOX_CID_TRANSPORT_SHM_ACCEPT, sizeof(uint32_t));
+    stl_le_p(buf + iov.iov_len, IOX_SHM_RING_SIZE);
+    iov.iov_len += sizeof(uint32_t);
+
+    fds[0] = cl->shm.memfd;
+    fds[1] = event_notifier_get_fd(&cl->shm.tx_doorbell);
+    fds[2] = cl->shm.rx_doorbell.wfd;
+
+    if (qio_channel_writev_full(QIO_CHANNEL(cl->sioc), &iov, 1, fds, 3, &err) != iov.iov_len) {
+        if (err)
+            warn_report_err(err);
+        else
+            warn_report("iox: cannot send shared-memory setup");
+
+        iox_shm_destroy(cl);
+        return;
+    }
+
+    cl->shm.active = true;
+}
+
+static void iox_shm_publish(IoXferClient *cl, uint32_t len)
+{
+    struct iox_shm_ring *ring = cl->shm.tx;
+
+    atomic_store_release(&ring->head, ring->head + len);
+
+    // only ring the doorbell if the client is actually waiting for it
+    smp_mb();
+    if (atomic_xchg(&ring->consumer_waiting, 0))
+        event_notifier_set(&cl->shm.tx_doorbell);
+}
+
+static void iox_shm_flush(IoXferClient *cl)
+{
+    struct iox_shm_ring *ring = cl->shm.tx;
+    struct iox_out_entry *e;
+    uint32_t pos = 0;
+
+    while ((e = g_queue_peek_head(&cl->outq))) {
+        uint32_t len = e->hdr_len + e->len;
+
+        if (iox_shm_ring_free(ring) - pos < len) {
+            // ring is full, let the client notify us once it has made room
+            atomic_set(&ring->producer_waiting, 1);
+            smp_mb();
+
+            if (iox_shm_ring_free(ring) - pos < len)
+                break;
+        }
+
+        iox_shm_ring_write(ring, pos, e->hdr, e->hdr_len);
+        if (e->len)
+            iox_shm_ring_write(ring, pos + e->hdr_len, e->blob->data, e->len);
+
+        iox_out_consume(cl, len);
+        pos += len;
+    }
+
+    if (pos)
+        iox_shm_publish(cl, pos);
+
+    if (g_queue_is_empty(&cl->outq))
+        iox_out_drained(cl);
+}
+
+static int iox_shm_send(IoXferClient *cl, const uint8_t *hdr, unsigned hdr_len,
+                        const uint8_t *data, uint32_t len, struct iox_out_blob **blob)
+{
+    struct iox_shm_ring *ring = cl->shm.tx;
+
+    // keep frames in order, only write directly if nothing is queued
+    if (!g_queue_is_empty(&cl->outq) || iox_shm_ring_free(ring) < hdr_len + len) {
+        iox_out_queue(cl, hdr, hdr_len, data, len, 0, blob);
+        iox_shm_flush(cl);
+        return 0;
+    }
+
+    iox_shm_ring_write(ring, 0, hdr, hdr_len);
+    if (len)
+        iox_shm_ring_write(ring, hdr_len, data, len);
+
+    iox_shm_publish(cl, hdr_len + len);
+    return 0;
+}
+
+static int iox_socket_send(IoXferClient *cl, const uint8_t *hdr, unsigned hdr_len,
+                           const uint8_t *data, uint32_t len, struct iox_out_blob **blob)
+{
+    QIOChannel *ioc = QIO_CHANNEL(cl->sioc);
+    struct iovec iov[2];
+    ssize_t n = 0;
+
+    iov[0].iov_base = (void *)hdr;
+    iov[0].iov_len = hdr_len;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+
+    // keep frames in order, only write directly if nothing is queued
+    if (g_queue_is_empty(&cl->outq)) {
+        n = qio_channel_writev(ioc, iov, len ? 2 : 1, NULL);
+        if (n == QIO_CHANNEL_ERR_BLOCK)
+            n = 0;
+        else if (n < 0)
+            return 0;       // client is gone, let the HUP handler clean up
+    }
+
+    if (n < hdr_len + len) {
+        iox_out_queue(cl, hdr, hdr_len, data, len, n, blob);
+
+        if (!cl->watch_out)
+            cl->watch_out = qio_channel_add_watch_source(ioc, G_IO_OUT, client_writable,
+                                                         cl, NULL, cl->server->ctx);
+    }
+
+    return 0;
+}
+
+/*
+ * Send a frame to a single client. The payload is shared via @blob with any
+ * other client the frame is queued for, see iox_out_queue().
+ */
+static int iox_client_send(IoXferClient *cl, uint8_t seq, uint8_t cat, uint8_t id,
+                           uint32_t len, const uint8_t *data, struct iox_out_blob **blob)
+{
+    IoXferServer *srv = cl->server;
+    uint8_t hdr[IOX_FRAME_HDR_MAX_LEN];
+    unsigned hdr_len;
+
+    // the protocol version may have changed since the frame has been queued
+    if (len > iox_frame_max_payload(cl)) {
+        warn_report("iox: frame exceeds maximum payload length");
+        return -1;
+    }
+
+    // backpressure: do not grow the queue beyond its high-water mark
+    if (cl->out_bytes >= srv->out_limit) {
+        warn_report_once("iox: output queue full, dropping frames");
+        atomic_inc(&srv->out_dropped);
+        return 0;
+    }
+
+    hdr_len = iox_frame_hdr_encode(cl, hdr, seq, cat, id, len);
+
+    if (cl->shm.active)
+        return iox_shm_send(cl, hdr, hdr_len, data, len, blob);
+
+    return iox_socket_send(cl, hdr, hdr_len, data, len, blob);
+}
+
+static int iox_client_reply(IoXferClient *cl, uint8_t seq, uint8_t id, uint32_t len,
+                            const uint8_t *data)
+{
+    struct iox_out_blob *blob = NULL;
+    int status;
+
+    status = iox_client_send(cl, seq, IOX_CAT_TRANSPORT, id, len, data, &blob);
+    iox_out_blob_unref(blob);
+
+    return status;
+}
+
+static void iox_dispatch_frame(IoXferClient *cl, struct iox_data_frame *frame);
+static void iox_client_disconnect(IoXferClient *cl);
+
+static void iox_shm_receive(IoXferClient *cl)
+{
+    struct iox_shm_ring *ring = cl->shm.rx;
+    uint8_t hdr[IOX_FRAME_HDR_MAX_LEN];
+    uint32_t used, pos;
+
+    do {
+        atomic_set(&ring->consumer_waiting, 0);
+
+        used = iox_shm_ring_used(ring);
+        pos = 0;
+
+        // dispatch all available frames in place, release their space afterwards
+        while (used - pos >= iox_frame_hdr_len(cl)) {
+            unsigned hdr_len = iox_frame_hdr_len(cl);
+            struct iox_data_frame frame;
+
+            iox_shm_ring_peek(ring, pos, hdr, hdr_len);
+            iox_frame_hdr_decode(cl, hdr, &frame);
+
+            if (frame.len > iox_frame_max_payload(cl)) {
+                warn_report("iox: frame exceeds maximum payload length, disconnecting");
+                iox_client_disconnect(cl);
+                return;
+            }
+
+            if (used - pos < hdr_len + frame.len) {
+                warn_report("iox: incomplete frame in shared-memory ring");
+                break;
+            }
+
+            frame.payload = iox_shm_ring_ptr(ring, pos + hdr_len, frame.len, cl->shm.bounce);
+            pos += hdr_len + frame.len;
+
+            iox_dispatch_frame(cl, &frame);
+        }
+
+        if (pos) {
+            atomic_store_release(&ring->tail, ring->tail + pos);
+
+            // wake up the client if it is waiting for free space
+            smp_mb();
+            if (atomic_xchg(&ring->producer_waiting, 0))
+                event_notifier_set(&cl->shm.tx_doorbell);
+        }
+
+        // go to sleep, but re-check to not miss any data published meanwhile
+        atomic_set(&ring->consumer_waiting, 1);
+        smp_mb();
+    } while (iox_shm_ring_used(ring) > used - pos);
+}
+
+
+static void iox_trace_frame(IoXferServer *srv, bool out, struct iox_data_frame *frame)
+{
+    const char *name = "";
+
+    if (!iox_trace_enabled())
+        return;
+
+    if (srv->addr && srv->addr->type == SOCKET_ADDRESS_TYPE_UNIX)
+        name = srv->addr->u.q_unix.path;
+
+    iox_trace_record(srv->trace_id, name, out, frame);
+}
+
+void iox_server_inject(IoXferServer *srv, struct iox_data_frame *frame)
+{
+    iox_trace_frame(srv, false, frame);
+
+    if (srv->handler)
+        srv->handler(frame, srv->handler_opaque);
+}
+
+// record/replay: frame logged via iox_server_receive() is due
+static void iox_server_rr_frame(void *opaque, const uint8_t *buf, size_t size)
+{
+    IoXferServer *srv = opaque;
+    struct iox_data_frame frame;
+
+    frame.seq = buf[0];
+    frame.cat = buf[1];
+    frame.id  = buf[2];
+    frame.len = size - IOX_FRAME_HDR_V2_LEN;
+    frame.payload = (uint8_t *)buf + IOX_FRAME_HDR_V2_LEN;
+
+    iox_server_inject(srv, &frame);
+}
+
+/*
+ * Pass a frame received from a client to the device. With record/replay
+ * (-icount rr=...), delivery goes through the replay event queue, received
+ * frames are logged when recording and ignored when replaying.
+ */
+static void iox_server_receive(IoXferServer *srv, struct iox_data_frame *frame)
+{
+    g_autofree uint8_t *buf = NULL;
+
+    switch (replay_mode) {
+    case REPLAY_MODE_NONE:
+        iox_server_inject(srv, frame);
+        break;
+
+    case REPLAY_MODE_RECORD:
+        buf = g_malloc(IOX_FRAME_HDR_V2_LEN + frame->len);
+
+        buf[0] = frame->seq;
+        buf[1] = frame->cat;
+        buf[2] = frame->id;
+        buf[3] = 0;
+        stl_le_p(buf + 4, frame->len);
+        memcpy(buf + IOX_FRAME_HDR_V2_LEN, frame->payload, frame->len);
+
+        replay_iox_frame_event(srv->rr, buf, IOX_FRAME_HDR_V2_LEN + frame->len);
+        break;
+
+    case REPLAY_MODE_PLAY:
+        break;
+    }
+}
+
+static void iox_remove_watch(GSource **source)
+{
+    if (!*source)
+        return;
+
+    g_source_destroy(*source);
+    g_source_unref(*source);
+    *source = NULL;
+}
+
+static void iox_server_listen(IoXferServer *srv, bool accept)
+{
+    qio_net_listener_set_client_func_full(srv->listener, accept ? server_accept : NULL,
+                                          srv, NULL, srv->ctx);
+}
+
+static void iox_server_update_max_payload(IoXferServer *srv)
+{
+    uint32_t max = srv->nclients ? IOX_FRAME_MAX_PAYLOAD : 0xff;
+    IoXferClient *cl;
+
+    // frames are sent to all clients, thus they have to fit for everyone
+    QTAILQ_FOREACH(cl, &srv->clients, next) {
+        max = MIN(max, iox_frame_max_payload(cl));
+    }
+
+    atomic_set(&srv->max_payload, max);
+}
+
+static void iox_server_set_owner(IoXferServer *srv, IoXferClient *cl)
+{
+    IoXferClient *prev = srv->owner;
+
+    srv->owner = cl;
+    atomic_set(&srv->out_depth, cl ? cl->out_bytes : 0);
+
+    // the device may have been waiting for the queue of the previous owner
+    if (prev) {
+        atomic_set(&srv->io_wakeup, true);
+        iox_server_wakeup(srv);
+    }
+}
+
+static void iox_client_connect(IoXferServer *srv, QIOChannelSocket *sioc)
+{
+    IoXferClient *cl = g_new0(IoXferClient, 1);
+    QIOChannel *ioc = QIO_CHANNEL(sioc);
+
+    cl->server = srv;
+    cl->version = 1;
+    bitmap_fill(cl->subscribed, 256);
+
+    buffer_init(&cl->inbuf, "iox-in");
+    g_queue_init(&cl->outq);
+
+    cl->watch_in = qio_channel_add_watch_source(ioc, G_IO_IN, client_receive,
+                                                cl, NULL, srv->ctx);
+    cl->watch_hup = qio_channel_add_watch_source(ioc, G_IO_HUP, client_hup,
+                                                 cl, NULL, srv->ctx);
+
+    qio_channel_set_blocking(ioc, false, &error_abort);
+
+    object_ref(OBJECT(sioc));
+    cl->sioc = sioc;
+
+    QTAILQ_INSERT_TAIL(&srv->clients, cl, next);
+    atomic_set(&srv->nclients, srv->nclients + 1);
+    iox_server_update_max_payload(srv);
+
+    if (!srv->owner)
+        iox_server_set_owner(srv, cl);
+
+    // do not accept any new clients once we are full
+    if (srv->nclients >= IOX_MAX_CLIENTS)
+        iox_server_listen(srv, false);
+}
+
+static void iox_client_disconnect(IoXferClient *cl)
+{
+    IoXferServer *srv = cl->server;
+
+    iox_remove_watch(&cl->watch_in);
+    iox_remove_watch(&cl->watch_hup);
+    iox_remove_watch(&cl->watch_out);
+
+    iox_shm_free(cl);
+
+    QTAILQ_REMOVE(&srv->clients, cl, next);
+    atomic_set(&srv->nclients, srv->nclients - 1);
+
+    qio_channel_close(QIO_CHANNEL(cl->sioc), NULL);
+    object_unref(OBJECT(cl->sioc));
+
+    // anything still queued is lost
+    iox_out_clear(cl);
+    iox_out_stall_end(cl);
+
+    // hand over the device input to the oldest remaining client
+    if (srv->owner == cl)
+        iox_server_set_owner(srv, QTAILQ_FIRST(&srv->clients));
+
+    iox_server_update_max_payload(srv);
+
+    buffer_free(&cl->inbuf);
+    g_free(cl);
+
+    // we can now accept new clients again
+    if (srv->nclients == IOX_MAX_CLIENTS - 1)
+        iox_server_listen(srv, true);
+}
+
+
+static void iox_io_list_reverse(struct iox_queued_frame **first)
+{
+    struct iox_queued_frame *item = *first, *prev = NULL;
+
+    while (item) {
+        struct iox_queued_frame *next = item->next.sle_next;
+
+        item->next.sle_next = prev;
+        prev = item;
+        item = next;
+    }
+
+    *first = prev;
+}
+
+static struct iox_queued_frame *iox_io_frame_new(uint8_t seq, uint8_t cat, uint8_t id,
+                                                 uint32_t len, const uint8_t *data)
+{
+    struct iox_queued_frame *item = g_malloc(sizeof(struct iox_queued_frame) + len);
+
+    item->next.sle_next = NULL;
+    item->frame.seq = seq;
+    item->frame.cat = cat;
+    item->frame.id = id;
+    item->frame.len = len;
+    item->frame.payload = item->data;
+
+    if (len)
+        memcpy(item->data, data, len);
+
+    return item;
+}
+
+static void iox_io_list_free(struct iox_queued_frame *item)
+{
+    while (item) {
+        struct iox_queued_frame *next = item->next.sle_next;
+
+        g_free(item);
+        item = next;
+    }
+}
+
+static int iox_send_direct(IoXferServer *srv, uint8_t seq, uint8_t cat, uint8_t id,
+                           uint32_t len, const uint8_t *data);
+
+// main loop: dispatch frames received by the I/O thread
+static void iox_io_in_bh(void *opaque)
+{
+    IoXferServer *srv = opaque;
+    struct iox_queued_frame *item;
+
+    // items are pushed to the front, restore the order they were received in
+    item = atomic_xchg(&srv->io_in.slh_first, NULL);
+    iox_io_list_reverse(&item);
+
+    while (item) {
+        struct iox_queued_frame *next = item->next.sle_next;
+
+        iox_server_receive(srv, &item->frame);
+
+        g_free(item);
+        item = next;
+    }
+}
+
+// I/O thread: send frames queued by the device
+static void iox_io_out_bh(void *opaque)
+{
+    IoXferServer *srv = opaque;
+    struct iox_queued_frame *item;
+
+    item = atomic_xchg(&srv->io_out.slh_first, NULL);
+    iox_io_list_reverse(&item);
+
+    while (item) {
+        struct iox_queued_frame *next = item->next.sle_next;
+        struct iox_data_frame *frame = &item->frame;
+
+        iox_send_direct(srv, frame->seq, frame->cat, frame->id, frame->len, frame->payload);
+        atomic_sub(&srv->io_out_bytes, IOX_FRAME_HDR_MAX_LEN + frame->len);
+
+        g_free(item);
+        item = next;
+    }
+
+    if (srv->owner && !srv->owner->out_bytes)
+        iox_out_drained(srv->owner);
+}
+
+// main loop: notify device that the output queue has been drained
+static void iox_io_drain_bh(void *opaque)
+{
+    IoXferServer *srv = opaque;
+
+    if (srv->drain_handler)
+        srv->drain_handler(srv->handler_opaque);
+}
+
+static void iox_io_receive(IoXferServer *srv, struct iox_data_frame *frame)
+{
+    struct iox_queued_frame *item;
+
+    item = iox_io_frame_new(frame->seq, frame->cat, frame->id, frame->len, frame->payload);
+    QSLIST_INSERT_HEAD_ATOMIC(&srv->io_in, item, next);
+    qemu_bh_schedule(srv->io_in_bh);
+}
+
+static int iox_io_send(IoXferServer *srv, uint8_t seq, uint8_t cat, uint8_t id,
+                       uint32_t len, const uint8_t *data)
+{
+    size_t size = IOX_FRAME_HDR_MAX_LEN + len;
+    struct iox_queued_frame *item;
+
+    item = iox_io_frame_new(seq, cat, id, len, data);
+
+    // device is congested now, have the I/O thread wake it once drained
+    if (iox_out_depth(srv) + size >= srv->out_limit)
+        atomic_set(&srv->io_wakeup, true);
+
+    atomic_add(&srv->io_out_bytes, size);
+    QSLIST_INSERT_HEAD_ATOMIC(&srv->io_out, item, next);
+    qemu_bh_schedule(srv->io_out_bh);
+    return 0;
+}
+
+
+IoXferServer *iox_server_new(void)
+{
+    IoXferServer *srv = g_new0(IoXferServer, 1);
+
+    srv->listener = qio_net_listener_new();
+    if (!srv->listener) {
+        g_free(srv);
+        return NULL;
+    }
+
+    QTAILQ_INIT(&srv->clients);
+    srv->max_payload = 0xff;
+    srv->seq = 0;
+    srv->trace_id = iox_trace_next_id++;
+    srv->out_limit = iox_queue_limit;
+
+    if (replay_mode != REPLAY_MODE_NONE)
+        srv->rr = replay_register_iox(iox_server_rr_frame, srv);
+
+    if (!iox_exit_notifier.notify) {
+        iox_exit_notifier.notify = iox_servers_exit;
+        qemu_add_exit_notifier(&iox_exit_notifier);
+    }
+
+    QLIST_INSERT_HEAD(&iox_servers, srv, next);
+    return srv;
+}
+
+void iox_server_free(IoXferServer *srv)
+{
+    QLIST_REMOVE(srv, next);
+    iox_server_close(srv);
+
+    if (srv->replay)
+        iox_replay_detach(srv->replay);
+
+    if (srv->rr)
+        replay_unregister_iox(srv->rr);
+
+    if (srv->iothread) {
+        qemu_bh_delete(srv->io_in_bh);
+        qemu_bh_delete(srv->io_out_bh);
+        qemu_bh_delete(srv->io_drain_bh);
+
+        iox_io_list_free(srv->io_in.slh_first);
+        iox_io_list_free(srv->io_out.slh_first);
+
+        object_unref(OBJECT(srv->iothread));
+    }
+
+    qapi_free_SocketAddress(srv->addr);
+    g_free(srv->listener);
+    g_free(srv);
+}
+
+void iox_server_set_handler(IoXferServer *srv, iox_frame_handler *handler, void* opaque)
+{
+    srv->handler = handler;
+    srv->handler_opaque = opaque;
+}
 
+void iox_server_set_drain_handler(IoXferServer *srv, iox_drain_handler *handler)
+{
+    srv->drain_handler = handler;
+}
 
-static void server_accept(QIONetListener *listener, QIOChannelSocket *sioc, gpointer data);
-static gboolean client_receive(QIOChannel *ioc, GIOCondition cond, gpointer data);
-static gboolean client_hup(QIOChannel *ioc, GIOCondition cond, gpointer data);
+void iox_server_set_queue_limit(IoXferServer *srv, size_t limit)
+{
+    srv->out_limit = limit;
+}
 
+void iox_server_set_response_pending(IoXferServer *srv, bool pending)
+{
+    if (srv)
+        srv->response_pending = pending;
+}
 
-static void iox_client_connect(IoXferServer *srv, QIOChannelSocket *client)
+void iox_server_set_iothread(IoXferServer *srv, IOThread *iothread)
 {
-    QIOChannel *ioc = QIO_CHANNEL(client);
+    if (!iothread)
+        return;
 
-    // do not accept any new clients
-    qio_net_listener_set_client_func(srv->listener, NULL, NULL, NULL);
+    object_ref(OBJECT(iothread));
+    srv->iothread = iothread;
+    srv->ctx = iothread_get_g_main_context(iothread);
 
-    qio_channel_add_watch(ioc, G_IO_IN, client_receive, srv, NULL);
-    qio_channel_add_watch(ioc, G_IO_HUP, client_hup, srv, NULL);
+    srv->io_out_bh = aio_bh_new(iothread_get_aio_context(iothread), iox_io_out_bh, srv);
+    srv->io_in_bh = qemu_bh_new(iox_io_in_bh, srv);
+    srv->io_drain_bh = qemu_bh_new(iox_io_drain_bh, srv);
+}
 
-    qio_channel_set_blocking(ioc, false, &error_abort);
 
-    srv->client = client;
+/*
+ * Listen on a unix domain socket without taking over the socket of another,
+ * still running instance. The socket is bound under a temporary name and only
+ * then linked to its final path, which fails if that already exists. Sockets
+ * left behind by dead instances are detected and replaced. All of this is
+ * serialized via a lock on the socket directory.
+ */
+static int iox_server_listen_unix(IoXferServer *srv, const char *path, Error **errp)
+{
+    g_autofree char *dir = g_path_get_dirname(path);
+    g_autofree char *tmp = g_strdup_printf("%s.%d", path, getpid());
+    SocketAddress addr;
+    struct stat st;
+    int dirfd, fd;
+    int status = -1;
+
+    addr.type = SOCKET_ADDRESS_TYPE_UNIX;
+    addr.u.q_unix.path = tmp;
+
+    dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (dirfd < 0) {
+        error_setg_errno(errp, errno, "iox: cannot open socket directory %s", dir);
+        return -1;
+    }
+
+    if (flock(dirfd, LOCK_EX)) {
+        error_setg_errno(errp, errno, "iox: cannot lock socket directory %s", dir);
+        goto out;
+    }
+
+    if (qio_net_listener_open_sync(srv->listener, &addr, IOX_MAX_CLIENTS, errp))
+        goto out;
+
+    if (link(tmp, path)) {
+        if (errno != EEXIST) {
+            error_setg_errno(errp, errno, "iox: cannot create socket %s", path);
+            goto out_close;
+        }
+
+        // someone is still listening on it, do not steal their socket
+        fd = unix_connect(path, NULL);
+        if (fd >= 0) {
+            close(fd);
+            error_setg(errp, "iox: socket %s is already in use", path);
+            goto out_close;
+        }
+
+        // stale socket of a dead instance
+        if (unlink(path) || link(tmp, path)) {
+            error_setg_errno(errp, errno, "iox: cannot create socket %s", path);
+            goto out_close;
+        }
+    }
+
+    // the listener only knows the temporary name, remember the final one
+    if (stat(path, &st)) {
+        error_setg_errno(errp, errno, "iox: cannot create socket %s", path);
+        unlink(path);
+        goto out_close;
+    }
+
+    srv->unix_path = g_strdup(path);
+    srv->unix_dev = st.st_dev;
+    srv->unix_ino = st.st_ino;
+
+    status = 0;
+    goto out_unlink;
+
+out_close:
+    qio_net_listener_disconnect(srv->listener);
+out_unlink:
+    unlink(tmp);
+out:
+    close(dirfd);
+    return status;
+}
+
+int iox_server_open(IoXferServer *srv, SocketAddress *addr, Error **errp)
+{
+    int status;
+
+    qapi_free_SocketAddress(srv->addr);
+    srv->addr = QAPI_CLONE(SocketAddress, addr);
+
+    // replay the recorded traffic of the socket instead of listening on it
+    if (iox_replay_path() && addr->type == SOCKET_ADDRESS_TYPE_UNIX) {
+        g_autofree char *name = g_path_get_basename(addr->u.q_unix.path);
+
+        srv->replay = iox_replay_attach(srv, name);
+        atomic_set(&srv->max_payload, iox_replay_max_payload(srv->replay));
+        return 0;
+    }
+
+    if (addr->type == SOCKET_ADDRESS_TYPE_UNIX)
+        status = iox_server_listen_unix(srv, addr->u.q_unix.path, errp);
+    else
+        status = qio_net_listener_open_sync(srv->listener, addr, IOX_MAX_CLIENTS, errp);
+
+    if (status)
+        return -1;
+
+    // watches are bound to the context of the server, register them last
+    iox_server_listen(srv, true);
+    return 0;
+}
+
+static void iox_server_do_close(void *opaque)
+{
+    IoXferServer *srv = opaque;
+    IoXferClient *cl;
+
+    while ((cl = QTAILQ_FIRST(&srv->clients)))
+        iox_client_disconnect(cl);
+
+    if (qio_net_listener_is_connected(srv->listener))
+        qio_net_listener_disconnect(srv->listener);
 }
 
-static void iox_client_disconnect(IoXferServer *srv)
+static void iox_server_unlink(IoXferServer *srv)
 {
-    if (!srv->client)
+    struct stat st;
+
+    if (!srv->unix_path)
         return;
 
-    qio_channel_close(QIO_CHANNEL(srv->client), NULL);
-    srv->client = NULL;
+    // another instance may have replaced a socket it considered stale
+    if (!stat(srv->unix_path, &st) && st.st_dev == srv->unix_dev && st.st_ino == srv->unix_ino)
+        unlink(srv->unix_path);
 
-    // we can now accept new clients again
-    qio_net_listener_set_client_func(srv->listener, server_accept, srv, NULL);
+    g_free(srv->unix_path);
+    srv->unix_path = NULL;
 }
 
+void iox_server_close(IoXferServer *srv)
+{
+    AioContext *ctx;
 
-IoXferServer *iox_server_new(void)
+    if (!srv->iothread) {
+        iox_server_do_close(srv);
+        iox_server_unlink(srv);
+        return;
+    }
+
+    // the I/O thread owns connections and listener, let it clean up
+    ctx = iothread_get_aio_context(srv->iothread);
+
+    aio_context_acquire(ctx);
+    aio_wait_bh_oneshot(ctx, iox_server_do_close, srv);
+    aio_context_release(ctx);
+
+    iox_server_unlink(srv);
+}
+
+// devices are not unrealized on exit, remove our sockets nevertheless
+static void iox_servers_exit(Notifier *n, void *data)
 {
-    IoXferServer *srv = g_new0(IoXferServer, 1);
+    IoXferServer *srv;
 
-    srv->listener = qio_net_listener_new();
-    if (!srv->listener) {
-        g_free(srv);
-        return NULL;
+    QLIST_FOREACH(srv, &iox_servers, next)
+        iox_server_unlink(srv);
+}
+
+bool iox_input_pending(void)
+{
+    IoXferServer *srv;
+    IoXferClient *cl;
+
+    QLIST_FOREACH(srv, &iox_servers, next) {
+        if (atomic_read(&srv->io_in.slh_first))
+            return true;
+
+        // clients are owned by the I/O thread, if there is one
+        if (srv->iothread)
+            continue;
+
+        QTAILQ_FOREACH(cl, &srv->clients, next) {
+            if (cl->inbuf.offset)
+                return true;
+
+            if (cl->shm.active && iox_shm_ring_used(cl->shm.rx))
+                return true;
+        }
     }
 
-    srv->buffer_used = 0;
-    srv->seq = 0;
-    return srv;
+    return false;
 }
 
-void iox_server_free(IoXferServer *srv)
+bool iox_output_pending(void)
 {
-    iox_server_close(srv);
-    g_free(srv->listener);
-    g_free(srv);
+    IoXferServer *srv;
+    IoXferClient *cl;
+
+    QLIST_FOREACH(srv, &iox_servers, next) {
+        if (iox_out_depth(srv))
+            return true;
+
+        // clients are owned by the I/O thread, if there is one
+        if (srv->iothread)
+            continue;
+
+        QTAILQ_FOREACH(cl, &srv->clients, next) {
+            if (cl->out_bytes)
+                return true;
+        }
+    }
+
+    return false;
 }
 
-void iox_server_set_handler(IoXferServer *srv, iox_frame_handler *handler, void* opaque)
+bool iox_response_pending(void)
 {
-    srv->handler = handler;
-    srv->handler_opaque = opaque;
+    IoXferServer *srv;
+
+    QLIST_FOREACH(srv, &iox_servers, next) {
+        if (srv->response_pending && atomic_read(&srv->nclients))
+            return true;
+    }
+
+    return false;
 }
 
+bool iox_server_congested(IoXferServer *srv)
+{
+    // frames are dropped instead, flow control would depend on the clients
+    if (replay_mode != REPLAY_MODE_NONE)
+        return false;
 
-int iox_server_open(IoXferServer *srv, SocketAddress *addr, Error **errp)
+    return srv && atomic_read(&srv->nclients) && iox_out_depth(srv) >= srv->out_limit;
+}
+
+size_t iox_get_queue_limit(void)
 {
-    qio_net_listener_set_client_func(srv->listener, server_accept, srv, NULL);
-    return qio_net_listener_open_sync(srv->listener, addr, 1, errp);
+    return iox_queue_limit;
 }
 
-void iox_server_close(IoXferServer *srv)
+void iox_set_queue_limit(size_t limit)
 {
-    iox_client_disconnect(srv);
+    IoXferServer *srv;
 
-    if (qio_net_listener_is_connected(srv->listener))
-        qio_net_listener_disconnect(srv->listener);
+    iox_queue_limit = limit;
+
+    QLIST_FOREACH(srv, &iox_servers, next) {
+        iox_server_set_queue_limit(srv, limit);
+    }
 }
 
+void iox_visit_stats(Visitor *v, const char *name, Error **errp)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    Error *err = NULL;
+    IoXferServer *srv;
 
-int iox_send_frame(IoXferServer *srv, struct iox_data_frame *frame)
+    visit_start_list(v, name, NULL, 0, &err);
+    if (err)
+        goto out;
+
+    QLIST_FOREACH(srv, &iox_servers, next) {
+        const char *path = "";
+        uint32_t clients = atomic_read(&srv->nclients);
+        uint64_t depth = iox_out_depth(srv);
+        uint64_t limit = srv->out_limit;
+        uint64_t dropped = atomic_read(&srv->out_dropped);
+        int64_t stall = atomic_read(&srv->out_stall_ns);
+        IoXferClient *cl;
+
+        // include ongoing stalls, unless the clients are owned by an I/O thread
+        if (!srv->iothread) {
+            QTAILQ_FOREACH(cl, &srv->clients, next) {
+                if (cl->out_stalled)
+                    stall += now - cl->out_stall_start;
+            }
+        }
+
+        if (srv->addr && srv->addr->type == SOCKET_ADDRESS_TYPE_UNIX)
+            path = srv->addr->u.q_unix.path;
+
+        visit_start_struct(v, NULL, NULL, 0, &err);
+        if (err)
+            goto out_list;
+
+        visit_type_str(v, "socket", (char **)&path, &err);
+        if (!err)
+            visit_type_uint32(v, "clients", &clients, &err);
+        if (!err)
+            visit_type_uint64(v, "queue-depth", &depth, &err);
+        if (!err)
+            visit_type_uint64(v, "queue-limit", &limit, &err);
+        if (!err)
+            visit_type_int64(v, "stall-ns", &stall, &err);
+        if (!err)
+            visit_type_uint64(v, "dropped", &dropped, &err);
+        if (!err)
+            visit_check_struct(v, &err);
+
+        visit_end_struct(v, NULL);
+        if (err)
+            goto out_list;
+    }
+
+    visit_check_list(v, &err);
+out_list:
+    visit_end_list(v, NULL);
+out:
+    error_propagate(errp, err);
+}
+
+bool iox_servers_use_iothread(void)
 {
-    if (!srv || !srv->client)
-        return 0;
+    IoXferServer *srv;
+
+    QLIST_FOREACH(srv, &iox_servers, next) {
+        if (srv->iothread)
+            return true;
+    }
 
-    int len = sizeof(struct iox_data_frame) + frame->len;
-    return qio_channel_write_all(QIO_CHANNEL(srv->client), (char *)frame, len, NULL);
+    return false;
 }
 
-int iox_send_data(IoXferServer *srv, uint8_t seq, uint8_t cat, uint8_t id, uint8_t len, uint8_t *data)
+int iox_servers_fork_child(const char *dir, Error **errp)
+{
+    IoXferServer *srv;
+
+    QLIST_FOREACH(srv, &iox_servers, next) {
+        SocketAddress addr;
+        g_autofree char *name = NULL;
+        g_autofree char *path = NULL;
+
+        if (!qio_net_listener_is_connected(srv->listener))
+            continue;
+
+        if (srv->addr->type != SOCKET_ADDRESS_TYPE_UNIX) {
+            error_setg(errp, "iox: cannot re-open non-unix socket in child");
+            return -1;
+        }
+
+        // The listening sockets are shared with the parent: close only our
+        // fds, without the cleanup of a listener, which would unlink the
+        // socket path of the parent.
+        for (size_t i = 0; i < srv->listener->nsioc; i++) {
+            QIOChannel *ioc = QIO_CHANNEL(srv->listener->sioc[i]);
+
+            ioc->features &= ~(1 << QIO_CHANNEL_FEATURE_LISTEN);
+        }
+
+        // same for the final path, it belongs to the parent
+        g_free(srv->unix_path);
+        srv->unix_path = NULL;
+
+        iox_server_close(srv);
+
+        // the old listener still references its closed sockets, start anew
+        object_unref(OBJECT(srv->listener));
+        srv->listener = qio_net_listener_new();
+
+        name = g_path_get_basename(srv->addr->u.q_unix.path);
+        path = g_build_filename(dir, name, NULL);
+
+        addr.type = SOCKET_ADDRESS_TYPE_UNIX;
+        addr.u.q_unix.path = path;
+
+        if (iox_server_open(srv, &addr, errp))
+            return -1;
+
+        info_report("iox: listening on %s", path);
+    }
+
+    return 0;
+}
+
+
+/*
+ * Send a frame to all subscribed clients, from the context of the server,
+ * i.e. the I/O thread if there is one, the main loop otherwise.
+ */
+static int iox_send_direct(IoXferServer *srv, uint8_t seq, uint8_t cat, uint8_t id,
+                           uint32_t len, const uint8_t *data)
 {
-    uint8_t *buf = g_new0(uint8_t, sizeof(struct iox_data_frame) + len);
-    struct iox_data_frame *frame = (struct iox_data_frame *)buf;
+    struct iox_out_blob *blob = NULL;
+    IoXferClient *cl;
+    int status = 0;
 
-    frame->seq = seq;
-    frame->cat = cat;
-    frame->id = id;
-    frame->len = len;
-    memcpy(frame->payload, data, len);
+    QTAILQ_FOREACH(cl, &srv->clients, next) {
+        if (!test_bit(cat, cl->subscribed))
+            continue;
+
+        if (iox_client_send(cl, seq, cat, id, len, data, &blob))
+            status = -1;
+    }
 
-    int status = iox_send_frame(srv, frame);
-    g_free(buf);
+    // clients that had to queue the frame hold their own reference
+    iox_out_blob_unref(blob);
     return status;
 }
 
+bool iox_server_active(IoXferServer *srv)
+{
+    return srv && (srv->replay || atomic_read(&srv->nclients));
+}
+
+static int iox_send_raw(IoXferServer *srv, uint8_t seq, uint8_t cat, uint8_t id,
+                        uint32_t len, const uint8_t *data)
+{
+    struct iox_data_frame frame = {
+        .seq = seq, .cat = cat, .id = id, .len = len, .payload = (uint8_t *)data,
+    };
+
+    if (!iox_server_active(srv))
+        return 0;
+
+    if (len > atomic_read(&srv->max_payload)) {
+        warn_report("iox: frame exceeds maximum payload length");
+        return -1;
+    }
+
+    // backpressure: do not grow the queue beyond its high-water mark
+    if (iox_out_depth(srv) >= srv->out_limit) {
+        warn_report_once("iox: output queue full, dropping frames");
+        atomic_set(&srv->io_wakeup, true);
+        atomic_inc(&srv->out_dropped);
+        return 0;
+    }
+
+    iox_trace_frame(srv, true, &frame);
+
+    if (srv->replay) {
+        iox_replay_output(srv->replay, &frame);
+        return 0;
+    }
+
+    if (srv->iothread)
+        return iox_io_send(srv, seq, cat, id, len, data);
+
+    return iox_send_direct(srv, seq, cat, id, len, data);
+}
+
+int iox_send_frame(IoXferServer *srv, struct iox_data_frame *frame)
+{
+    return iox_send_raw(srv, frame->seq, frame->cat, frame->id, frame->len, frame->payload);
+}
+
+int iox_send_data(IoXferServer *srv, uint8_t seq, uint8_t cat, uint8_t id, uint8_t len, uint8_t *data)
+{
+    return iox_send_raw(srv, seq, cat, id, len, data);
+}
+
 int iox_send_data_multiframe(IoXferServer *srv, uint8_t seq, uint8_t cat, uint8_t id, unsigned len, uint8_t *data)
 {
+    uint32_t max;
     int status;
 
-    while (len > 0xff) {
-        status = iox_send_data(srv, seq, cat, id, 0xff, data);
+    if (!iox_server_active(srv))
+        return 0;
+
+    // single frame for everything up to the maximum payload of all clients
+    max = atomic_read(&srv->max_payload);
+
+    while (len > max) {
+        status = iox_send_raw(srv, seq, cat, id, max, data);
         if (status)
             return status;
 
-        len -= 0xff;
-        data += 0xff;
+        len -= max;
+        data += max;
     }
 
-    return iox_send_data(srv, seq, cat, id, len, data);
+    return iox_send_raw(srv, seq, cat, id, len, data);
 }
 
 int iox_send_command(IoXferServer *srv, uint8_t seq, uint8_t cat, uint8_t id)
 {
-    struct iox_data_frame frame = {
-        .seq = seq,
-        .cat = cat,
-        .id  = id,
-        .len = 0,
-    };
-
-    return iox_send_frame(srv, &frame);
+    return iox_send_raw(srv, seq, cat, id, 0, NULL);
 }
 
 int iox_send_u32(IoXferServer *srv, uint8_t seq, uint8_t cat, uint8_t id, uint32_t value)
 {
-    uint8_t buf[sizeof(struct iox_data_frame) + sizeof(uint32_t)];
-    struct iox_data_frame *frame = (struct iox_data_frame *)buf;
+    uint8_t buf[sizeof(uint32_t)];
+
+    memcpy(buf, &value, sizeof(uint32_t));
+    return iox_send_raw(srv, seq, cat, id, sizeof(uint32_t), buf);
+}
+
+
+static void iox_negotiate_version(IoXferClient *cl, struct iox_data_frame *frame)
+{
+    uint8_t version = frame->len >= 1 ? frame->payload[0] : 1;
+    uint8_t buf[1 + 2 * sizeof(uint32_t)];
+
+    version = MAX(1, MIN(version, IOX_PROTOCOL_VERSION));
+
+    buf[0] = version;
+    stl_le_p(buf + 1, cl->server->iothread ? 0 : IOX_CAP_SHM);
+    stl_le_p(buf + 5, version >= 2 ? IOX_FRAME_MAX_PAYLOAD : 0xff);
+
+    // answer in the current format, the new one applies to all following frames
+    iox_client_reply(cl, IOX_SEQ_DIRECTION_SET_OUT(frame->seq), IOX_CID_TRANSPORT_VERSION,
+                     sizeof(buf), buf);
+
+    cl->version = version;
+    iox_server_update_max_payload(cl->server);
+}
+
+static void iox_subscribe(IoXferClient *cl, struct iox_data_frame *frame, bool subscribe)
+{
+    uint32_t i;
+
+    // no categories given means all categories
+    if (!frame->len) {
+        if (subscribe)
+            bitmap_fill(cl->subscribed, 256);
+        else
+            bitmap_zero(cl->subscribed, 256);
+        return;
+    }
+
+    for (i = 0; i < frame->len; i++) {
+        if (subscribe)
+            set_bit(frame->payload[i], cl->subscribed);
+        else
+            clear_bit(frame->payload[i], cl->subscribed);
+    }
+}
+
+static void iox_dispatch_frame(IoXferClient *cl, struct iox_data_frame *frame)
+{
+    IoXferServer *srv = cl->server;
+    uint8_t seq = IOX_SEQ_DIRECTION_SET_OUT(frame->seq);
+
+    if (frame->cat != IOX_CAT_TRANSPORT) {
+        // only the input owner gets to talk to the device
+        if (cl != srv->owner) {
+            warn_report_once("iox: dropping input of client not owning the device input");
+            return;
+        }
+
+        if (srv->iothread)
+            iox_io_receive(srv, frame);
+        else
+            iox_server_receive(srv, frame);
+        return;
+    }
 
-    frame->seq = seq;
-    frame->cat = cat;
-    frame->id  = id;
-    frame->len = sizeof(uint32_t);
-    *((uint32_t *)frame->payload) = value;
+    switch (frame->id) {
+    case IOX_CID_TRANSPORT_SHM_REQUEST:
+        iox_shm_setup(cl, seq);
+        break;
 
-    return iox_send_frame(srv, frame);
+    case IOX_CID_TRANSPORT_VERSION:
+        iox_negotiate_version(cl, frame);
+        break;
+
+    case IOX_CID_TRANSPORT_SUBSCRIBE:
+        iox_subscribe(cl, frame, true);
+        break;
+
+    case IOX_CID_TRANSPORT_UNSUBSCRIBE:
+        iox_subscribe(cl, frame, false);
+        break;
+
+    case IOX_CID_TRANSPORT_CLAIM_INPUT:
+        if (srv->owner != cl)
+            iox_server_set_owner(srv, cl);
+
+        iox_client_reply(cl, seq, IOX_CID_TRANSPORT_CLAIM_INPUT, 0, NULL);
+        break;
+
+    default:
+        warn_report("iox: unsupported transport command: 0x%02x", frame->id);
+        break;
+    }
 }
 
 
@@ -163,67 +1599,166 @@ static void server_accept(QIONetListener *listener, QIOChannelSocket *sioc, gpoi
 {
     IoXferServer *srv = data;
 
-    if (srv->client) {
+    if (srv->nclients >= IOX_MAX_CLIENTS) {
         qio_channel_close(QIO_CHANNEL(sioc), NULL);
-        warn_report("iox: server already has a client");
+        warn_report("iox: server already has the maximum number of clients");
         return;
     }
 
     iox_client_connect(srv, sioc);
 }
 
+/*
+ * Dispatch all complete frames in the receive buffer. Returns true if the
+ * client has been disconnected in the process.
+ */
+static bool iox_parse_input(IoXferClient *cl)
+{
+    Buffer *buf = &cl->inbuf;
+    size_t pos = 0;
+
+    while (buf->offset - pos >= iox_frame_hdr_len(cl)) {
+        unsigned hdr_len = iox_frame_hdr_len(cl);
+        struct iox_data_frame frame;
+
+        iox_frame_hdr_decode(cl, buf->buffer + pos, &frame);
+
+        if (frame.len > iox_frame_max_payload(cl)) {
+            warn_report("iox: frame exceeds maximum payload length, disconnecting");
+            iox_client_disconnect(cl);
+            return true;
+        }
+
+        // payload may arrive in multiple parts, wait for the rest
+        if (buf->offset - pos < hdr_len + frame.len)
+            break;
+
+        frame.payload = buf->buffer + pos + hdr_len;
+        pos += hdr_len + frame.len;
+
+        iox_dispatch_frame(cl, &frame);
+    }
+
+    // only the start of an incomplete frame remains, if anything
+    buffer_advance(buf, pos);
+    return false;
+}
+
 static gboolean client_receive(QIOChannel *ioc, GIOCondition cond, gpointer data)
 {
-    IoXferServer *srv = data;
+    IoXferClient *cl = data;
 
     while (true) {      // loop until all received data has been handled
-        if (srv->buffer_used < sizeof(struct iox_data_frame)) {
-            unsigned remaining = sizeof(struct iox_data_frame) - srv->buffer_used;
-            char *buf = (char *)srv->buffer;
+        Buffer *buf = &cl->inbuf;
+        size_t avail;
+        ssize_t nread;
 
-            ssize_t nread = qio_channel_read(ioc, buf, remaining, NULL);
-            if (nread == QIO_CHANNEL_ERR_BLOCK || nread == 0)
-                return G_SOURCE_CONTINUE;       // no more data to process
-            if (nread < 0)
-                return G_SOURCE_REMOVE;
+        // read as much as is available with a single call, frames always fit
+        buffer_reserve(buf, IOX_INPUT_CHUNK);
+        avail = buf->capacity - buf->offset;
 
-            srv->buffer_used += sizeof(struct iox_data_frame);
+        nread = qio_channel_read(ioc, (char *)buffer_end(buf), avail, NULL);
+        if (nread == QIO_CHANNEL_ERR_BLOCK || nread == 0)
+            return G_SOURCE_CONTINUE;           // no more data to process
+        if (nread < 0) {
+            iox_client_disconnect(cl);
+            return G_SOURCE_REMOVE;
         }
 
-        if (srv->buffer_used >= sizeof(struct iox_data_frame)) {
-            unsigned len = sizeof(struct iox_data_frame) + ((struct iox_data_frame *)srv->buffer)->len;
+        buf->offset += nread;
 
-            if (srv->buffer_used < len) {
-                unsigned remaining = len - srv->buffer_used;
-                char *buf = (char *)(srv->buffer + srv->buffer_used);
+        if (iox_parse_input(cl))
+            return G_SOURCE_REMOVE;
 
-                ssize_t nread = qio_channel_read(ioc, buf, remaining, NULL);
-                if (nread == QIO_CHANNEL_ERR_BLOCK || nread == 0)
-                    return G_SOURCE_CONTINUE;   // no more data to process
-                if (nread < 0)
-                    return G_SOURCE_REMOVE;
+        // a short read means there is nothing left for now
+        if (nread < avail)
+            return G_SOURCE_CONTINUE;
+    }
+}
 
-                srv->buffer_used += nread;
-            }
+static gboolean client_hup(QIOChannel *ioc, GIOCondition cond, gpointer data)
+{
+    IoXferClient *cl = data;
+
+    iox_client_disconnect(cl);
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean client_writable(QIOChannel *ioc, GIOCondition cond, gpointer data)
+{
+    IoXferClient *cl = data;
+
+    while (!g_queue_is_empty(&cl->outq)) {
+        struct iovec iov[IOX_OUTPUT_IOV_MAX];
+        unsigned niov = 0;
+        GList *it;
+        ssize_t n;
 
-            if (srv->buffer_used == len) {
-                struct iox_data_frame *frame = (struct iox_data_frame *)srv->buffer;
+        // gather as many queued frames as possible into a single write
+        for (it = cl->outq.head; it && niov + 2 <= ARRAY_SIZE(iov); it = it->next) {
+            struct iox_out_entry *e = it->data;
+            size_t skip = e->sent;
 
-                if (srv->handler)
-                    srv->handler(frame, srv->handler_opaque);
+            if (skip < e->hdr_len) {
+                iov[niov].iov_base = e->hdr + skip;
+                iov[niov].iov_len = e->hdr_len - skip;
+                niov++;
+                skip = 0;
+            } else {
+                skip -= e->hdr_len;
+            }
 
-                srv->buffer_used = 0;
+            if (e->len) {
+                iov[niov].iov_base = e->blob->data + skip;
+                iov[niov].iov_len = e->len - skip;
+                niov++;
             }
         }
+
+        n = qio_channel_writev(ioc, iov, niov, NULL);
+        if (n == QIO_CHANNEL_ERR_BLOCK)
+            return G_SOURCE_CONTINUE;   // wait until the client takes more
+        if (n < 0) {
+            iox_client_disconnect(cl);
+            return G_SOURCE_REMOVE;
+        }
+
+        iox_out_consume(cl, n);
     }
 
-    return G_SOURCE_CONTINUE;
+    iox_remove_watch(&cl->watch_out);
+    iox_out_drained(cl);
+    return G_SOURCE_REMOVE;
 }
 
-static gboolean client_hup(QIOChannel *ioc, GIOCondition cond, gpointer data)
+
+static int iox_buffer_get(QEMUFile *f, void *pv, size_t size, const VMStateField *field)
 {
-    IoXferServer *srv = data;
+    Buffer *buf = pv;
+    uint32_t len = qemu_get_be32(f);
 
-    iox_client_disconnect(srv);
-    return G_SOURCE_REMOVE;
+    buffer_reset(buf);
+    buffer_reserve(buf, len);
+
+    if (qemu_get_buffer(f, buffer_end(buf), len) != len)
+        return -EINVAL;
+
+    buf->offset += len;
+    return 0;
+}
+
+static int iox_buffer_put(QEMUFile *f, void *pv, size_t size, const VMStateField *field,
+                          QJSON *vmdesc)
+{
+    Buffer *buf = pv;
+
+    qemu_put_be32(f, buf->offset);
+    qemu_put_buffer(f, buf->buffer, buf->offset);
+    return 0;
 }
+
+const VMStateInfo vmstate_info_iox_buffer = {
+    .name = "iox_buffer",
+    .get = iox_buffer_get,
+    .put = iox_buffer_put,
+};
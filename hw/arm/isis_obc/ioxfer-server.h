@@ -8,7 +8,7 @@
  * category, ID, payload values and socket address depend on the device
  * implementing this server. Currently only supports unix domain sockets but
  * extension to/replacement with TCP is possible. The IOX server can entertain
- * multiple clients.
+ * multiple clients (see below).
  *
  * The goal of this framework is a easy-to-setup easy-to-use server
  * facilitating communication with external processes via a common interface.
@@ -31,6 +31,108 @@
  * via the same sequence number) to allow larger payloads by concatenating
  * them (though this is currently not implemented in any such device).
  *
+ * Protocol versions:
+ * The format above is protocol version 1, used by default. A client may
+ * request a newer version by sending a frame with category IOX_CAT_TRANSPORT
+ * and ID IOX_CID_TRANSPORT_VERSION, containing the highest version it
+ * supports as single payload byte. The server answers with the same category
+ * and ID, payload (all little-endian):
+ * - selected version (8-bit),
+ * - capabilities (32-bit, see IOX_CAP_*),
+ * - maximum payload length (32-bit).
+ * The answer still uses the old format, all following frames in both
+ * directions use the selected version. The client must not send any further
+ * frames before having received the answer. Version 2 extends the header to
+ * eight bytes: sequence ID, category, ID, one reserved byte (zero), and the
+ * payload length as 32-bit little-endian value. This allows transfers of up
+ * to IOX_FRAME_MAX_PAYLOAD bytes in a single frame, larger transfers are
+ * still split into multiple frames.
+ *
+ * Shared-memory transport:
+ * Instead of exchanging frames via the socket, a client may request a pair
+ * of shared-memory ring buffers by sending a frame with category
+ * IOX_CAT_TRANSPORT and ID IOX_CID_TRANSPORT_SHM_REQUEST after connecting.
+ * The server answers with IOX_CID_TRANSPORT_SHM_ACCEPT (payload: ring size
+ * in bytes as 32-bit little-endian value), passing three file descriptors
+ * via SCM_RIGHTS, in order:
+ * - a memfd containing two struct iox_shm_ring, each followed by its data
+ *   area: first the server-to-client ring, then the client-to-server ring,
+ * - the doorbell (eventfd) signaled by the server, to be read by the client,
+ * - the doorbell (eventfd) signaled by the client, to be read by the server.
+ * If shared memory is not available, the server answers with
+ * IOX_CID_TRANSPORT_SHM_REJECT and the socket is used as before. Frames in
+ * the rings use the negotiated protocol version. Frames of
+ * category IOX_CAT_TRANSPORT are handled by the server and never passed on
+ * to the device.
+ *
+ * Each ring is a single-producer single-consumer byte queue with free-running
+ * 32-bit head (producer) and tail (consumer) positions, containing complete
+ * frames (header and payload) which may wrap around the end of the data area.
+ * To avoid a system call per frame, doorbells are only signaled on request:
+ * - A consumer about to sleep sets consumer_waiting and re-checks head
+ *   afterwards. A producer, after publishing a new head, clears
+ *   consumer_waiting and signals the doorbell if it was set.
+ * - A producer finding the ring full sets producer_waiting and re-checks
+ *   tail afterwards. A consumer, after publishing a new tail, clears
+ *   producer_waiting and signals the doorbell if it was set.
+ * Each side only ever signals the doorbell of its peer, i.e. the client
+ * sleeps on the server doorbell both for new data and free space, and vice
+ * versa. Head/tail updates require release semantics, flag accesses a full
+ * memory barrier.
+ *
+ * Multiple clients:
+ * Up to IOX_MAX_CLIENTS clients can be connected to a server at the same
+ * time. Frames sent by the device are delivered to all clients subscribed to
+ * the category of the frame. New clients are subscribed to all categories. A
+ * client can change its subscriptions via IOX_CID_TRANSPORT_SUBSCRIBE and
+ * IOX_CID_TRANSPORT_UNSUBSCRIBE, with the payload being the list of
+ * categories (one byte each) to add or remove. An empty payload adds or
+ * removes all categories. Frames received by the server are only passed on
+ * to the device if they originate from the input owner; input of any other
+ * client is dropped. The oldest client owns the input by default, a client
+ * can take over ownership via IOX_CID_TRANSPORT_CLAIM_INPUT (answered with
+ * the same category and ID, without payload). Transport commands are handled
+ * per client, the answers are only sent to the requesting client.
+ *
+ * Output queue:
+ * Frames are never sent by blocking on a client. Whatever cannot be written
+ * immediately (socket buffer or shared-memory ring full) is appended to the
+ * output queue of the client, which is flushed once the client is able to
+ * take more data. The payload of a frame is copied at most once, no matter
+ * how many clients queue it. Each queue is bounded by a high-water mark
+ * (queue limit), frames for a client at or above this mark are dropped (and
+ * counted). The server is considered congested while the queue of the input
+ * owner is at or above this mark. Devices able to signal flow control to the
+ * guest should check iox_server_congested() before sending and register a
+ * drain handler, which is called once the queue of the input owner has been
+ * emptied.
+ *
+ * I/O threads:
+ * By default, all socket I/O is done in the main loop. Alternatively, a
+ * server can be bound to an IOThread (see iox_server_set_iothread()), which
+ * then does all socket I/O, framing, and transport negotiation on its own,
+ * without taking the BQL. Received frames are handed over to the main loop
+ * via a lock-free list and dispatched to the device from a bottom half.
+ * Frames sent by the device are copied to a lock-free list in the same way
+ * and written by the I/O thread. Frame and drain handlers are thus always
+ * called from the main loop with the BQL held. The shared-memory transport
+ * is not available for servers bound to an I/O thread.
+ *
+ * Socket creation:
+ * Unix domain sockets are never taken over from another running instance.
+ * Opening a server fails if some other process is still listening on the
+ * same path. Sockets left behind by terminated instances are replaced.
+ *
+ * Record/replay:
+ * With QEMU record/replay (-icount ...,rr=record|replay), frames received
+ * from clients are passed to the device via the replay event queue. When
+ * recording, they are logged to the replay file and delivered at the next
+ * checkpoint. When replaying, they are taken from the replay file and any
+ * input from connected clients is ignored. Output is still sent to clients
+ * in both modes. Drain handlers and queue congestion depend on the speed of
+ * the clients and are thus disabled, output exceeding the queue limit is
+ * dropped instead.
+ *
  * Copyright (c) 2019-2020 KSat e.V. Stuttgart
  *
  * This work is licensed under the terms of the GNU GPL, version 2 or, at your
@@ -41,9 +143,15 @@
 #define HW_ARM_ISIS_OBC_IOXFER_SERVER_H
 
 #include "qemu/osdep.h"
+#include "qemu/bitops.h"
 #include "qemu/buffer.h"
+#include "qemu/queue.h"
+#include "qemu/event_notifier.h"
 #include "io/channel-socket.h"
 #include "io/net-listener.h"
+#include "migration/vmstate.h"
+#include "sysemu/iothread.h"
+#include "sysemu/replay.h"
 
 #define IOX_SEQ_DIRECTION_SET_IN(x)     ((x) & ~BIT(7))
 #define IOX_SEQ_DIRECTION_SET_OUT(x)    ((x) | BIT(7))
@@ -52,41 +160,246 @@
  * The data frame transmitted and expected by the IOX server.
  *
  * Command cateogry, ID, and payload depend on the endpoint/device
- * implementing this server.
+ * implementing this server. Note that this is the in-memory representation,
+ * the header format on the wire depends on the protocol version (see above).
+ * For received frames, the payload points directly into the receive buffer
+ * of the server and is only valid for the duration of the handler call.
  */
-__attribute__ ((packed))
 struct iox_data_frame {
     uint8_t seq;            // sequence number, bit 7 indicates direction (in: 0 / out: 1)
     uint8_t cat;            // command category
     uint8_t id;             // command ID
-    uint8_t len;            // payload length
-    uint8_t payload[0];     // payload (variable length, lenght given by "len" field)
+    uint32_t len;           // payload length
+    uint8_t *payload;       // payload (variable length, lenght given by "len" field)
+};
+
+/*
+ * Frame handed over between I/O thread and main loop, the payload of the
+ * embedded frame points to data.
+ */
+struct iox_queued_frame {
+    QSLIST_ENTRY(iox_queued_frame) next;
+    struct iox_data_frame frame;
+    uint8_t data[];
 };
 
 typedef void(iox_frame_handler)(struct iox_data_frame *cmd, void* opaque);
+typedef void(iox_drain_handler)(void *opaque);
+
+
+#define IOX_CAT_TRANSPORT               0xFF
+
+#define IOX_CID_TRANSPORT_SHM_REQUEST   0x01
+#define IOX_CID_TRANSPORT_SHM_ACCEPT    0x02
+#define IOX_CID_TRANSPORT_SHM_REJECT    0x03
+#define IOX_CID_TRANSPORT_VERSION       0x04
+#define IOX_CID_TRANSPORT_SUBSCRIBE     0x05
+#define IOX_CID_TRANSPORT_UNSUBSCRIBE   0x06
+#define IOX_CID_TRANSPORT_CLAIM_INPUT   0x07
+
+#define IOX_CAP_SHM                     BIT(0)
 
+#define IOX_PROTOCOL_VERSION            2
+#define IOX_FRAME_MAX_PAYLOAD           0x10000
 
-typedef struct {
+#define IOX_SHM_RING_SIZE               0x40000
+
+#define IOX_QUEUE_LIMIT_DEFAULT         0x40000
+
+#define IOX_MAX_CLIENTS                 8
+
+/*
+ * Control block of a shared-memory ring, followed by IOX_SHM_RING_SIZE bytes
+ * of data. Producer and consumer fields are kept on separate cache lines.
+ */
+struct iox_shm_ring {
+    uint32_t head;
+    uint32_t producer_waiting;
+    uint8_t  _reserved0[56];
+    uint32_t tail;
+    uint32_t consumer_waiting;
+    uint8_t  _reserved1[56];
+    uint8_t  data[];
+};
+
+
+typedef struct IoXferServer IoXferServer;
+typedef struct IoXferReplayStream IoXferReplayStream;
+
+typedef struct IoXferClient {
+    IoXferServer *server;
+    QIOChannelSocket *sioc;
+    GSource *watch_in;
+    GSource *watch_hup;
+    GSource *watch_out;
+
+    uint8_t version;
+    unsigned long subscribed[BITS_TO_LONGS(256)];
+
+    // received data, may end with the start of an incomplete frame
+    Buffer inbuf;
+
+    // output queue (struct iox_out_entry), size in bytes
+    GQueue outq;
+    size_t out_bytes;
+    bool out_stalled;
+    int64_t out_stall_start;
+
+    // shared-memory transport
+    struct {
+        bool active;
+        int memfd;
+        void *mem;
+        size_t size;
+        struct iox_shm_ring *tx;
+        struct iox_shm_ring *rx;
+        EventNotifier tx_doorbell;
+        EventNotifier rx_doorbell;
+        uint8_t *bounce;
+    } shm;
+
+    QTAILQ_ENTRY(IoXferClient) next;
+} IoXferClient;
+
+struct IoXferServer {
     QIONetListener *listener;
-    QIOChannelSocket *client;
+    SocketAddress *addr;
+
+    // final path of our unix socket, removed on close if it is still ours
+    char *unix_path;
+    dev_t unix_dev;
+    ino_t unix_ino;
+
+    // connected clients, oldest first, one of them owns the device input
+    QTAILQ_HEAD(, IoXferClient) clients;
+    IoXferClient *owner;
+    unsigned nclients;
+    uint32_t max_payload;
+
+    // I/O thread doing all socket I/O, context is NULL for the main loop
+    IOThread *iothread;
+    GMainContext *ctx;
+    QEMUBH *io_in_bh;
+    QEMUBH *io_out_bh;
+    QEMUBH *io_drain_bh;
+    QSLIST_HEAD(, iox_queued_frame) io_in;
+    QSLIST_HEAD(, iox_queued_frame) io_out;
+    size_t io_out_bytes;
+    bool io_wakeup;
 
     iox_frame_handler *handler;
+    iox_drain_handler *drain_handler;
     void *handler_opaque;
 
-    uint8_t buffer[sizeof(struct iox_data_frame) + 256];
-    unsigned buffer_used;
-
     uint8_t seq;
-} IoXferServer;
+
+    // device waits for a response from its client, see iox_response_pending()
+    bool response_pending;
+
+    // ID of the server in traffic captures, see ioxfer-trace.h
+    uint8_t trace_id;
+
+    // recorded traffic replacing the socket, see ioxfer-replay.h
+    IoXferReplayStream *replay;
+
+    // record/replay of received frames (-icount rr=...)
+    ReplayIoxState *rr;
+
+    // output queue limit and statistics, depth is the one of the input owner
+    size_t out_limit;
+    size_t out_depth;
+    int64_t out_stall_ns;
+    uint64_t out_dropped;
+
+    QLIST_ENTRY(IoXferServer) next;
+};
 
 
 IoXferServer *iox_server_new(void);
 void iox_server_free(IoXferServer *srv);
 
 void iox_server_set_handler(IoXferServer *srv, iox_frame_handler *handler, void* opaque);
+void iox_server_set_drain_handler(IoXferServer *srv, iox_drain_handler *handler);
+void iox_server_set_queue_limit(IoXferServer *srv, size_t limit);
+void iox_server_set_iothread(IoXferServer *srv, IOThread *iothread);
+void iox_server_set_response_pending(IoXferServer *srv, bool pending);
 int iox_server_open(IoXferServer *srv, SocketAddress *addr, Error **errp);
 void iox_server_close(IoXferServer *srv);
 
+/*
+ * Pass a frame to the device as if it had been received from the input
+ * owner. Must be called with the BQL held.
+ */
+void iox_server_inject(IoXferServer *srv, struct iox_data_frame *frame);
+
+/*
+ * Check if the given server exchanges frames with anything, i.e. has a
+ * connected client or replays a trace.
+ */
+bool iox_server_active(IoXferServer *srv);
+
+/*
+ * Check if any IOX server is currently in the process of receiving a frame,
+ * i.e. has received the start of a frame but not all of it.
+ */
+bool iox_input_pending(void);
+
+/*
+ * Check if any IOX server has queued output not yet taken by its client.
+ */
+bool iox_output_pending(void);
+
+/*
+ * Check if any device waits for a response of a connected client, as set via
+ * iox_server_set_response_pending(). Virtual time must not be warped past
+ * such a response, the client only runs in real time.
+ */
+bool iox_response_pending(void);
+
+/*
+ * Check if the output queue of the given server has reached its high-water
+ * mark. Further frames will be dropped until the queue has been drained.
+ */
+bool iox_server_congested(IoXferServer *srv);
+
+/*
+ * Get/set the default queue limit. Setting it also applies the new limit to
+ * all existing servers.
+ */
+size_t iox_get_queue_limit(void);
+void iox_set_queue_limit(size_t limit);
+
+/*
+ * Visit output queue statistics (depth, limit, stall time, dropped frames)
+ * of all IOX servers as list, e.g. for exposure via a QOM property.
+ */
+void iox_visit_stats(Visitor *v, const char *name, Error **errp);
+
+/*
+ * Re-open all IOX servers in a child process after fork(). Connections and
+ * listening sockets are shared with the parent and are thus closed (but not
+ * shut down) in the child. Unix sockets are re-created with their original
+ * file name inside the directory @dir.
+ */
+int iox_servers_fork_child(const char *dir, Error **errp);
+
+/*
+ * Check if any IOX server is bound to an I/O thread. I/O threads do not
+ * survive fork(), thus such servers cannot be re-opened in a child.
+ */
+bool iox_servers_use_iothread(void);
+
+/*
+ * Migration support for the data buffers (Buffer) used by devices to store
+ * data received from or to be sent to IOX clients. Only the used part of the
+ * buffer (up to offset) is transferred.
+ */
+extern const VMStateInfo vmstate_info_iox_buffer;
+
+#define VMSTATE_IOX_BUFFER(_field, _state) \
+    VMSTATE_SINGLE(_field, _state, 0, vmstate_info_iox_buffer, Buffer)
+
+
 static inline uint8_t iox_next_seqid(IoXferServer *srv)
 {
     if (!srv)
@@ -103,6 +416,15 @@ int iox_send_command(IoXferServer *srv, uint8_t seq, uint8_t cat, uint8_t id);
 
 int iox_send_u32(IoXferServer *srv, uint8_t seq, uint8_t cat, uint8_t id, uint32_t value);
 
+/*
+ * Maximum payload length of a single frame accepted by all clients of the
+ * server, larger transfers need to be split by the caller.
+ */
+static inline uint32_t iox_server_max_payload(IoXferServer *srv)
+{
+    return srv ? atomic_read(&srv->max_payload) : 0xff;
+}
+
 static inline int iox_send_frame_new(IoXferServer *srv, struct iox_data_frame *frame)
 {
     frame->seq = iox_next_seqid(srv);
@@ -0,0 +1,270 @@
+/*
+ * I/O Transfer Server (IOX) traffic capture.
+ *
+ * See ioxfer-trace.h for details.
+ *
+ * Copyright (c) 2019-2020 KSat e.V. Stuttgart
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or, at your
+ * option, any later version. See the COPYING file in the top-level directory.
+ */
+
+#include "ioxfer-trace.h"
+#include "qemu-common.h"
+#include "qemu/bitops.h"
+#include "qemu/bswap.h"
+#include "qemu/error-report.h"
+#include "qemu/notify.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "sysemu/sysemu.h"
+
+
+#define IOX_TRACE_FLUSH_MS      100
+
+struct iox_trace {
+    char *path;
+    int fd;
+
+    QemuThread thread;
+    QemuSemaphore kick;
+    bool kicked;
+    bool stop;
+
+    // single producer (BQL holder), single consumer (writer thread)
+    uint8_t *ring;
+    uint32_t head;
+    uint32_t tail;
+
+    uint64_t dropped;
+    unsigned long announced[BITS_TO_LONGS(256)];
+};
+
+bool iox_trace_active;
+
+static struct iox_trace *iox_trace;
+static Notifier iox_trace_exit_notifier;
+
+
+static void iox_trace_ring_write(struct iox_trace *t, uint32_t pos, const void *data, uint32_t len)
+{
+    uint32_t off = (t->head + pos) & (IOX_TRACE_RING_SIZE - 1);
+    uint32_t n = MIN(len, IOX_TRACE_RING_SIZE - off);
+
+    if (!len)
+        return;
+
+    memcpy(t->ring + off, data, n);
+    memcpy(t->ring, (const uint8_t *)data + n, len - n);
+}
+
+static void iox_trace_write(struct iox_trace *t, const void *data, size_t len)
+{
+    if (qemu_write_full(t->fd, data, len) != len)
+        warn_report_once("iox: cannot write trace %s: %s", t->path, strerror(errno));
+}
+
+static void iox_trace_write_dropped(struct iox_trace *t)
+{
+    uint8_t rec[IOX_TRACE_REC_HDR_LEN + sizeof(uint64_t)] = { 0 };
+    uint64_t dropped = atomic_xchg(&t->dropped, 0);
+
+    if (!dropped)
+        return;
+
+    stl_le_p(rec, sizeof(rec));
+    rec[4] = IOX_TRACE_REC_DROPPED;
+    stq_le_p(rec + IOX_TRACE_REC_HDR_LEN, dropped);
+
+    iox_trace_write(t, rec, sizeof(rec));
+}
+
+static void *iox_trace_thread(void *opaque)
+{
+    struct iox_trace *t = opaque;
+    bool stop;
+
+    do {
+        uint32_t head, off, n;
+
+        // flush periodically, or early if the ring fills up
+        qemu_sem_timedwait(&t->kick, IOX_TRACE_FLUSH_MS);
+        atomic_set(&t->kicked, false);
+
+        stop = atomic_read(&t->stop);
+        head = atomic_load_acquire(&t->head);
+
+        off = t->tail & (IOX_TRACE_RING_SIZE - 1);
+        n = MIN(head - t->tail, IOX_TRACE_RING_SIZE - off);
+
+        iox_trace_write(t, t->ring + off, n);
+        iox_trace_write(t, t->ring, head - t->tail - n);
+
+        atomic_store_release(&t->tail, head);
+
+        iox_trace_write_dropped(t);
+    } while (!stop);
+
+    return NULL;
+}
+
+static void iox_trace_exit(Notifier *n, void *data)
+{
+    iox_trace_stop();
+}
+
+int iox_trace_start(const char *path, Error **errp)
+{
+    uint8_t hdr[IOX_TRACE_HDR_LEN];
+    struct iox_trace *t;
+    int fd;
+
+    iox_trace_stop();
+
+    fd = qemu_open(path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "iox: cannot open trace %s", path);
+        return -1;
+    }
+
+    memcpy(hdr, IOX_TRACE_MAGIC, 8);
+    stl_le_p(hdr + 8, IOX_TRACE_VERSION);
+    stl_le_p(hdr + 12, IOX_TRACE_HDR_LEN);
+
+    if (qemu_write_full(fd, hdr, sizeof(hdr)) != sizeof(hdr)) {
+        error_setg_errno(errp, errno, "iox: cannot write trace %s", path);
+        qemu_close(fd);
+        return -1;
+    }
+
+    t = g_new0(struct iox_trace, 1);
+    t->path = g_strdup(path);
+    t->fd = fd;
+    t->ring = g_malloc(IOX_TRACE_RING_SIZE);
+
+    qemu_sem_init(&t->kick, 0);
+    qemu_thread_create(&t->thread, "iox-trace", iox_trace_thread, t, QEMU_THREAD_JOINABLE);
+
+    if (!iox_trace_exit_notifier.notify) {
+        iox_trace_exit_notifier.notify = iox_trace_exit;
+        qemu_add_exit_notifier(&iox_trace_exit_notifier);
+    }
+
+    iox_trace = t;
+    atomic_set(&iox_trace_active, true);
+
+    info_report("iox: capturing to %s", path);
+    return 0;
+}
+
+static void iox_trace_free(struct iox_trace *t)
+{
+    qemu_sem_destroy(&t->kick);
+    g_free(t->ring);
+    g_free(t->path);
+    g_free(t);
+}
+
+void iox_trace_stop(void)
+{
+    struct iox_trace *t = iox_trace;
+
+    if (!t)
+        return;
+
+    atomic_set(&iox_trace_active, false);
+    iox_trace = NULL;
+
+    // the writer drains the ring once more before exiting
+    atomic_set(&t->stop, true);
+    qemu_sem_post(&t->kick);
+    qemu_thread_join(&t->thread);
+
+    qemu_close(t->fd);
+    iox_trace_free(t);
+}
+
+const char *iox_trace_path(void)
+{
+    return iox_trace ? iox_trace->path : NULL;
+}
+
+void iox_trace_fork_child(void)
+{
+    struct iox_trace *t = iox_trace;
+
+    if (!t)
+        return;
+
+    // the writer thread did not survive the fork, the file belongs to the parent
+    atomic_set(&iox_trace_active, false);
+    iox_trace = NULL;
+
+    qemu_close(t->fd);
+    iox_trace_free(t);
+
+    info_report("iox: capture disabled in forked child");
+}
+
+static bool iox_trace_append(struct iox_trace *t, uint8_t type, uint8_t server, uint8_t flags,
+                             int64_t time, const void *data0, uint32_t len0,
+                             const void *data1, uint32_t len1)
+{
+    uint8_t hdr[IOX_TRACE_REC_HDR_LEN];
+    uint32_t size = IOX_TRACE_REC_HDR_LEN + len0 + len1;
+    uint32_t used;
+
+    used = t->head - atomic_load_acquire(&t->tail);
+    if (IOX_TRACE_RING_SIZE - used < size) {
+        atomic_inc(&t->dropped);
+        return false;
+    }
+
+    stl_le_p(hdr, size);
+    hdr[4] = type;
+    hdr[5] = server;
+    hdr[6] = flags;
+    hdr[7] = 0;
+    stq_le_p(hdr + 8, time);
+
+    iox_trace_ring_write(t, 0, hdr, IOX_TRACE_REC_HDR_LEN);
+    iox_trace_ring_write(t, IOX_TRACE_REC_HDR_LEN, data0, len0);
+    iox_trace_ring_write(t, IOX_TRACE_REC_HDR_LEN + len0, data1, len1);
+
+    atomic_store_release(&t->head, t->head + size);
+
+    // don't wait for the next periodic flush if we are running out of space
+    if (used + size >= IOX_TRACE_RING_SIZE / 2 && !atomic_xchg(&t->kicked, true))
+        qemu_sem_post(&t->kick);
+
+    return true;
+}
+
+void iox_trace_record(uint8_t server, const char *name, bool out,
+                      const struct iox_data_frame *frame)
+{
+    struct iox_trace *t = iox_trace;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    uint8_t hdr[IOX_TRACE_FRAME_HDR_LEN];
+
+    if (!t)
+        return;
+
+    // announce the server before its first frame
+    if (!test_bit(server, t->announced)) {
+        if (!iox_trace_append(t, IOX_TRACE_REC_SERVER, server, 0, now,
+                              name, strlen(name), NULL, 0))
+            return;
+
+        set_bit(server, t->announced);
+    }
+
+    hdr[0] = frame->seq;
+    hdr[1] = frame->cat;
+    hdr[2] = frame->id;
+    hdr[3] = 0;
+    stl_le_p(hdr + 4, frame->len);
+
+    iox_trace_append(t, IOX_TRACE_REC_FRAME, server, out ? IOX_TRACE_FLAG_OUT : 0, now,
+                     hdr, sizeof(hdr), frame->payload, frame->len);
+}
@@ -0,0 +1,97 @@
+/*
+ * I/O Transfer Server (IOX) traffic capture.
+ *
+ * Records all frames exchanged between IOX servers and their devices to a
+ * binary trace file, with timestamps in virtual time (QEMU_CLOCK_VIRTUAL).
+ * Use scripts/iox-trace-dump.py to convert a trace to text or pcapng.
+ *
+ * Records are appended to an in-memory ring by the thread holding the BQL
+ * and written to the file by a background thread, so capturing never blocks
+ * on file I/O. If the ring is full, records are dropped and counted.
+ *
+ * File format (all values little endian):
+ * The file starts with a 16 byte header: the magic "IOXTRACE", followed by
+ * the format version and the header size (both uint32). It is followed by
+ * any number of records, each starting with a 16 byte record header:
+ * - uint32 size:   size of the record in bytes, including this header
+ * - uint8  type:   record type (IOX_TRACE_REC_*)
+ * - uint8  server: ID of the IOX server, unique per machine
+ * - uint8  flags:  IOX_TRACE_FLAG_*
+ * - uint8  reserved
+ * - uint64 time:   virtual time in nanoseconds
+ * followed by type-specific data:
+ * - IOX_TRACE_REC_SERVER: name (socket path) of the server, not terminated.
+ *   Written before the first frame of each server.
+ * - IOX_TRACE_REC_FRAME: seq, cat, id, reserved (uint8 each), payload
+ *   length (uint32), and payload.
+ * - IOX_TRACE_REC_DROPPED: number of records dropped since the last record
+ *   of this type (uint64). Time and server are not set.
+ *
+ * Copyright (c) 2019-2020 KSat e.V. Stuttgart
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or, at your
+ * option, any later version. See the COPYING file in the top-level directory.
+ */
+
+#ifndef HW_ARM_ISIS_OBC_IOXFER_TRACE_H
+#define HW_ARM_ISIS_OBC_IOXFER_TRACE_H
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qapi/error.h"
+
+#include "ioxfer-server.h"
+
+
+#define IOX_TRACE_MAGIC             "IOXTRACE"
+#define IOX_TRACE_VERSION           1
+
+#define IOX_TRACE_HDR_LEN           16
+#define IOX_TRACE_REC_HDR_LEN       16
+#define IOX_TRACE_FRAME_HDR_LEN     8
+
+#define IOX_TRACE_REC_SERVER        0x01
+#define IOX_TRACE_REC_FRAME         0x02
+#define IOX_TRACE_REC_DROPPED       0x03
+
+#define IOX_TRACE_FLAG_OUT          BIT(0)      // frame sent by the device
+
+#define IOX_TRACE_RING_SIZE         0x100000
+
+
+extern bool iox_trace_active;
+
+/*
+ * Start capturing to the given file, replacing any previous trace. Any
+ * ongoing capture is stopped first.
+ */
+int iox_trace_start(const char *path, Error **errp);
+
+/*
+ * Stop capturing, writing out all buffered records.
+ */
+void iox_trace_stop(void);
+
+/*
+ * Path of the current trace file, NULL if not capturing.
+ */
+const char *iox_trace_path(void);
+
+/*
+ * Drop the capture state in a forked child, without touching the file or
+ * the background thread of the parent.
+ */
+void iox_trace_fork_child(void);
+
+/*
+ * Record a frame. Must be called with the BQL held.
+ */
+void iox_trace_record(uint8_t server, const char *name, bool out,
+                      const struct iox_data_frame *frame);
+
+static inline bool iox_trace_enabled(void)
+{
+    return atomic_read(&iox_trace_active);
+}
+
+#endif /* HW_ARM_ISIS_OBC_IOXFER_TRACE_H */
@@ -0,0 +1,307 @@
+/*
+ * Cypress FM25V-style serial (SPI) F-RAM.
+ *
+ * See spi-fram.h for details.
+ *
+ * Copyright (c) 2019-2020 KSat e.V. Stuttgart
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or, at your
+ * option, any later version. See the COPYING file in the top-level directory.
+ */
+
+#include "spi-fram.h"
+#include "iobc-mapped_file.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/host-utils.h"
+#include "qemu/log.h"
+#include "qemu/units.h"
+#include "hw/qdev-properties.h"
+#include "migration/vmstate.h"
+
+
+#define CMD_WRSR        0x01
+#define CMD_WRITE       0x02
+#define CMD_READ        0x03
+#define CMD_WRDI        0x04
+#define CMD_RDSR        0x05
+#define CMD_WREN        0x06
+#define CMD_FSTRD       0x0B
+#define CMD_RDID        0x9F
+#define CMD_SLEEP       0xB9
+
+#define SR_WEL          BIT(1)
+#define SR_BP(s)        (((s)->sr >> 2) & 0x03)
+#define SR_WRITABLE     0x8C            // WPEN, BP1, BP0
+
+#define RDID_LEN        9
+#define RDID_MFR        0xC2            // Cypress (Ramtron), after 6x 0x7F
+#define RDID_FAMILY     0x20            // FM25V
+
+
+static bool fram_protected(SpiFramState *s, uint32_t addr)
+{
+    // SPEC: BP1:BP0 = 01: upper quarter, 10: upper half, 11: all protected
+    switch (SR_BP(s)) {
+    case 1:
+        return addr >= s->size / 4 * 3;
+    case 2:
+        return addr >= s->size / 2;
+    case 3:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static uint8_t fram_rdid(SpiFramState *s, unsigned idx)
+{
+    if (idx < 6)
+        return 0x7F;
+    if (idx == 6)
+        return RDID_MFR;
+    if (idx == 7)
+        return RDID_FAMILY | (ctz32(s->size) - 13);     // density, 16 KiB = 1
+
+    return 0x00;
+}
+
+static void fram_command(SpiFramState *s, uint8_t cmd)
+{
+    s->cmd = cmd;
+
+    switch (cmd) {
+    case CMD_WREN:
+        s->sr |= SR_WEL;
+        s->state = SPI_FRAM_IGNORE;
+        break;
+
+    case CMD_WRDI:
+        s->sr &= ~SR_WEL;
+        s->state = SPI_FRAM_IGNORE;
+        break;
+
+    case CMD_RDSR:
+        s->state = SPI_FRAM_RDSR;
+        break;
+
+    case CMD_WRSR:
+        s->state = SPI_FRAM_WRSR;
+        break;
+
+    case CMD_READ:
+    case CMD_FSTRD:
+    case CMD_WRITE:
+        s->addr = 0;
+        s->count = 0;
+        s->state = SPI_FRAM_ADDR;
+        break;
+
+    case CMD_RDID:
+        s->count = 0;
+        s->state = SPI_FRAM_RDID;
+        break;
+
+    case CMD_SLEEP:
+        s->sleep = true;
+        s->state = SPI_FRAM_IGNORE;
+        break;
+
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR, "fm25v: unknown command 0x%02x\n", cmd);
+        s->state = SPI_FRAM_IGNORE;
+        break;
+    }
+}
+
+static uint32_t fram_transfer(SSISlave *ss, uint32_t tx)
+{
+    SpiFramState *s = SPI_FRAM(ss);
+    uint8_t val = tx & 0xFF;
+    uint8_t rx = 0;
+
+    switch (s->state) {
+    case SPI_FRAM_IDLE:
+        fram_command(s, val);
+        break;
+
+    case SPI_FRAM_ADDR:
+        s->addr = (s->addr << 8) | val;
+        if (++s->count < s->addr_bytes)
+            break;
+
+        s->addr &= s->size - 1;
+
+        if (s->cmd == CMD_READ) {
+            s->state = SPI_FRAM_READ;
+        } else if (s->cmd == CMD_FSTRD) {
+            s->state = SPI_FRAM_DUMMY;
+        } else if (s->sr & SR_WEL) {
+            s->state = SPI_FRAM_WRITE;
+        } else {
+            qemu_log_mask(LOG_GUEST_ERROR, "fm25v: write without WEL set\n");
+            s->state = SPI_FRAM_IGNORE;
+        }
+        break;
+
+    case SPI_FRAM_DUMMY:
+        s->state = SPI_FRAM_READ;
+        break;
+
+    case SPI_FRAM_READ:
+        rx = s->mem[s->addr];
+        s->addr = (s->addr + 1) & (s->size - 1);
+        break;
+
+    case SPI_FRAM_WRITE:
+        if (!fram_protected(s, s->addr))
+            s->mem[s->addr] = val;
+
+        s->addr = (s->addr + 1) & (s->size - 1);
+        s->written = true;
+        break;
+
+    case SPI_FRAM_RDSR:
+        rx = s->sr;
+        break;
+
+    case SPI_FRAM_WRSR:
+        if (s->sr & SR_WEL) {
+            s->sr = (s->sr & ~SR_WRITABLE) | (val & SR_WRITABLE);
+            s->written = true;
+        }
+        s->state = SPI_FRAM_IGNORE;
+        break;
+
+    case SPI_FRAM_RDID:
+        rx = fram_rdid(s, s->count);
+        if (s->count < RDID_LEN)
+            s->count++;
+        break;
+
+    case SPI_FRAM_IGNORE:
+        break;
+    }
+
+    return rx;
+}
+
+static int fram_set_cs(SSISlave *ss, bool high)
+{
+    SpiFramState *s = SPI_FRAM(ss);
+
+    if (high) {
+        // SPEC: WEL is cleared on the rising edge of CS following a WRITE or
+        // WRSR command.
+        if (s->written)
+            s->sr &= ~SR_WEL;
+
+        s->written = false;
+        s->state = SPI_FRAM_IDLE;
+    } else {
+        // SPEC: The device exits sleep mode on the falling edge of CS.
+        s->sleep = false;
+    }
+
+    return 0;
+}
+
+static void fram_realize(SSISlave *ss, Error **errp)
+{
+    SpiFramState *s = SPI_FRAM(ss);
+
+    if (!is_power_of_2(s->size) || s->size < 16 * KiB || s->size > 256 * KiB) {
+        error_setg(errp, "fm25v: size must be a power of two between 16 KiB and 256 KiB");
+        return;
+    }
+
+    s->addr_bytes = s->size > 64 * KiB ? 3 : 2;
+
+    if (s->file) {
+        s->mem = iobc_map_file("fm25v", s->file, s->size, errp);
+        if (!s->mem)
+            return;
+
+        s->mapped = true;
+    } else {
+        s->mem = g_malloc0(s->size);
+        s->mapped = false;
+    }
+}
+
+static void fram_unrealize(DeviceState *dev, Error **errp)
+{
+    SpiFramState *s = SPI_FRAM(dev);
+
+    if (s->mapped)
+        iobc_unmap_file(s->mem, s->size);
+    else
+        g_free(s->mem);
+
+    s->mem = NULL;
+}
+
+static void fram_reset(DeviceState *dev)
+{
+    SpiFramState *s = SPI_FRAM(dev);
+
+    // BP and WPEN are non-volatile, keep them (not stored in the file though)
+    s->state = SPI_FRAM_IDLE;
+    s->sr &= ~SR_WEL;
+    s->written = false;
+    s->sleep = false;
+}
+
+static Property fram_properties[] = {
+    DEFINE_PROP_STRING("file", SpiFramState, file),
+    DEFINE_PROP_UINT32("size", SpiFramState, size, 128 * KiB),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static const VMStateDescription vmstate_spi_fram = {
+    .name = "fm25v",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_SSI_SLAVE(parent_obj, SpiFramState),
+        VMSTATE_UINT32(state, SpiFramState),
+        VMSTATE_UINT8(cmd, SpiFramState),
+        VMSTATE_UINT32(addr, SpiFramState),
+        VMSTATE_UINT8(count, SpiFramState),
+        VMSTATE_UINT8(sr, SpiFramState),
+        VMSTATE_BOOL(written, SpiFramState),
+        VMSTATE_BOOL(sleep, SpiFramState),
+        VMSTATE_VBUFFER_UINT32(mem, SpiFramState, 0, NULL, size),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
+static void fram_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+    SSISlaveClass *ssc = SSI_SLAVE_CLASS(klass);
+
+    ssc->realize = fram_realize;
+    ssc->transfer = fram_transfer;
+    ssc->set_cs = fram_set_cs;
+    ssc->cs_polarity = SSI_CS_LOW;
+
+    dc->unrealize = fram_unrealize;
+    dc->reset = fram_reset;
+    device_class_set_props(dc, fram_properties);
+    dc->vmsd = &vmstate_spi_fram;
+}
+
+static const TypeInfo spi_fram_info = {
+    .name = TYPE_SPI_FRAM,
+    .parent = TYPE_SSI_SLAVE,
+    .instance_size = sizeof(SpiFramState),
+    .class_init = fram_class_init,
+};
+
+static void spi_fram_register_types(void)
+{
+    type_register_static(&spi_fram_info);
+}
+
+type_init(spi_fram_register_types)
@@ -0,0 +1,75 @@
+/*
+ * Cypress FM25V-style serial (SPI) F-RAM.
+ *
+ * SSI slave emulating an FM25V serial F-RAM, to be attached to one of the
+ * chip-select buses of the AT91 SPI (see at91-spi.h), e.g. via
+ *
+ *   -device fm25v,bus=spi0.cs1,size=131072,file=fram.bin
+ *
+ * Supported commands are WREN, WRDI, RDSR, WRSR, READ, FSTRD, WRITE, SLEEP
+ * and RDID. Block protection via BP0/BP1 is honored, WPEN and the write
+ * protect pin are ignored. Addresses are two bytes for devices up to 64 KiB,
+ * three bytes for larger ones. Reads and writes wrap around at the end of
+ * the memory, as on the real device. RDID returns the Cypress manufacturer
+ * ID followed by the FM25V product ID for the configured density.
+ *
+ * Properties:
+ * - size: memory size in bytes (power of two, 16 KiB to 256 KiB, default
+ *   128 KiB as for the FM25V10).
+ * - file: backing file. The file is created if it does not exist, and
+ *   extended to the memory size if it is smaller. It is mapped shared, so
+ *   writes of the guest end up in the file immediately and changes to the
+ *   file by other processes are seen by the guest. Note that this includes
+ *   processes forked via the fork server (see iobc-fork_server.h), all of
+ *   which share the same memory. Without file, the memory is anonymous and
+ *   initially zero.
+ *
+ * Copyright (c) 2019-2020 KSat e.V. Stuttgart
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or, at your
+ * option, any later version. See the COPYING file in the top-level directory.
+ */
+
+#ifndef HW_ARM_ISIS_OBC_SPI_FRAM_H
+#define HW_ARM_ISIS_OBC_SPI_FRAM_H
+
+#include "qemu/osdep.h"
+#include "hw/ssi/ssi.h"
+
+
+#define TYPE_SPI_FRAM "fm25v"
+#define SPI_FRAM(obj) OBJECT_CHECK(SpiFramState, (obj), TYPE_SPI_FRAM)
+
+
+enum spi_fram_state {
+    SPI_FRAM_IDLE,
+    SPI_FRAM_ADDR,
+    SPI_FRAM_DUMMY,
+    SPI_FRAM_READ,
+    SPI_FRAM_WRITE,
+    SPI_FRAM_RDSR,
+    SPI_FRAM_WRSR,
+    SPI_FRAM_RDID,
+    SPI_FRAM_IGNORE,
+};
+
+typedef struct {
+    SSISlave parent_obj;
+
+    char *file;
+    uint32_t size;
+
+    uint8_t *mem;
+    bool mapped;
+
+    uint32_t state;
+    uint8_t cmd;
+    uint32_t addr;
+    uint8_t addr_bytes;
+    uint8_t count;
+    uint8_t sr;
+    bool written;
+    bool sleep;
+} SpiFramState;
+
+#endif /* HW_ARM_ISIS_OBC_SPI_FRAM_H */
@@ -129,6 +129,22 @@ uint8_t sdbus_read_data(SDBus *sdbus)
     return value;
 }
 
+size_t sdbus_claim_blocks(SDBus *sdbus, bool write, size_t len,
+                          BlockBackend **blk, uint64_t *offset)
+{
+    SDState *card = get_card(sdbus);
+
+    if (card) {
+        SDCardClass *sc = SD_CARD_GET_CLASS(card);
+
+        if (sc->claim_blocks) {
+            return sc->claim_blocks(card, write, len, blk, offset);
+        }
+    }
+
+    return 0;
+}
+
 bool sdbus_data_ready(SDBus *sdbus)
 {
     SDState *card = get_card(sdbus);
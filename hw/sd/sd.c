@@ -2043,6 +2043,85 @@ uint8_t sd_read_data(SDState *sd)
     return ret;
 }
 
+/*
+ * Claim whole blocks of the current CMD24/CMD25 (write) or CMD17/CMD18
+ * (read) transfer: Advance the card as if up to len bytes had been
+ * transferred, without transferring any data. Returns the number of bytes
+ * claimed, which are contiguous at *offset of *blk and have to be
+ * transferred by the caller. Returns zero if the card is not at a block
+ * boundary of such a transfer.
+ */
+size_t sd_claim_blocks(SDState *sd, bool write, size_t len,
+                       BlockBackend **blk, uint64_t *offset)
+{
+    size_t done = 0;
+    uint32_t blk_len;
+    bool multi;
+
+    if (!sd->blk || !blk_is_inserted(sd->blk) || !sd->enable)
+        return 0;
+
+    if (write) {
+        if (sd->state != sd_receivingdata_state
+            || (sd->current_cmd != 24 && sd->current_cmd != 25))
+            return 0;
+
+        blk_len = sd->blk_len;
+        multi = sd->current_cmd == 25;
+    } else {
+        if (sd->state != sd_sendingdata_state
+            || (sd->current_cmd != 17 && sd->current_cmd != 18))
+            return 0;
+
+        blk_len = (sd->ocr & (1 << 30)) ? 512 : sd->blk_len;
+        multi = sd->current_cmd == 18;
+    }
+
+    if (sd->data_offset != 0 || (sd->card_status & (ADDRESS_ERROR | WP_VIOLATION)))
+        return 0;
+
+    *blk = sd->blk;
+    *offset = sd->data_start;
+
+    while (len - done >= blk_len) {
+        if (multi && sd->data_start + blk_len > sd->size) {
+            sd->card_status |= ADDRESS_ERROR;
+            break;
+        }
+        if (multi && write && sd_wp_addr(sd, sd->data_start)) {
+            sd->card_status |= WP_VIOLATION;
+            break;
+        }
+
+        done += blk_len;
+
+        if (write) {
+            sd->blk_written++;
+            sd->csd[14] |= 0x40;
+        }
+
+        if (!multi) {
+            sd->data_offset = blk_len;
+            sd->state = sd_transfer_state;
+            break;
+        }
+
+        sd->data_start += blk_len;
+        if (sd->multi_blk_cnt != 0 && --sd->multi_blk_cnt == 0) {
+            sd->state = sd_transfer_state;
+            break;
+        }
+    }
+
+    if (done && write) {
+        trace_sdcard_write_block(*offset, done);
+    } else if (done) {
+        trace_sdcard_read_block(*offset, done);
+    }
+
+    return done;
+}
+
 bool sd_data_ready(SDState *sd)
 {
     return sd->state == sd_sendingdata_state;
@@ -2130,6 +2209,7 @@ static void sd_class_init(ObjectClass *klass, void *data)
     sc->do_command = sd_do_command;
     sc->write_data = sd_write_data;
     sc->read_data = sd_read_data;
+    sc->claim_blocks = sd_claim_blocks;
     sc->data_ready = sd_data_ready;
     sc->enable = sd_enable;
     sc->get_inserted = sd_get_inserted;
@@ -106,6 +106,8 @@ typedef struct {
     int (*do_command)(SDState *sd, SDRequest *req, uint8_t *response);
     void (*write_data)(SDState *sd, uint8_t value);
     uint8_t (*read_data)(SDState *sd);
+    size_t (*claim_blocks)(SDState *sd, bool write, size_t len,
+                           BlockBackend **blk, uint64_t *offset);
     bool (*data_ready)(SDState *sd);
     void (*set_voltage)(SDState *sd, uint16_t millivolts);
     uint8_t (*get_dat_lines)(SDState *sd);
@@ -142,6 +144,8 @@ int sd_do_command(SDState *sd, SDRequest *req,
                   uint8_t *response);
 void sd_write_data(SDState *sd, uint8_t value);
 uint8_t sd_read_data(SDState *sd);
+size_t sd_claim_blocks(SDState *sd, bool write, size_t len,
+                       BlockBackend **blk, uint64_t *offset);
 void sd_set_cb(SDState *sd, qemu_irq readonly, qemu_irq insert);
 bool sd_data_ready(SDState *sd);
 /* sd_enable should not be used -- it is only used on the nseries boards,
@@ -162,6 +166,23 @@ bool sdbus_get_cmd_line(SDBus *sdbus);
 int sdbus_do_command(SDBus *sd, SDRequest *req, uint8_t *response);
 void sdbus_write_data(SDBus *sd, uint8_t value);
 uint8_t sdbus_read_data(SDBus *sd);
+/**
+ * sdbus_claim_blocks: Claim whole blocks for I/O done by the controller
+ * @sd: the bus
+ * @write: claim blocks of a write (CMD24, CMD25) instead of a read (CMD17,
+ *         CMD18) transfer
+ * @len: maximum number of bytes
+ * @blk: returns the block backend of the card
+ * @offset: returns the offset of the first block in @blk
+ *
+ * Advance the card over whole blocks of the current transfer as if they had
+ * been transferred, so that the controller can do the actual I/O on @blk
+ * itself, e.g. asynchronously. Returns the number of bytes claimed, which
+ * are contiguous in @blk, or zero if the card is not at a block boundary of
+ * a block transfer (use sdbus_read_data()/sdbus_write_data() then).
+ */
+size_t sdbus_claim_blocks(SDBus *sd, bool write, size_t len,
+                          BlockBackend **blk, uint64_t *offset);
 bool sdbus_data_ready(SDBus *sd);
 bool sdbus_get_inserted(SDBus *sd);
 bool sdbus_get_readonly(SDBus *sd);
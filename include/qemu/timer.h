@@ -796,6 +796,8 @@ int64_t cpu_get_ticks(void);
 void cpu_enable_ticks(void);
 /* Caller must hold BQL */
 void cpu_disable_ticks(void);
+/* Caller must hold BQL */
+void cpu_clock_warp(int64_t delta);
 
 static inline int64_t get_max_clock_jump(void)
 {
@@ -43,6 +43,7 @@ enum ReplayCheckpoint {
 typedef enum ReplayCheckpoint ReplayCheckpoint;
 
 typedef struct ReplayNetState ReplayNetState;
+typedef struct ReplayIoxState ReplayIoxState;
 
 extern ReplayMode replay_mode;
 
@@ -187,6 +188,18 @@ void replay_unregister_net(ReplayNetState *rns);
 void replay_net_packet_event(ReplayNetState *rns, unsigned flags,
                              const struct iovec *iov, int iovcnt);
 
+/* I/O transfer servers */
+
+typedef void ReplayIoxHandler(void *opaque, const uint8_t *buf, size_t size);
+
+/*! Registers an IOX server, handler is called to pass frames to the device. */
+ReplayIoxState *replay_register_iox(ReplayIoxHandler *handler, void *opaque);
+/*! Unregisters an IOX server. */
+void replay_unregister_iox(ReplayIoxState *ris);
+/*! Called to write a frame received by an IOX server to the replay log. */
+void replay_iox_frame_event(ReplayIoxState *ris, const uint8_t *buf,
+                            size_t size);
+
 /* Audio */
 
 /*! Saves/restores number of played samples of audio out operation. */
@@ -2181,6 +2181,60 @@ void hmp_info_vm_generation_id(Monitor *mon, const QDict *qdict)
     qapi_free_GuidInfo(info);
 }
 
+void hmp_info_at91_mci(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+    At91MciStats *info = qmp_query_at91_mci(&err);
+    At91MciCardStatsList *card;
+    At91MciCommandStatsList *cmd;
+    uint64List *lat;
+    int i;
+
+    if (err) {
+        hmp_handle_error(mon, err);
+        return;
+    }
+
+    monitor_printf(mon, "status register reads: %" PRIu64 "\n",
+                   info->sr_reads);
+
+    for (card = info->cards; card; card = card->next) {
+        At91MciCardStats *st = card->value;
+
+        monitor_printf(mon, "card %u:\n", st->slot);
+        monitor_printf(mon, "  PDC:     %" PRIu64 " bytes read, %" PRIu64
+                       " bytes written\n", st->pdc_read_bytes,
+                       st->pdc_write_bytes);
+        monitor_printf(mon, "  RDR/TDR: %" PRIu64 " bytes read, %" PRIu64
+                       " bytes written\n", st->reg_read_bytes,
+                       st->reg_write_bytes);
+        monitor_printf(mon, "  block requests: %" PRIu64 "\n",
+                       st->block_requests);
+
+        for (cmd = st->commands; cmd; cmd = cmd->next) {
+            monitor_printf(mon, "  CMD%-2u %10" PRIu64 "  latency:",
+                           cmd->value->index, cmd->value->count);
+
+            /* only non-empty buckets, labeled with their upper bound */
+            for (lat = cmd->value->latency, i = 0; lat; lat = lat->next, i++) {
+                if (!lat->value) {
+                    continue;
+                }
+                if (lat->next) {
+                    monitor_printf(mon, " <%" PRIu64 "us:%" PRIu64,
+                                   (uint64_t)1 << i, lat->value);
+                } else {
+                    monitor_printf(mon, " >=%" PRIu64 "us:%" PRIu64,
+                                   (uint64_t)1 << (i - 1), lat->value);
+                }
+            }
+            monitor_printf(mon, "\n");
+        }
+    }
+
+    qapi_free_At91MciStats(info);
+}
+
 void hmp_info_memory_size_summary(Monitor *mon, const QDict *qdict)
 {
     Error *err = NULL;
@@ -590,6 +590,36 @@ void monitor_cleanup(void)
     }
 }
 
+/*
+ * Detach all monitors in a child process after fork(). The monitor
+ * connections are shared with the parent process, which stays in control of
+ * them: The child must neither read commands from them nor write responses
+ * or events to them. This is also why the monitors must not be destroyed
+ * here. Monitors served by the monitor I/O thread are inactive already, as
+ * the child does not inherit that thread.
+ */
+void monitor_fork_child(void)
+{
+    /* the child is single-threaded here, locks may be held by lost threads */
+    qemu_mutex_init(&monitor_lock);
+
+    while (!QTAILQ_EMPTY(&mon_list)) {
+        Monitor *mon = QTAILQ_FIRST(&mon_list);
+        QTAILQ_REMOVE(&mon_list, mon, entry);
+
+        qemu_mutex_init(&mon->mon_lock);
+        mon->skip_flush = true;
+
+        if (!mon->use_io_thread) {
+            qemu_chr_fe_set_handlers(&mon->chr, NULL, NULL, NULL, NULL,
+                                     NULL, NULL, true);
+        }
+    }
+
+    /* the thread is gone, don't try to stop it on exit */
+    mon_iothread = NULL;
+}
+
 static void monitor_qapi_event_init(void)
 {
     monitor_qapi_event_state = g_hash_table_new(qapi_event_throttle_hash,
@@ -55,6 +55,9 @@ static void replay_run_event(Event *event)
     case REPLAY_ASYNC_EVENT_NET:
         replay_event_net_run(event->opaque);
         break;
+    case REPLAY_ASYNC_EVENT_IOX:
+        replay_event_iox_run(event->opaque);
+        break;
     default:
         error_report("Replay: invalid async event ID (%d) in the queue",
                     event->event_kind);
@@ -192,6 +195,9 @@ static void replay_save_event(Event *event, int checkpoint)
         case REPLAY_ASYNC_EVENT_NET:
             replay_event_net_save(event->opaque);
             break;
+        case REPLAY_ASYNC_EVENT_IOX:
+            replay_event_iox_save(event->opaque);
+            break;
         default:
             error_report("Unknown ID %" PRId64 " of replay event", event->id);
             exit(1);
@@ -261,6 +267,11 @@ static Event *replay_read_event(int checkpoint)
         event->event_kind = replay_state.read_event_kind;
         event->opaque = replay_event_net_load();
         return event;
+    case REPLAY_ASYNC_EVENT_IOX:
+        event = g_malloc0(sizeof(Event));
+        event->event_kind = replay_state.read_event_kind;
+        event->opaque = replay_event_iox_load();
+        return event;
     default:
         error_report("Unknown ID %d of replay event",
             replay_state.read_event_kind);
@@ -59,6 +59,7 @@ enum ReplayAsyncEventKind {
     REPLAY_ASYNC_EVENT_CHAR_READ,
     REPLAY_ASYNC_EVENT_BLOCK,
     REPLAY_ASYNC_EVENT_NET,
+    REPLAY_ASYNC_EVENT_IOX,
     REPLAY_ASYNC_COUNT
 };
 
@@ -186,6 +187,15 @@ void replay_event_net_save(void *opaque);
 /*! Reads network from the file. */
 void *replay_event_net_load(void);
 
+/* I/O transfer servers */
+
+/*! Called to run IOX frame event. */
+void replay_event_iox_run(void *opaque);
+/*! Writes IOX frame event to the file. */
+void replay_event_iox_save(void *opaque);
+/*! Reads IOX frame event from the file. */
+void *replay_event_iox_load(void);
+
 /* VMState-related functions */
 
 /* Registers replay VMState.
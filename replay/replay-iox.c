@@ -0,0 +1,91 @@
+/*
+ * replay-iox.c
+ *
+ * Record/replay of frames received by I/O transfer (IOX) servers.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/error-report.h"
+#include "sysemu/replay.h"
+#include "replay-internal.h"
+
+struct ReplayIoxState {
+    ReplayIoxHandler *handler;
+    void *opaque;
+    int id;
+};
+
+typedef struct IoxEvent {
+    uint8_t id;
+    uint8_t *data;
+    size_t size;
+} IoxEvent;
+
+static ReplayIoxState **iox_servers;
+static int iox_servers_count;
+
+ReplayIoxState *replay_register_iox(ReplayIoxHandler *handler, void *opaque)
+{
+    ReplayIoxState *ris = g_new0(ReplayIoxState, 1);
+    ris->handler = handler;
+    ris->opaque = opaque;
+    ris->id = iox_servers_count++;
+    iox_servers = g_realloc(iox_servers,
+                            iox_servers_count * sizeof(*iox_servers));
+    iox_servers[iox_servers_count - 1] = ris;
+    return ris;
+}
+
+void replay_unregister_iox(ReplayIoxState *ris)
+{
+    iox_servers[ris->id] = NULL;
+    g_free(ris);
+}
+
+void replay_iox_frame_event(ReplayIoxState *ris, const uint8_t *buf,
+                            size_t size)
+{
+    IoxEvent *event = g_new(IoxEvent, 1);
+    event->id = ris->id;
+    event->data = g_memdup(buf, size);
+    event->size = size;
+
+    replay_add_event(REPLAY_ASYNC_EVENT_IOX, event, NULL, 0);
+}
+
+void replay_event_iox_run(void *opaque)
+{
+    IoxEvent *event = opaque;
+
+    assert(event->id < iox_servers_count);
+
+    if (iox_servers[event->id]) {
+        iox_servers[event->id]->handler(iox_servers[event->id]->opaque,
+                                        event->data, event->size);
+    }
+
+    g_free(event->data);
+    g_free(event);
+}
+
+void replay_event_iox_save(void *opaque)
+{
+    IoxEvent *event = opaque;
+
+    replay_put_byte(event->id);
+    replay_put_array(event->data, event->size);
+}
+
+void *replay_event_iox_load(void)
+{
+    IoxEvent *event = g_new(IoxEvent, 1);
+
+    event->id = replay_get_byte();
+    replay_get_array_alloc(&event->data, &event->size);
+
+    return event;
+}
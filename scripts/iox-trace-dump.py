@@ -0,0 +1,183 @@
+#!/usr/bin/env python3
+#
+# Dump an IOX traffic capture of the isis-obc board as text or pcapng.
+#
+# Copyright (c) 2019-2020 KSat e.V. Stuttgart
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or, at your
+# option, any later version. See the COPYING file in the top-level directory.
+
+"""
+Dump an IOX traffic capture.
+
+Captures are recorded via the iox-trace machine property, e.g.
+
+  qemu-system-arm -M isis-obc,iox-trace=/tmp/iox.trace ...
+
+or at runtime via QMP
+
+  { "execute": "qom-set", "arguments": { "path": "/machine",
+    "property": "iox-trace", "value": "/tmp/iox.trace" } }
+
+See hw/arm/isis_obc/ioxfer-trace.h for the file format.
+
+In pcapng output, each IOX server is represented by an interface named after
+its socket, using link-type USER0 (147). Packets contain the frame header
+(seq, cat, id, reserved, 32-bit little-endian payload length) followed by
+the payload, direction is given via the packet flags.
+"""
+
+import argparse
+import os
+import struct
+import sys
+
+
+TRACE_MAGIC = b'IOXTRACE'
+TRACE_VERSION = 1
+
+REC_SERVER = 0x01
+REC_FRAME = 0x02
+REC_DROPPED = 0x03
+
+FLAG_OUT = 0x01
+
+REC_HDR = struct.Struct('<IBBBxQ')
+FRAME_HDR = struct.Struct('<BBBxI')
+
+LINKTYPE_USER0 = 147
+
+
+class Record:
+    def __init__(self, type, server, flags, time, data):
+        self.type = type
+        self.server = server
+        self.flags = flags
+        self.time = time
+        self.data = data
+
+
+def read_records(file):
+    hdr = file.read(16)
+    if len(hdr) < 16 or hdr[:8] != TRACE_MAGIC:
+        raise ValueError('not an IOX trace')
+
+    version, hdr_len = struct.unpack('<II', hdr[8:])
+    if version != TRACE_VERSION:
+        raise ValueError(f'unsupported trace version {version}')
+
+    file.read(hdr_len - 16)
+
+    while True:
+        hdr = file.read(REC_HDR.size)
+        if len(hdr) < REC_HDR.size:
+            return
+
+        size, type, server, flags, time = REC_HDR.unpack(hdr)
+        data = file.read(size - REC_HDR.size)
+        if len(data) < size - REC_HDR.size:
+            print('warning: trace truncated', file=sys.stderr)
+            return
+
+        yield Record(type, server, flags, time, data)
+
+
+def dump_text(records, out):
+    names = {}
+
+    for rec in records:
+        if rec.type == REC_SERVER:
+            names[rec.server] = os.path.basename(rec.data.decode(errors='replace'))
+
+        elif rec.type == REC_FRAME:
+            seq, cat, id, length = FRAME_HDR.unpack_from(rec.data)
+            payload = rec.data[FRAME_HDR.size:FRAME_HDR.size + length]
+            name = names.get(rec.server, f'server{rec.server}')
+            direction = 'out' if rec.flags & FLAG_OUT else 'in '
+
+            out.write(f'{rec.time / 1e9:16.9f}  {name:<20} {direction} '
+                      f'seq=0x{seq:02x} cat=0x{cat:02x} id=0x{id:02x} '
+                      f'len={length} {payload.hex()}\n')
+
+        elif rec.type == REC_DROPPED:
+            count, = struct.unpack_from('<Q', rec.data)
+            out.write(f'{"":16}  *** {count} records dropped ***\n')
+
+
+def pcapng_block(type, body):
+    body += b'\0' * (-len(body) % 4)
+    length = len(body) + 12
+    return struct.pack('<II', type, length) + body + struct.pack('<I', length)
+
+
+def pcapng_option(code, value):
+    return struct.pack('<HH', code, len(value)) + value + b'\0' * (-len(value) % 4)
+
+
+def dump_pcapng(records, out):
+    interfaces = {}
+    dropped = 0
+
+    # section header block
+    out.write(pcapng_block(0x0A0D0D0A, struct.pack('<IHHq', 0x1A2B3C4D, 1, 0, -1)))
+
+    for rec in records:
+        if rec.type == REC_SERVER:
+            # interface description block: name and nanosecond resolution
+            options = pcapng_option(2, rec.data) + pcapng_option(9, b'\x09') \
+                    + pcapng_option(0, b'')
+
+            interfaces[rec.server] = len(interfaces)
+            out.write(pcapng_block(0x00000001,
+                                   struct.pack('<HHI', LINKTYPE_USER0, 0, 0) + options))
+
+        elif rec.type == REC_FRAME:
+            if rec.server not in interfaces:
+                continue
+
+            # enhanced packet block, flags give direction (1: in, 2: out)
+            flags = 2 if rec.flags & FLAG_OUT else 1
+            options = pcapng_option(2, struct.pack('<I', flags)) + pcapng_option(0, b'')
+            data = rec.data + b'\0' * (-len(rec.data) % 4)
+
+            out.write(pcapng_block(0x00000006,
+                                   struct.pack('<IIIII', interfaces[rec.server],
+                                               rec.time >> 32, rec.time & 0xffffffff,
+                                               len(rec.data), len(rec.data))
+                                   + data + options))
+
+        elif rec.type == REC_DROPPED:
+            dropped += struct.unpack_from('<Q', rec.data)[0]
+
+    if dropped:
+        print(f'warning: {dropped} records have been dropped during capture',
+              file=sys.stderr)
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Dump an IOX traffic capture.')
+    parser.add_argument('trace', help='trace file recorded via iox-trace')
+    parser.add_argument('-f', '--format', choices=['text', 'pcapng'], default='text',
+                        help='output format (default: text)')
+    parser.add_argument('-o', '--output', help='output file (default: stdout)')
+    args = parser.parse_args()
+
+    with open(args.trace, 'rb') as file:
+        records = read_records(file)
+
+        if args.format == 'pcapng':
+            if args.output:
+                with open(args.output, 'wb') as out:
+                    dump_pcapng(records, out)
+            else:
+                dump_pcapng(records, sys.stdout.buffer)
+        else:
+            if args.output:
+                with open(args.output, 'w') as out:
+                    dump_text(records, out)
+            else:
+                dump_text(records, sys.stdout)
+
+
+if __name__ == '__main__':
+    main()
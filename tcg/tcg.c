@@ -799,6 +799,17 @@ void tcg_register_thread(void)
     g_assert(!err);
     qemu_mutex_unlock(&region.lock);
 }
+
+/*
+ * Attach the calling thread to the already registered context @n. This is
+ * used to replace vCPU threads after fork(): The child process inherits all
+ * contexts and their regions, but not the threads they belong to.
+ */
+void tcg_reattach_thread(unsigned int n)
+{
+    g_assert(n < atomic_read(&n_tcg_ctxs));
+    tcg_ctx = atomic_read(&tcg_ctxs[n]);
+}
 #endif /* !CONFIG_USER_ONLY */
 
 /*
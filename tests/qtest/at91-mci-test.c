@@ -0,0 +1,318 @@
+/*
+ * QTest testcase and benchmark for the AT91 MCI PDC path (isis-obc machine)
+ *
+ * Initializes the SD card via the MCI registers and moves data between card
+ * and SDRAM via multi-block PDC transfers, with the block-level PDC path
+ * enabled and disabled (at91-mci.block-io). Data read from and written to
+ * the card is checked against the backing image.
+ *
+ * In perf mode (-m perf), additionally reports read and write throughput of
+ * both paths in MB/s.
+ *
+ * Copyright (c) 2019-2020 KSat e.V. Stuttgart
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or, at your
+ * option, any later version. See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "libqtest.h"
+
+#define MCI_BASE        0xFFFA8000
+#define SDRAM_BASE      0x20000000
+
+#define MCI_CR          0x00
+#define MCI_MR          0x04
+#define MCI_SDCR        0x0C
+#define MCI_ARGR        0x10
+#define MCI_CMDR        0x14
+#define MCI_BLKR        0x18
+#define MCI_RSPR0       0x20
+#define MCI_SR          0x40
+
+#define PDC_RPR         0x100
+#define PDC_RCR         0x104
+#define PDC_TPR         0x108
+#define PDC_TCR         0x10C
+#define PDC_PTCR        0x120
+
+#define PTCR_RXTEN      BIT(0)
+#define PTCR_RXTDIS     BIT(1)
+#define PTCR_TXTEN      BIT(8)
+#define PTCR_TXTDIS     BIT(9)
+
+#define CR_MCIEN        BIT(0)
+#define MR_PDCMODE      BIT(15)
+#define SDCR_SDCBUS     BIT(7)
+
+#define CMDR_RSP_48     (1 << 6)
+#define CMDR_RSP_136    (2 << 6)
+#define CMDR_TR_START   (1 << 16)
+#define CMDR_TR_STOP    (2 << 16)
+#define CMDR_TRDIR      BIT(18)
+#define CMDR_TR_MULTI   (1 << 19)
+
+#define SR_CMDRDY       BIT(0)
+#define SR_NOTBUSY      BIT(5)
+#define SR_ENDRX        BIT(6)
+#define SR_ENDTX        BIT(7)
+
+#define BLKLEN          512
+#define CHUNK           (64 * KiB)      // bytes per multi-block command
+
+#define IMAGE_SIZE      (32 * MiB)
+#define CHECK_SIZE      (1 * MiB)
+#define BENCH_SIZE      (32 * MiB)
+
+
+static char *image_path;
+
+// private IOX socket directory, avoids clashes with other isis-obc instances
+static char *iox_dir;
+
+static void iox_dir_create(void)
+{
+    GError *err = NULL;
+
+    iox_dir = g_dir_make_tmp("at91-mci-test-iox-XXXXXX", &err);
+    g_assert_no_error(err);
+}
+
+static void iox_dir_remove(void)
+{
+    GDir *dir = g_dir_open(iox_dir, 0, NULL);
+    const char *name;
+
+    // sockets are removed by QEMU on exit, clean up what may be left over
+    while (dir && (name = g_dir_read_name(dir))) {
+        g_autofree char *path = g_build_filename(iox_dir, name, NULL);
+        unlink(path);
+    }
+
+    if (dir) {
+        g_dir_close(dir);
+    }
+
+    rmdir(iox_dir);
+    g_free(iox_dir);
+}
+
+
+static uint8_t image_pattern(uint64_t off)
+{
+    return (off * 7 + (off >> 9) * 13) & 0xff;
+}
+
+static void image_create(void)
+{
+    g_autofree uint8_t *buf = g_malloc(IMAGE_SIZE);
+    GError *err = NULL;
+    uint64_t i;
+    int fd;
+
+    for (i = 0; i < IMAGE_SIZE; i++) {
+        buf[i] = image_pattern(i);
+    }
+
+    fd = g_file_open_tmp("at91-mci-test-XXXXXX.img", &image_path, &err);
+    g_assert_no_error(err);
+    g_assert_cmpint(write(fd, buf, IMAGE_SIZE), ==, IMAGE_SIZE);
+    close(fd);
+}
+
+static uint32_t mci_command(QTestState *qts, uint32_t cmdr, uint32_t arg)
+{
+    qtest_writel(qts, MCI_BASE + MCI_ARGR, arg);
+    qtest_writel(qts, MCI_BASE + MCI_CMDR, cmdr);
+    g_assert(qtest_readl(qts, MCI_BASE + MCI_SR) & SR_CMDRDY);
+
+    return (cmdr & CMDR_RSP_48) ? qtest_readl(qts, MCI_BASE + MCI_RSPR0) : 0;
+}
+
+static void mci_wait(QTestState *qts, uint32_t flags)
+{
+    int i;
+
+    // block I/O of PDC transfers completes asynchronously, each register
+    // access lets the main loop of QEMU run
+    for (i = 0; i < 1000000; i++) {
+        if ((qtest_readl(qts, MCI_BASE + MCI_SR) & flags) == flags) {
+            return;
+        }
+    }
+
+    g_assert_not_reached();
+}
+
+static QTestState *mci_init(bool block_io)
+{
+    QTestState *qts;
+    uint32_t rsp;
+    int i;
+
+    qts = qtest_initf("-machine isis-obc,iox-dir=%s -global at91-mci.block-io=%s "
+                      "-drive if=sd,index=0,format=raw,file=%s",
+                      iox_dir, block_io ? "on" : "off", image_path);
+
+    qtest_writel(qts, MCI_BASE + MCI_CR, CR_MCIEN);
+    qtest_writel(qts, MCI_BASE + MCI_MR, MR_PDCMODE | (BLKLEN << 16));
+    qtest_writel(qts, MCI_BASE + MCI_SDCR, SDCR_SDCBUS);
+
+    mci_command(qts, 0, 0);                                     // GO_IDLE
+    mci_command(qts, 8 | CMDR_RSP_48, 0x1AA);                   // SEND_IF_COND
+
+    for (i = 0; i < 100; i++) {
+        mci_command(qts, 55 | CMDR_RSP_48, 0);                  // APP_CMD
+        rsp = mci_command(qts, 41 | CMDR_RSP_48, 0x00FF8000);   // SD_SEND_OP_COND
+        if (rsp & BIT(31)) {
+            break;
+        }
+        qtest_clock_step(qts, 1000000);
+    }
+    g_assert(rsp & BIT(31));
+
+    mci_command(qts, 2 | CMDR_RSP_136, 0);                      // ALL_SEND_CID
+    rsp = mci_command(qts, 3 | CMDR_RSP_48, 0);                 // SEND_RELATIVE_ADDR
+    mci_command(qts, 7 | CMDR_RSP_48, rsp & 0xFFFF0000);        // SELECT_CARD
+    mci_command(qts, 16 | CMDR_RSP_48, BLKLEN);                 // SET_BLOCKLEN
+
+    return qts;
+}
+
+static void mci_read(QTestState *qts, uint64_t off, uint32_t sdram, size_t len)
+{
+    size_t pos;
+
+    for (pos = 0; pos < len; pos += CHUNK) {
+        qtest_writel(qts, MCI_BASE + PDC_RPR, SDRAM_BASE + sdram + pos);
+        qtest_writel(qts, MCI_BASE + PDC_RCR, CHUNK / 4);
+        qtest_writel(qts, MCI_BASE + MCI_BLKR, (BLKLEN << 16) | (CHUNK / BLKLEN));
+        qtest_writel(qts, MCI_BASE + PDC_PTCR, PTCR_RXTEN);
+
+        mci_command(qts, 18 | CMDR_RSP_48 | CMDR_TR_START | CMDR_TRDIR | CMDR_TR_MULTI,
+                    off + pos);                                 // READ_MULTIPLE_BLOCK
+        mci_wait(qts, SR_ENDRX);
+
+        qtest_writel(qts, MCI_BASE + PDC_PTCR, PTCR_RXTDIS);
+        mci_command(qts, 12 | CMDR_RSP_48 | CMDR_TR_STOP, 0);   // STOP_TRANSMISSION
+    }
+}
+
+static void mci_write(QTestState *qts, uint64_t off, uint32_t sdram, size_t len)
+{
+    size_t pos;
+
+    for (pos = 0; pos < len; pos += CHUNK) {
+        qtest_writel(qts, MCI_BASE + PDC_TPR, SDRAM_BASE + sdram + pos);
+        qtest_writel(qts, MCI_BASE + PDC_TCR, CHUNK / 4);
+        qtest_writel(qts, MCI_BASE + MCI_BLKR, (BLKLEN << 16) | (CHUNK / BLKLEN));
+        qtest_writel(qts, MCI_BASE + PDC_PTCR, PTCR_TXTEN);
+
+        mci_command(qts, 25 | CMDR_RSP_48 | CMDR_TR_START | CMDR_TR_MULTI,
+                    off + pos);                                 // WRITE_MULTIPLE_BLOCK
+        mci_wait(qts, SR_ENDTX | SR_NOTBUSY);
+
+        qtest_writel(qts, MCI_BASE + PDC_PTCR, PTCR_TXTDIS);
+        mci_command(qts, 12 | CMDR_RSP_48 | CMDR_TR_STOP, 0);   // STOP_TRANSMISSION
+    }
+}
+
+static void test_read_write(const void *data)
+{
+    bool block_io = GPOINTER_TO_INT(data);
+    g_autofree uint8_t *buf = g_malloc(CHECK_SIZE);
+    QTestState *qts;
+    size_t i;
+
+    qts = mci_init(block_io);
+
+    // read: SDRAM must contain the image pattern
+    mci_read(qts, 0, 0, CHECK_SIZE);
+    qtest_memread(qts, SDRAM_BASE, buf, CHECK_SIZE);
+    for (i = 0; i < CHECK_SIZE; i++) {
+        g_assert_cmphex(buf[i], ==, image_pattern(i));
+    }
+
+    // write inverted data to the second MiB, read it back into fresh SDRAM
+    for (i = 0; i < CHECK_SIZE; i++) {
+        buf[i] = ~image_pattern(CHECK_SIZE + i);
+    }
+    qtest_memwrite(qts, SDRAM_BASE + 2 * CHECK_SIZE, buf, CHECK_SIZE);
+    mci_write(qts, CHECK_SIZE, 2 * CHECK_SIZE, CHECK_SIZE);
+
+    memset(buf, 0, CHECK_SIZE);
+    qtest_memset(qts, SDRAM_BASE + 4 * CHECK_SIZE, 0, CHECK_SIZE);
+    mci_read(qts, CHECK_SIZE, 4 * CHECK_SIZE, CHECK_SIZE);
+    qtest_memread(qts, SDRAM_BASE + 4 * CHECK_SIZE, buf, CHECK_SIZE);
+    for (i = 0; i < CHECK_SIZE; i++) {
+        g_assert_cmphex(buf[i], ==, (uint8_t)~image_pattern(CHECK_SIZE + i));
+    }
+
+    // restore the image for the other tests
+    for (i = 0; i < CHECK_SIZE; i++) {
+        buf[i] = image_pattern(CHECK_SIZE + i);
+    }
+    qtest_memwrite(qts, SDRAM_BASE + 2 * CHECK_SIZE, buf, CHECK_SIZE);
+    mci_write(qts, CHECK_SIZE, 2 * CHECK_SIZE, CHECK_SIZE);
+
+    qtest_quit(qts);
+}
+
+static double bench(QTestState *qts, bool write)
+{
+    g_test_timer_start();
+
+    if (write) {
+        mci_write(qts, 0, 0, BENCH_SIZE);
+    } else {
+        mci_read(qts, 0, 0, BENCH_SIZE);
+    }
+
+    return (double)BENCH_SIZE / MiB / g_test_timer_elapsed();
+}
+
+static void test_bench(void)
+{
+    double rd[2], wr[2];
+    int block_io;
+
+    for (block_io = 0; block_io < 2; block_io++) {
+        QTestState *qts = mci_init(block_io);
+
+        // write back what has been read, keeps the image intact
+        rd[block_io] = bench(qts, false);
+        wr[block_io] = bench(qts, true);
+
+        qtest_quit(qts);
+    }
+
+    g_test_message("PDC read:  %.2f MB/s byte-wise, %.2f MB/s block-io", rd[0], rd[1]);
+    g_test_message("PDC write: %.2f MB/s byte-wise, %.2f MB/s block-io", wr[0], wr[1]);
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+    image_create();
+    iox_dir_create();
+
+    qtest_add_data_func("at91-mci/read_write/bytes", GINT_TO_POINTER(false),
+                        test_read_write);
+    qtest_add_data_func("at91-mci/read_write/blocks", GINT_TO_POINTER(true),
+                        test_read_write);
+
+    if (g_test_perf()) {
+        qtest_add_func("at91-mci/bench", test_bench);
+    }
+
+    ret = g_test_run();
+
+    unlink(image_path);
+    g_free(image_path);
+    iox_dir_remove();
+
+    return ret;
+}
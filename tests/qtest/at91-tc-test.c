@@ -0,0 +1,398 @@
+/*
+ * QTest testcase for the AT91 Timer/Counter (isis-obc machine)
+ *
+ * The counter value of the TC channels is computed lazily from the virtual
+ * clock. This test compares CV and SR against a straightforward per-tick
+ * reference model of the counter, for each of the six channels of both TC
+ * blocks, and for all channels running at the same time.
+ *
+ * Copyright (c) 2019-2020 KSat e.V. Stuttgart
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or, at your
+ * option, any later version. See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/timer.h"
+#include "libqtest-single.h"
+#include "qapi/qmp/qdict.h"
+
+#define TC012_BASE      0xFFFA0000
+#define TC345_BASE      0xFFFDC000
+#define TC_CHAN(n)      ((n) * 0x40)
+#define TC_NUM_CHANS    6
+
+#define TC_CCR          0x00
+#define TC_CMR          0x04
+#define TC_CV           0x10
+#define TC_RA           0x14
+#define TC_RB           0x18
+#define TC_RC           0x1C
+#define TC_SR           0x20
+#define TC_IER          0x24
+#define TC_IDR          0x28
+
+#define CCR_CLKEN       BIT(0)
+#define CCR_SWTRG       BIT(2)
+
+#define CMR_TCCLKS_TC5  4
+#define CMR_CPCTRG      BIT(14)
+#define CMR_CPCSTOP     BIT(6)
+#define CMR_CPCDIS      BIT(7)
+#define CMR_WAVE        BIT(15)
+#define CMR_WAVSEL(x)   (((x) & 0x03) << 13)
+
+#define SR_COVFS        BIT(0)
+#define SR_CPAS         BIT(2)
+#define SR_CPBS         BIT(3)
+#define SR_CPCS         BIT(4)
+#define SR_CLKSTA       BIT(16)
+
+#define SR_FLAGS        0xff
+
+#define SLCK            32768
+
+
+typedef struct {
+    uint32_t base;
+
+    uint32_t cmr;
+    uint32_t ra;
+    uint32_t rb;
+    uint32_t rc;
+
+    uint32_t cv;
+    uint32_t sr;
+    int cstep;
+    bool running;
+
+    int64_t start_ns;
+    uint64_t ticks;
+} RefChan;
+
+
+// private IOX socket directory, avoids clashes with other isis-obc instances
+static char *iox_dir;
+
+static void iox_dir_create(void)
+{
+    GError *err = NULL;
+
+    iox_dir = g_dir_make_tmp("at91-tc-test-iox-XXXXXX", &err);
+    g_assert_no_error(err);
+}
+
+static void iox_dir_remove(void)
+{
+    GDir *dir = g_dir_open(iox_dir, 0, NULL);
+    const char *name;
+
+    // sockets are removed by QEMU on exit, clean up what may be left over
+    while (dir && (name = g_dir_read_name(dir))) {
+        g_autofree char *path = g_build_filename(iox_dir, name, NULL);
+        unlink(path);
+    }
+
+    if (dir) {
+        g_dir_close(dir);
+    }
+
+    rmdir(iox_dir);
+    g_free(iox_dir);
+}
+
+static uint64_t ref_ticks_at(RefChan *r, int64_t now)
+{
+    return muldiv64(now - r->start_ns, SLCK, NANOSECONDS_PER_SECOND);
+}
+
+static void ref_tick(RefChan *r)
+{
+    if (r->cv == 0xffff) {
+        r->sr |= SR_COVFS;
+    }
+
+    if (r->cmr & CMR_WAVE) {
+        uint32_t wavsel = (r->cmr >> 13) & 0x03;
+        uint32_t cmp = (wavsel & 0x02) ? r->rc : 0xffff;
+
+        if (!(wavsel & 0x01)) {
+            r->cv = r->cv == cmp ? 0 : (r->cv + 1) & 0xffff;
+        } else {
+            if (r->cv == cmp) {
+                r->cstep = -1;
+            } else if (r->cv == 0) {
+                r->cstep = 1;
+            }
+            r->cv = (r->cv + r->cstep) & 0xffff;
+        }
+
+        if (r->cv == r->ra) {
+            r->sr |= SR_CPAS;
+        }
+        if (r->cv == r->rb) {
+            r->sr |= SR_CPBS;
+        }
+        if (r->cv == r->rc) {
+            r->sr |= SR_CPCS;
+
+            if (r->cmr & CMR_CPCDIS) {
+                r->sr &= ~SR_CLKSTA;
+                r->running = false;
+            }
+            if (r->cmr & CMR_CPCSTOP) {
+                r->running = false;
+            }
+        }
+
+    } else {
+        r->cv = (r->cv + 1) & 0xffff;
+
+        if (r->cv == r->rc) {
+            r->sr |= SR_CPCS;
+
+            if (r->cmr & CMR_CPCTRG) {
+                r->cv = 0;
+            }
+        }
+    }
+}
+
+static void ref_advance(RefChan *r, int64_t now)
+{
+    uint64_t target = ref_ticks_at(r, now);
+
+    for (; r->ticks < target && r->running; r->ticks++) {
+        ref_tick(r);
+    }
+    r->ticks = target;
+}
+
+static uint32_t tc_chan_base(int n)
+{
+    return (n < 3 ? TC012_BASE : TC345_BASE) + TC_CHAN(n % 3);
+}
+
+static void tc_reset(void)
+{
+    // start from a known counter state (CV = 0, counting up)
+    qobject_unref(qmp("{ 'execute': 'system_reset' }"));
+    qmp_eventwait("RESET");
+}
+
+static void tc_setup(RefChan *r, uint32_t base, uint32_t cmr, uint32_t ra,
+                     uint32_t rb, uint32_t rc)
+{
+    bool triangle = (cmr & CMR_WAVE) && (cmr & CMR_WAVSEL(1));
+
+    writel(base + TC_CMR, cmr);
+    if (cmr & CMR_WAVE) {
+        writel(base + TC_RA, ra);
+        writel(base + TC_RB, rb);
+    }
+    writel(base + TC_RC, rc);
+    writel(base + TC_CCR, CCR_CLKEN | CCR_SWTRG);
+
+    *r = (RefChan) {
+        .base = base,
+        .cmr = cmr, .ra = ra, .rb = rb, .rc = rc,
+        .cv = 0, .sr = SR_CLKSTA, .running = true,
+        // a software trigger reverses the direction in up/down mode
+        .cstep = triangle ? -1 : 1,
+        .start_ns = clock_step(0), .ticks = 0,
+    };
+}
+
+static void tc_start(RefChan *r, uint32_t base, uint32_t cmr, uint32_t ra,
+                     uint32_t rb, uint32_t rc)
+{
+    tc_reset();
+    tc_setup(r, base, cmr, ra, rb, rc);
+}
+
+static void tc_compare(RefChan *r)
+{
+    uint32_t cv = readl(r->base + TC_CV);
+    uint32_t sr = readl(r->base + TC_SR);
+
+    g_assert_cmphex(cv, ==, r->cv);
+    g_assert_cmphex(sr & (SR_FLAGS | SR_CLKSTA), ==, r->sr);
+
+    r->sr &= ~SR_FLAGS;
+}
+
+static void tc_check(RefChan *r, int n, int64_t step)
+{
+    int64_t now = clock_step(step);
+
+    for (int i = 0; i < n; i++) {
+        ref_advance(&r[i], now);
+        tc_compare(&r[i]);
+    }
+}
+
+static void tc_check_steps_n(RefChan *r, int n)
+{
+    static const int64_t steps[] = {
+        1, 30000, 30518, 61035, 1000000, 3333333, 100000000,
+        NANOSECONDS_PER_SECOND, 7 * NANOSECONDS_PER_SECOND + 12345, 17,
+    };
+
+    for (int i = 0; i < ARRAY_SIZE(steps); i++) {
+        tc_check(r, n, steps[i]);
+    }
+}
+
+static void tc_check_steps(RefChan *r)
+{
+    tc_check_steps_n(r, 1);
+}
+
+static void test_wave_up(const void *data)
+{
+    uint32_t base = GPOINTER_TO_UINT(data);
+    RefChan r;
+
+    tc_start(&r, base, CMR_TCCLKS_TC5 | CMR_WAVE | CMR_WAVSEL(0), 100, 20000, 0);
+    tc_check_steps(&r);
+}
+
+static void test_wave_up_rc(const void *data)
+{
+    uint32_t base = GPOINTER_TO_UINT(data);
+    RefChan r;
+
+    tc_start(&r, base, CMR_TCCLKS_TC5 | CMR_WAVE | CMR_WAVSEL(2), 3, 500, 1000);
+    tc_check_steps(&r);
+}
+
+static void test_wave_updown(const void *data)
+{
+    uint32_t base = GPOINTER_TO_UINT(data);
+    RefChan r;
+
+    tc_start(&r, base, CMR_TCCLKS_TC5 | CMR_WAVE | CMR_WAVSEL(1), 0, 40000, 7);
+    tc_check_steps(&r);
+}
+
+static void test_wave_updown_rc(const void *data)
+{
+    uint32_t base = GPOINTER_TO_UINT(data);
+    RefChan r;
+
+    tc_start(&r, base, CMR_TCCLKS_TC5 | CMR_WAVE | CMR_WAVSEL(3), 10, 1500, 2000);
+    tc_check_steps(&r);
+}
+
+static void test_wave_cpcstop(const void *data)
+{
+    uint32_t base = GPOINTER_TO_UINT(data);
+    RefChan r;
+
+    tc_start(&r, base, CMR_TCCLKS_TC5 | CMR_WAVE | CMR_WAVSEL(2) | CMR_CPCSTOP,
+             1, 2, 300);
+    tc_check_steps(&r);
+
+    tc_start(&r, base, CMR_TCCLKS_TC5 | CMR_WAVE | CMR_WAVSEL(0) | CMR_CPCDIS,
+             1, 2, 300);
+    tc_check_steps(&r);
+}
+
+static void test_capture(const void *data)
+{
+    uint32_t base = GPOINTER_TO_UINT(data);
+    RefChan r;
+
+    tc_start(&r, base, CMR_TCCLKS_TC5, 0, 0, 5000);
+    tc_check_steps(&r);
+
+    tc_start(&r, base, CMR_TCCLKS_TC5 | CMR_CPCTRG, 0, 0, 5000);
+    tc_check_steps(&r);
+}
+
+static void test_irq_deadline(const void *data)
+{
+    uint32_t base = GPOINTER_TO_UINT(data);
+    RefChan r;
+    int seen = 0;
+
+    tc_start(&r, base, CMR_TCCLKS_TC5 | CMR_WAVE | CMR_WAVSEL(2), 0, 0, 99);
+    writel(base + TC_IER, SR_CPCS);
+
+    // step from deadline to deadline: the TC must never let us skip past a
+    // compare match, and must wake us (almost) exactly on it
+    while (seen < 5) {
+        int64_t now = clock_step_next();
+        RefChan prev = r;
+        uint32_t sr;
+
+        ref_advance(&prev, now - 2);
+        ref_advance(&r, now);
+        sr = readl(base + TC_SR);
+
+        g_assert_cmphex(readl(base + TC_CV), ==, r.cv);
+        g_assert_cmphex(sr & (SR_FLAGS | SR_CLKSTA), ==, r.sr);
+
+        if (sr & SR_CPCS) {
+            g_assert_false(prev.sr & SR_CPCS);
+            seen++;
+        }
+
+        r.sr &= ~SR_FLAGS;
+    }
+
+    writel(base + TC_IDR, SR_CPCS);
+}
+
+static void test_all_channels(void)
+{
+    RefChan r[TC_NUM_CHANS];
+
+    // different modes and compare values on all channels at once, each
+    // channel must keep its own state
+    tc_reset();
+    for (int i = 0; i < TC_NUM_CHANS; i++) {
+        uint32_t cmr = CMR_TCCLKS_TC5 | CMR_WAVE | CMR_WAVSEL(i % 4);
+
+        tc_setup(&r[i], tc_chan_base(i), cmr, 10 + i, 300 + 7 * i, 1000 + 113 * i);
+    }
+
+    tc_check_steps_n(r, TC_NUM_CHANS);
+}
+
+static void add_chan_test(const char *name, int chan, GTestDataFunc fn)
+{
+    g_autofree char *path = g_strdup_printf("at91-tc/tc%d/%s", chan, name);
+
+    qtest_add_data_func(path, GUINT_TO_POINTER(tc_chan_base(chan)), fn);
+}
+
+int main(int argc, char **argv)
+{
+    g_autofree char *args = NULL;
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (int i = 0; i < TC_NUM_CHANS; i++) {
+        add_chan_test("wave_up", i, test_wave_up);
+        add_chan_test("wave_up_rc", i, test_wave_up_rc);
+        add_chan_test("wave_updown", i, test_wave_updown);
+        add_chan_test("wave_updown_rc", i, test_wave_updown_rc);
+        add_chan_test("wave_cpcstop", i, test_wave_cpcstop);
+        add_chan_test("capture", i, test_capture);
+        add_chan_test("irq_deadline", i, test_irq_deadline);
+    }
+    qtest_add_func("at91-tc/all_channels", test_all_channels);
+
+    iox_dir_create();
+    args = g_strdup_printf("-machine isis-obc,iox-dir=%s", iox_dir);
+
+    qtest_start(args);
+    ret = g_test_run();
+    qtest_end();
+
+    iox_dir_remove();
+
+    return ret;
+}